@@ -0,0 +1,766 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <err.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+This is an offline analyzer for the frame captures written by nRF_capture_frames(). Captures are memory-mapped and a sidecar index (<capture>.idx, built on first use and rebuilt when the capture changes) allows to answer queries by simulated time and address without reading the whole file again.
+
+Please read the fine manual.
+
+(c) 2022 by kittennbfive
+
+AGPLv3+ and NO WARRANTY!
+*/
+
+#define NB_FILES_MAX 16
+#define SZ_MODULE 32
+#define NB_LINKS_MAX 256
+#define NB_DIFFS_SHOWN 20
+
+#define INDEX_MAGIC "NRFCIDX1"
+
+#define ADDRESS_ANY UINT64_MAX
+
+typedef enum
+{
+	KIND_UNKNOWN=0, //capture written before TX and ACK were marked
+	KIND_TX,
+	KIND_ACK
+} kind_t;
+
+typedef struct
+{
+	uint64_t offset; //of the line in the capture
+	uint64_t address;
+	uint64_t time_us;
+	uint32_t payload_hash; //FNV-1a, to recognize retransmissions
+	uint16_t nb_bits;
+	uint8_t kind; //kind_t
+	uint8_t bytes_addr;
+	uint8_t bytes_crc;
+	uint8_t PID;
+	uint8_t nb_bytes;
+	uint8_t crc_ok;
+} record_t;
+
+typedef struct
+{
+	char magic[8];
+	uint64_t capture_size;
+	int64_t capture_mtime_sec;
+	int64_t capture_mtime_nsec;
+	uint64_t nb_records;
+	char module[SZ_MODULE];
+} index_header_t; //followed by the records in time order and by the record numbers sorted by address and time
+
+typedef struct
+{
+	char const * filename;
+	char const * data; //the capture
+	size_t size;
+	void * index;
+	size_t index_size;
+	index_header_t const * header;
+	record_t const * records;
+	uint32_t const * by_address;
+} capture_t;
+
+typedef struct
+{
+	uint64_t from_us;
+	uint64_t to_us; //exclusive
+	uint64_t address; //ADDRESS_ANY
+	char const * module; //NULL: any
+	uint32_t min_burst;
+} filter_t;
+
+typedef struct
+{
+	uint8_t file;
+	uint64_t address;
+	uint8_t bytes_addr;
+	uint64_t first_us;
+	uint64_t last_us;
+	uint32_t nb_frames;
+	uint32_t nb_packets; //new PID or payload
+	uint64_t payload_bytes; //of new packets only
+	uint32_t nb_acks; //ACK-frames with this address in any of the captures
+	uint32_t nb_crc_errors;
+
+	//current packet, for retry bursts
+	uint8_t PID;
+	uint32_t payload_hash;
+	uint64_t burst_start_us;
+	uint32_t burst_frames;
+} link_t;
+
+static capture_t captures[NB_FILES_MAX];
+static uint8_t nb_captures=0;
+
+static record_t const * sort_records; //for qsort() of the address index
+
+//Enhanced ShockBurst frame, see build_frame() in nRF.c
+
+static uint8_t frame_get_byte(uint8_t const * const frame, const uint16_t pos)
+{
+	uint8_t shift=pos&7;
+
+	if(shift)
+		return (frame[pos>>3]<<shift)|(frame[(pos>>3)+1]>>(8-shift));
+	else
+		return frame[pos>>3];
+}
+
+static uint16_t frame_crc(uint8_t const * const frame, const uint16_t nb_bits, const uint8_t bytes_crc) //bitwise, speed doesn't matter here
+{
+	uint16_t crc=(bytes_crc==2)?0xffff:0xff;
+	const uint16_t top=(bytes_crc==2)?0x8000:0x80;
+	const uint16_t poly=(bytes_crc==2)?0x1021:0x07;
+	uint16_t i;
+
+	for(i=0; i<nb_bits; i++)
+	{
+		if((frame[1+(i>>3)]>>(7-(i&7)))&1)
+			crc^=top;
+		crc=(crc&top)?((crc<<1)^poly):(crc<<1);
+	}
+
+	return (bytes_crc==2)?crc:(crc&0xff);
+}
+
+static bool decode_frame(record_t * const rec, uint8_t const * const frame)
+{
+	//without AW and CRC in the line (old capture) every combination matching the length is tried, the one with a valid CRC wins
+	uint8_t aw_first=rec->bytes_addr?rec->bytes_addr:3, aw_last=rec->bytes_addr?rec->bytes_addr:5;
+	uint8_t crc_first=rec->bytes_crc?rec->bytes_crc:1, crc_last=rec->bytes_crc?rec->bytes_crc:2;
+	bool found=false;
+	uint8_t aw, crc;
+
+	for(aw=aw_first; aw<=aw_last; aw++)
+	{
+		for(crc=crc_first; crc<=crc_last; crc++)
+		{
+			const uint16_t pos_pcf=8+8*aw;
+			if(pos_pcf+9>rec->nb_bits)
+				continue;
+
+			const uint8_t nb_bytes=frame_get_byte(frame, pos_pcf)>>2;
+			if(nb_bytes>32 || rec->nb_bits!=pos_pcf+9+8*nb_bytes+8*crc)
+				continue;
+
+			const uint16_t nb_bits_crc=rec->nb_bits-8-8*crc;
+			const uint16_t crc_frame=(crc==2)?((frame_get_byte(frame, 8+nb_bits_crc)<<8)|frame_get_byte(frame, 16+nb_bits_crc)):frame_get_byte(frame, 8+nb_bits_crc);
+			const bool crc_ok=(frame_crc(frame, nb_bits_crc, crc)==crc_frame);
+			if(found && !crc_ok)
+				continue;
+
+			rec->bytes_addr=aw;
+			rec->bytes_crc=crc;
+			rec->nb_bytes=nb_bytes;
+			rec->PID=frame_get_byte(frame, pos_pcf)&3;
+			rec->crc_ok=crc_ok;
+
+			rec->address=0;
+			uint8_t i;
+			for(i=0; i<aw; i++)
+				rec->address=(rec->address<<8)|frame[1+i];
+
+			uint32_t hash=2166136261u;
+			for(i=0; i<nb_bytes; i++)
+			{
+				hash^=frame_get_byte(frame, pos_pcf+9+8*i);
+				hash*=16777619u;
+			}
+			rec->payload_hash=hash;
+
+			found=true;
+			if(crc_ok)
+				return true;
+		}
+	}
+
+	return found;
+}
+
+//capture lines look like "[    12.345ms] TX  AW5 CRC2  97 bits: 55 e7 ..."
+
+static char const * parse_uint(char const * p, char const * const end, uint64_t * const value)
+{
+	*value=0;
+	while(p<end && *p==' ')
+		p++;
+	if(p==end || *p<'0' || *p>'9')
+		return NULL;
+	while(p<end && *p>='0' && *p<='9')
+		*value=*value*10+(*p++-'0');
+	return p;
+}
+
+static bool parse_line(char const * p, char const * const end, record_t * const rec)
+{
+	uint64_t ms, frac, value;
+	memset(rec, 0, sizeof(record_t));
+
+	if(*p++!='[' || !(p=parse_uint(p, end, &ms)) || *p++!='.' || !(p=parse_uint(p, end, &frac)))
+		return false;
+	rec->time_us=ms*1000+frac; //3 decimals
+
+	if(end-p<4 || memcmp(p, "ms] ", 4))
+		return false;
+	p+=4;
+
+	if(end-p>=3 && !memcmp(p, "TX ", 3))
+		rec->kind=KIND_TX;
+	else if(end-p>=4 && !memcmp(p, "ACK ", 4))
+		rec->kind=KIND_ACK;
+
+	if(rec->kind!=KIND_UNKNOWN)
+	{
+		while(p<end && *p!='W')
+			p++;
+		if(!(p=parse_uint(p+1, end, &value)))
+			return false;
+		rec->bytes_addr=value;
+		if(end-p<4 || memcmp(p, " CRC", 4) || !(p=parse_uint(p+4, end, &value)))
+			return false;
+		rec->bytes_crc=value;
+	}
+
+	if(!(p=parse_uint(p, end, &value)) || value<8 || value>8*40)
+		return false;
+	rec->nb_bits=value;
+	if(end-p<6 || memcmp(p, " bits:", 6))
+		return false;
+	p+=6;
+
+	uint8_t frame[41]={0};
+	uint16_t i;
+	for(i=0; i<(rec->nb_bits+7)/8; i++)
+	{
+		if(end-p<3)
+			return false;
+		char hex[3]={p[1], p[2], '\0'};
+		frame[i]=strtoul(hex, NULL, 16);
+		p+=3;
+	}
+
+	return decode_frame(rec, frame);
+}
+
+static void * map_file(char const * const filename, size_t * const size, struct stat * const st)
+{
+	int fd=open(filename, O_RDONLY);
+	if(fd<0)
+		err(1, "opening %s failed", filename);
+	if(fstat(fd, st))
+		err(1, "stat %s failed", filename);
+
+	*size=st->st_size;
+	void * data=NULL;
+	if(*size)
+	{
+		data=mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(data==MAP_FAILED)
+			err(1, "mmap %s failed", filename);
+		madvise(data, *size, MADV_SEQUENTIAL);
+	}
+	close(fd);
+
+	return data;
+}
+
+static int compare_by_address(const void * a, const void * b)
+{
+	record_t const * const r1=&sort_records[*(uint32_t const*)a];
+	record_t const * const r2=&sort_records[*(uint32_t const*)b];
+
+	if(r1->address!=r2->address)
+		return (r1->address<r2->address)?-1:1;
+	if(r1->time_us!=r2->time_us)
+		return (r1->time_us<r2->time_us)?-1:1;
+	return (*(uint32_t const*)a<*(uint32_t const*)b)?-1:1;
+}
+
+static void build_index(capture_t * const cap, char const * const index_name, struct stat const * const st)
+{
+	//first pass only counts the lines so the index can be written directly into a mapping of its file
+	uint64_t nb_lines=0;
+	char const * p=cap->data;
+	char const * const end=cap->data+cap->size;
+	while(p<end && (p=memchr(p, '\n', end-p)))
+	{
+		nb_lines++;
+		p++;
+	}
+
+	int fd=open(index_name, O_RDWR|O_CREAT|O_TRUNC, 0644);
+	if(fd<0)
+		err(1, "creating index %s failed", index_name);
+
+	const size_t max_size=sizeof(index_header_t)+nb_lines*(sizeof(record_t)+sizeof(uint32_t));
+	if(ftruncate(fd, max_size))
+		err(1, "ftruncate %s failed", index_name);
+
+	uint8_t * index=mmap(NULL, max_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if(index==MAP_FAILED)
+		err(1, "mmap %s failed", index_name);
+
+	index_header_t * const header=(index_header_t*)index;
+	record_t * const records=(record_t*)(index+sizeof(index_header_t));
+	memset(header, 0, sizeof(index_header_t));
+	strcpy(header->module, "?");
+
+	uint64_t nb_records=0;
+	uint64_t nb_invalid=0;
+	for(p=cap->data; p<end; )
+	{
+		char const * eol=memchr(p, '\n', end-p);
+		if(!eol)
+			eol=end;
+
+		if(eol-p>22 && !strncmp(p, "FRAME CAPTURE FOR nRF ", 22) && eol-p-22<SZ_MODULE)
+		{
+			memset(header->module, 0, SZ_MODULE);
+			memcpy(header->module, p+22, eol-p-22);
+		}
+		else if(eol>p)
+		{
+			if(parse_line(p, eol, &records[nb_records]))
+			{
+				records[nb_records].offset=p-cap->data;
+				nb_records++;
+			}
+			else
+				nb_invalid++;
+		}
+
+		p=eol+1;
+	}
+
+	if(nb_invalid)
+		fprintf(stderr, "%s: %lu lines could not be decoded\n", cap->filename, (unsigned long)nb_invalid);
+
+	//address index, written right after the records
+	uint32_t * const by_address=(uint32_t*)(records+nb_records);
+	uint64_t i;
+	for(i=0; i<nb_records; i++)
+		by_address[i]=i;
+	sort_records=records;
+	qsort(by_address, nb_records, sizeof(uint32_t), &compare_by_address);
+
+	memcpy(header->magic, INDEX_MAGIC, 8);
+	header->capture_size=st->st_size;
+	header->capture_mtime_sec=st->st_mtim.tv_sec;
+	header->capture_mtime_nsec=st->st_mtim.tv_nsec;
+	header->nb_records=nb_records;
+
+	munmap(index, max_size);
+	if(ftruncate(fd, sizeof(index_header_t)+nb_records*(sizeof(record_t)+sizeof(uint32_t))))
+		err(1, "ftruncate %s failed", index_name);
+	close(fd);
+
+	fprintf(stderr, "%s: indexed %lu frames\n", cap->filename, (unsigned long)nb_records);
+}
+
+static bool index_valid(char const * const index_name, struct stat const * const st)
+{
+	FILE * f=fopen(index_name, "rb");
+	if(!f)
+		return false;
+
+	index_header_t header;
+	bool valid=(fread(&header, sizeof(header), 1, f)==1 && !memcmp(header.magic, INDEX_MAGIC, 8) && header.capture_size==(uint64_t)st->st_size \
+			&& header.capture_mtime_sec==st->st_mtim.tv_sec && header.capture_mtime_nsec==st->st_mtim.tv_nsec);
+	fclose(f);
+
+	return valid;
+}
+
+static void open_capture(char const * const filename)
+{
+	if(nb_captures==NB_FILES_MAX)
+		errx(1, "too many captures, increase NB_FILES_MAX");
+
+	capture_t * const cap=&captures[nb_captures++];
+	cap->filename=filename;
+
+	struct stat st;
+	cap->data=map_file(filename, &cap->size, &st);
+
+	char index_name[4096];
+	snprintf(index_name, sizeof(index_name), "%s.idx", filename);
+
+	if(!index_valid(index_name, &st))
+		build_index(cap, index_name, &st);
+
+	struct stat st_index;
+	cap->index=map_file(index_name, &cap->index_size, &st_index);
+	cap->header=cap->index;
+	cap->records=(record_t const*)((uint8_t const*)cap->index+sizeof(index_header_t));
+	cap->by_address=(uint32_t const*)(cap->records+cap->header->nb_records);
+	madvise(cap->index, cap->index_size, MADV_RANDOM);
+}
+
+//cursor over the frames of one capture matching a filter, using the address index if an address is given
+
+typedef struct
+{
+	capture_t const * cap;
+	uint64_t pos; //in records[] or by_address[]
+	bool use_address;
+} cursor_t;
+
+static record_t const * cursor_record(cursor_t const * const cur, filter_t const * const filter)
+{
+	const uint64_t nb=cur->cap->header->nb_records;
+	if(cur->pos>=nb)
+		return NULL;
+
+	record_t const * const rec=&cur->cap->records[cur->use_address?cur->cap->by_address[cur->pos]:cur->pos];
+	if(rec->time_us>=filter->to_us || (cur->use_address && rec->address!=filter->address))
+		return NULL;
+
+	return rec;
+}
+
+static void cursor_start(cursor_t * const cur, capture_t const * const cap, filter_t const * const filter)
+{
+	cur->cap=cap;
+	cur->use_address=(filter->address!=ADDRESS_ANY);
+
+	//binary search for the first record at or after from_us (for this address)
+	uint64_t lo=0, hi=cap->header->nb_records;
+	while(lo<hi)
+	{
+		const uint64_t mid=lo+(hi-lo)/2;
+		record_t const * rec;
+		bool before;
+		if(cur->use_address)
+		{
+			rec=&cap->records[cap->by_address[mid]];
+			before=(rec->address<filter->address || (rec->address==filter->address && rec->time_us<filter->from_us));
+		}
+		else
+		{
+			rec=&cap->records[mid];
+			before=(rec->time_us<filter->from_us);
+		}
+
+		if(before)
+			lo=mid+1;
+		else
+			hi=mid;
+	}
+	cur->pos=lo;
+
+	if(filter->module && strcmp(filter->module, cap->header->module))
+		cur->pos=cap->header->nb_records; //nothing from this capture
+}
+
+static record_t const * next_record(cursor_t * const cursors, filter_t const * const filter, uint8_t * const file)
+{
+	//merge of all captures in time order
+	record_t const * best=NULL;
+	uint8_t i;
+	for(i=0; i<nb_captures; i++)
+	{
+		record_t const * const rec=cursor_record(&cursors[i], filter);
+		if(rec && (!best || rec->time_us<best->time_us))
+		{
+			best=rec;
+			*file=i;
+		}
+	}
+
+	if(best)
+		cursors[*file].pos++;
+
+	return best;
+}
+
+static void start_all(cursor_t * const cursors, filter_t const * const filter)
+{
+	uint8_t i;
+	for(i=0; i<nb_captures; i++)
+		cursor_start(&cursors[i], &captures[i], filter);
+}
+
+static char const * kind_name(const uint8_t kind)
+{
+	return (kind==KIND_TX)?"TX":((kind==KIND_ACK)?"ACK":"?");
+}
+
+static void print_address(const uint64_t address, const uint8_t bytes_addr)
+{
+	printf("0x%0*lx", 2*bytes_addr, (unsigned long)address);
+}
+
+static void cmd_frames(filter_t const * const filter)
+{
+	cursor_t cursors[NB_FILES_MAX];
+	start_all(cursors, filter);
+
+	uint64_t nb=0;
+	uint8_t file;
+	record_t const * rec;
+	while((rec=next_record(cursors, filter, &file)))
+	{
+		printf("%12.3fms %-*s %-3s ", rec->time_us/1E3, SZ_MODULE/2, captures[file].header->module, kind_name(rec->kind));
+		print_address(rec->address, rec->bytes_addr);
+		printf(" PID %u %2u bytes%s\n", rec->PID, rec->nb_bytes, rec->crc_ok?"":" CRC error");
+		nb++;
+	}
+
+	printf("%lu frames\n", (unsigned long)nb);
+}
+
+static link_t * find_link(link_t * const links, uint16_t * const nb_links, const uint8_t file, const uint64_t address)
+{
+	uint16_t i;
+	for(i=0; i<*nb_links; i++)
+	{
+		if(links[i].file==file && links[i].address==address)
+			return &links[i];
+	}
+
+	if(*nb_links==NB_LINKS_MAX)
+		errx(1, "too many links, increase NB_LINKS_MAX");
+
+	link_t * const link=&links[(*nb_links)++];
+	memset(link, 0, sizeof(link_t));
+	link->file=file;
+	link->address=address;
+	link->PID=0xff;
+
+	return link;
+}
+
+static void print_burst(link_t const * const link, filter_t const * const filter)
+{
+	if(link->burst_frames<filter->min_burst)
+		return;
+
+	printf("%12.3fms %-*s ", link->burst_start_us/1E3, SZ_MODULE/2, captures[link->file].header->module);
+	print_address(link->address, link->bytes_addr);
+	printf(" PID %u sent %u times in %.3fms\n", link->PID, link->burst_frames, (link->last_us-link->burst_start_us)/1E3);
+}
+
+static void scan_links(filter_t const * const filter, link_t * const links, uint16_t * const nb_links, const bool bursts)
+{
+	//a link is a PTX (capture) and the address it sends to, a packet sent again with the same PID and payload is a retransmission
+	cursor_t cursors[NB_FILES_MAX];
+	start_all(cursors, filter);
+
+	uint8_t file;
+	record_t const * rec;
+	while((rec=next_record(cursors, filter, &file)))
+	{
+		if(rec->kind==KIND_ACK)
+		{
+			uint16_t i;
+			for(i=0; i<*nb_links; i++)
+			{
+				if(links[i].address==rec->address)
+					links[i].nb_acks++;
+			}
+			continue;
+		}
+
+		link_t * const link=find_link(links, nb_links, file, rec->address);
+		if(!link->nb_frames)
+			link->first_us=rec->time_us;
+		link->bytes_addr=rec->bytes_addr;
+		link->nb_frames++;
+		if(!rec->crc_ok)
+			link->nb_crc_errors++;
+
+		if(rec->PID!=link->PID || rec->payload_hash!=link->payload_hash)
+		{
+			if(bursts && link->burst_frames)
+				print_burst(link, filter);
+
+			link->PID=rec->PID;
+			link->payload_hash=rec->payload_hash;
+			link->burst_start_us=rec->time_us;
+			link->burst_frames=0;
+			link->nb_packets++;
+			link->payload_bytes+=rec->nb_bytes;
+		}
+
+		link->burst_frames++;
+		link->last_us=rec->time_us;
+	}
+
+	if(bursts)
+	{
+		uint16_t i;
+		for(i=0; i<*nb_links; i++)
+			print_burst(&links[i], filter);
+	}
+}
+
+static void cmd_goodput(filter_t const * const filter)
+{
+	static link_t links[NB_LINKS_MAX];
+	uint16_t nb_links=0;
+
+	scan_links(filter, links, &nb_links, false);
+
+	printf("PTX;address;first_ms;last_ms;frames;packets;retransmissions;ACKs;CRC_errors;payload_bytes;goodput_kbps\n");
+
+	uint16_t i;
+	for(i=0; i<nb_links; i++)
+	{
+		link_t const * const link=&links[i];
+		const double span_s=(link->last_us-link->first_us)/1E6;
+		printf("%s;", captures[link->file].header->module);
+		print_address(link->address, link->bytes_addr);
+		printf(";%.3f;%.3f;%u;%u;%u;%u;%u;%lu;%.3f\n", link->first_us/1E3, link->last_us/1E3, link->nb_frames, link->nb_packets, link->nb_frames-link->nb_packets, \
+				link->nb_acks, link->nb_crc_errors, (unsigned long)link->payload_bytes, span_s>0?link->payload_bytes*8/span_s/1E3:0);
+	}
+}
+
+static void cmd_bursts(filter_t const * const filter)
+{
+	static link_t links[NB_LINKS_MAX];
+	uint16_t nb_links=0;
+
+	scan_links(filter, links, &nb_links, true);
+}
+
+static bool same_frame(capture_t const * const a, record_t const * const ra, capture_t const * const b, record_t const * const rb)
+{
+	if(ra->time_us!=rb->time_us || ra->kind!=rb->kind || ra->nb_bits!=rb->nb_bits)
+		return false;
+
+	//the bitstream is compared in the captures themselves, only these pages are touched
+	char const * const la=memchr(a->data+ra->offset, ':', a->size-ra->offset);
+	char const * const lb=memchr(b->data+rb->offset, ':', b->size-rb->offset);
+	return la && lb && !memcmp(la, lb, 3*((ra->nb_bits+7)/8));
+}
+
+static void print_frame(char const * const prefix, capture_t const * const cap, record_t const * const rec)
+{
+	char const * const line=cap->data+rec->offset;
+	char const * const eol=memchr(line, '\n', cap->size-rec->offset);
+	printf("%s %.*s\n", prefix, (int)((eol?eol:cap->data+cap->size)-line), line);
+}
+
+static int cmd_diff(filter_t const * const filter)
+{
+	//both captures are walked in time order, frames at the same time are compared, a frame at a time missing in the other capture is reported alone
+	capture_t const * const a=&captures[0];
+	capture_t const * const b=&captures[1];
+
+	cursor_t ca, cb;
+	cursor_start(&ca, a, filter);
+	cursor_start(&cb, b, filter);
+
+	uint64_t nb_same=0, nb_changed=0, nb_only_a=0, nb_only_b=0;
+	uint32_t nb_shown=0;
+	record_t const * ra=cursor_record(&ca, filter);
+	record_t const * rb=cursor_record(&cb, filter);
+
+	while(ra || rb)
+	{
+		if(ra && rb && ra->time_us==rb->time_us)
+		{
+			if(same_frame(a, ra, b, rb))
+				nb_same++;
+			else
+			{
+				nb_changed++;
+				if(nb_shown++<NB_DIFFS_SHOWN)
+				{
+					print_frame("-", a, ra);
+					print_frame("+", b, rb);
+				}
+			}
+			ca.pos++;
+			cb.pos++;
+		}
+		else if(ra && (!rb || ra->time_us<rb->time_us))
+		{
+			nb_only_a++;
+			if(nb_shown++<NB_DIFFS_SHOWN)
+				print_frame("-", a, ra);
+			ca.pos++;
+		}
+		else
+		{
+			nb_only_b++;
+			if(nb_shown++<NB_DIFFS_SHOWN)
+				print_frame("+", b, rb);
+			cb.pos++;
+		}
+
+		ra=cursor_record(&ca, filter);
+		rb=cursor_record(&cb, filter);
+	}
+
+	if(nb_shown>NB_DIFFS_SHOWN)
+		printf("... %u more differences\n", nb_shown-NB_DIFFS_SHOWN);
+	printf("%lu identical frames, %lu changed, %lu only in %s, %lu only in %s\n", (unsigned long)nb_same, (unsigned long)nb_changed, (unsigned long)nb_only_a, a->filename, (unsigned long)nb_only_b, b->filename);
+
+	return (nb_changed || nb_only_a || nb_only_b)?1:0;
+}
+
+static void usage(char const * const name)
+{
+	errx(1, "usage: %s index|frames|goodput|bursts|diff capture... [from=ms] [to=ms] [addr=0x...] [module=name] [min=N]", name);
+}
+
+int main(int argc, char ** argv)
+{
+	if(argc<3)
+		usage(argv[0]);
+
+	filter_t filter={0, UINT64_MAX, ADDRESS_ANY, NULL, 2};
+
+	int i;
+	for(i=2; i<argc; i++)
+	{
+		if(!strncmp(argv[i], "from=", 5))
+			filter.from_us=strtod(argv[i]+5, NULL)*1E3;
+		else if(!strncmp(argv[i], "to=", 3))
+			filter.to_us=strtod(argv[i]+3, NULL)*1E3;
+		else if(!strncmp(argv[i], "addr=", 5))
+			filter.address=strtoull(argv[i]+5, NULL, 16);
+		else if(!strncmp(argv[i], "module=", 7))
+			filter.module=argv[i]+7;
+		else if(!strncmp(argv[i], "min=", 4))
+			filter.min_burst=strtoul(argv[i]+4, NULL, 10);
+		else
+			open_capture(argv[i]);
+	}
+
+	if(nb_captures==0)
+		usage(argv[0]);
+
+	char const * const cmd=argv[1];
+	if(!strcmp(cmd, "index"))
+		return 0; //done by open_capture()
+	else if(!strcmp(cmd, "frames"))
+		cmd_frames(&filter);
+	else if(!strcmp(cmd, "goodput"))
+		cmd_goodput(&filter);
+	else if(!strcmp(cmd, "bursts"))
+		cmd_bursts(&filter);
+	else if(!strcmp(cmd, "diff"))
+	{
+		if(nb_captures!=2)
+			errx(1, "diff needs two captures");
+		return cmd_diff(&filter);
+	}
+	else
+		usage(argv[0]);
+
+	return 0;
+}
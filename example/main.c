@@ -114,7 +114,7 @@ int main(void)
 			state1=avr_run(avr1);
 		else
 			state2=avr_run(avr2);
-	} while(state1!=cpu_Done && state1!=cpu_Crashed && state2!=cpu_Done && state2!=cpu_Crashed && run);
+	} while(state1!=cpu_Done && state1!=cpu_Crashed && state2!=cpu_Done && state2!=cpu_Crashed && run && !nRF_done(NULL));
 
 	avr_terminate(avr1);
 	avr_terminate(avr2);
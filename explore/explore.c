@@ -0,0 +1,649 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <unistd.h>
+#include <err.h>
+
+#include "sim_avr.h"
+#include "sim_irq.h"
+
+#include "nRF.h"
+#include "nRF_defs.h"
+
+#include "sim_shim.h"
+
+/*
+exhaustive explorer of the timing interleavings of the PTX/PRX handshake of simavr-nRF24
+
+Two or three nRF without AVR cores (one PRX, one or two PTX on different clocks) are driven by a minimal firmware reacting to the IRQ-pin. Every time several cycle timers are due within a small window the explorer tries every order, with a stateless depth-first search: each run replays the choices of the previous one up to the last choice point with an untried alternative. A state already seen at a choice point (hash of both nRF, the firmwares and the pending timers) is not explored again. Internal errors (errx), deadlocks, stuck states and duplicates are reported with the choices leading to them, see README.
+
+(c) 2022 by kittennbfive
+
+AGPLv3+ and NO WARRANTY!
+*/
+
+#define NB_MODULES_MAX 3
+#define MODULE_PRX 1
+#define DEPTH_MAX 4096 //choice points per run
+#define STEP_US 100 //deadlocks, stuck states and the end are checked at this interval
+#define OFFSET_STEP_US 10
+#define NB_FINDINGS_SHOWN 10
+#define SZ_PAYLOAD 4
+#define PROGRESS_RUNS 10000
+
+typedef enum
+{
+	FINDING_INTERNAL_ERROR,
+	FINDING_DEADLOCK,
+	FINDING_STUCK,
+	FINDING_DUPLICATE,
+	FINDING_UNFINISHED,
+	NB_FINDING_KINDS
+} finding_t;
+
+typedef struct
+{
+	nRF_t * nRF;
+	uint8_t id; //also index of the module
+	uint8_t sent; //PTX: payloads written
+	uint8_t acked;
+	uint8_t max_rt;
+	uint32_t received[NB_MODULES_MAX]; //PRX: bitmask of the payloads received from each PTX
+} firmware_t;
+
+typedef struct
+{
+	uint8_t nb_modules;
+	uint8_t packets; //per PTX
+	uint32_t window_us;
+	uint8_t ard;
+	uint8_t arc;
+	uint32_t offset_max_us;
+	uint32_t lost;
+	uint32_t latency_us;
+	uint32_t time_ms;
+	uint32_t stuck_ms;
+	uint64_t max_runs; //0: until everything is explored
+} options_t;
+
+static const uint32_t frequencies[NB_MODULES_MAX]={10000000, 8000000, 12000000};
+static const char * names[NB_MODULES_MAX]={"PTX1", "PRX", "PTX2"};
+static const char * pin_names[2*NB_MODULES_MAX]={"CE1", "IRQ1", "CE2", "IRQ2", "CE3", "IRQ3"};
+static const char * finding_names[NB_FINDING_KINDS]={
+	[FINDING_INTERNAL_ERROR]="internal error",
+	[FINDING_DEADLOCK]="deadlock",
+	[FINDING_STUCK]="stuck",
+	[FINDING_DUPLICATE]="duplicate",
+	[FINDING_UNFINISHED]="unfinished"
+};
+
+static options_t options={2, 2, 10, 0, 3, 0, 0, 20, 50, 5, 0};
+
+static avr_t * avr[NB_MODULES_MAX];
+static nRF_t * nRF[NB_MODULES_MAX];
+static firmware_t firmwares[NB_MODULES_MAX];
+static avr_irq_t * pins; //per module: CE (output to nRF) and IRQ (input from nRF)
+
+//current path of the depth-first search
+static uint8_t path[DEPTH_MAX];
+static uint8_t branching[DEPTH_MAX];
+static uint32_t depth;
+static uint32_t depth_max;
+static uint32_t prefix_len; //choices replayed from the previous run
+static bool replay; //a single path given on the command line, no pruning
+static bool pruned;
+static bool run_done; //finding or end of the run
+static jmp_buf run_env;
+static bool in_run; //errx() is a finding only inside run()
+
+static uint64_t * visited=NULL; //open addressing, 0 is empty
+static uint64_t sz_visited=0;
+static uint64_t nb_visited=0;
+
+static uint64_t nb_findings[NB_FINDING_KINDS];
+static uint64_t nb_pruned;
+static uint64_t nb_too_deep;
+
+static void print_path(void)
+{
+	uint32_t len=depth;
+	while(len && !path[len-1]) //trailing zeros are implied
+		len--;
+
+	fprintf(stderr, "  path: ");
+	if(!len)
+		fprintf(stderr, "0");
+	uint32_t i;
+	for(i=0; i<len; i++)
+		fprintf(stderr, "%s%u", i?",":"", path[i]);
+	fprintf(stderr, "\n");
+}
+
+static void finding(const finding_t kind, char const * const fmt, ...)
+{
+	if(run_done)
+		return;
+	run_done=true;
+
+	if(nb_findings[kind]++>=NB_FINDINGS_SHOWN && !replay)
+		return;
+
+	va_list args;
+	va_start(args, fmt);
+	fprintf(stderr, "%s: ", finding_names[kind]);
+	vfprintf(stderr, fmt, args);
+	fprintf(stderr, "\n");
+	va_end(args);
+
+	print_path();
+}
+
+void __real_errx(int eval, const char * fmt, ...) __attribute__((noreturn));
+void __wrap_errx(int eval, const char * fmt, ...) __attribute__((noreturn));
+
+void __wrap_errx(int eval, const char * fmt, ...)
+{
+	char msg[256];
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, args);
+	va_end(args);
+
+	if(!in_run) //error of the explorer itself
+		__real_errx(eval, "%s", msg);
+
+	finding(FINDING_INTERNAL_ERROR, "%s", msg);
+
+	longjmp(run_env, 1); //everything is set up again for the next run
+}
+
+static uint64_t fnv(uint64_t hash, void const * const data, const size_t length)
+{
+	uint8_t const * const bytes=data;
+	size_t i;
+	for(i=0; i<length; i++)
+	{
+		hash^=bytes[i];
+		hash*=1099511628211ULL;
+	}
+
+	return hash;
+}
+
+static uint64_t state_hash(void)
+{
+	uint64_t hash=14695981039346656037ULL;
+
+	uint8_t i;
+	for(i=0; i<options.nb_modules; i++)
+	{
+		nRF_t const * const m=nRF[i];
+		const uint8_t fields[]={m->state, m->state_next, m->state_spi, m->pin_CE, m->pin_IRQ, m->PID, m->fifo_tx_entries, m->fifo_rx_entries, m->ack_payloads_entries, \
+			m->tx_in_progress, m->tx_finished, m->tx_wait_for_ack, m->tx_ack_received, m->ard_has_elapsed, m->nb_retries, m->rx_ack_timeout, m->rx_send_ack, \
+			m->rx_send_ack_to?m->rx_send_ack_to->index+1:0, m->tx_receive_ack_from?m->tx_receive_ack_from->index+1:0, \
+			m->last_rx_valid, m->cold->last_rx.PID, m->cold->last_rx.data[1], m->packet_being_sent_valid, m->cold->packet_being_sent.PID, \
+			m->regs[REG_STATUS], m->regs[REG_FIFO_STATUS], m->regs[REG_OBSERVE_TX], m->fifo_tx_entries?m->cold->fifo_tx[0].data[1]:0xff};
+		hash=fnv(hash, fields, sizeof(fields));
+
+		firmware_t const * const fw=&firmwares[i];
+		hash=fnv(hash, &fw->sent, sizeof(fw->sent));
+		hash=fnv(hash, &fw->acked, sizeof(fw->acked));
+		hash=fnv(hash, &fw->max_rt, sizeof(fw->max_rt));
+		hash=fnv(hash, fw->received, sizeof(fw->received));
+	}
+
+	return (hash^shim_hash_timers())|1; //never 0
+}
+
+static bool visit(const uint64_t hash) //false if already seen
+{
+	if(2*(nb_visited+1)>sz_visited)
+	{
+		uint64_t * const old=visited;
+		const uint64_t sz_old=sz_visited;
+
+		sz_visited=sz_visited?2*sz_visited:(1<<16);
+		visited=calloc(sz_visited, sizeof(uint64_t));
+		if(!visited)
+			err(1, "calloc for visited states failed");
+
+		uint64_t i;
+		for(i=0; i<sz_old; i++)
+		{
+			if(!old[i])
+				continue;
+			uint64_t pos=old[i]&(sz_visited-1);
+			while(visited[pos])
+				pos=(pos+1)&(sz_visited-1);
+			visited[pos]=old[i];
+		}
+		free(old);
+	}
+
+	uint64_t pos=hash&(sz_visited-1);
+	while(visited[pos])
+	{
+		if(visited[pos]==hash)
+			return false;
+		pos=(pos+1)&(sz_visited-1);
+	}
+
+	visited[pos]=hash;
+	nb_visited++;
+
+	return true;
+}
+
+static uint8_t choose(const uint8_t nb_candidates)
+{
+	if(pruned)
+		return 0;
+
+	if(depth==DEPTH_MAX) //the rest of this run is not explored
+	{
+		if(!nb_too_deep++)
+			fprintf(stderr, "warning: more than %u choice points in one run, increase DEPTH_MAX or reduce -t\n", DEPTH_MAX);
+		pruned=true;
+		return 0;
+	}
+
+	if(depth<prefix_len)
+	{
+		if(path[depth]>=nb_candidates)
+		{
+			if(!replay)
+				__real_errx(1, "explorer: choice point %u has %u alternatives instead of %u, simulation is not deterministic", depth, nb_candidates, branching[depth]);
+			fprintf(stderr, "choice %u: only %u alternatives, taking 0\n", depth, nb_candidates);
+			path[depth]=0;
+		}
+		branching[depth]=nb_candidates;
+		return path[depth++];
+	}
+
+	if(!replay && !visit(state_hash()))
+	{
+		pruned=true;
+		nb_pruned++;
+		return 0;
+	}
+
+	path[depth]=0;
+	branching[depth]=nb_candidates;
+	depth++;
+	if(depth>depth_max)
+		depth_max=depth;
+
+	return 0;
+}
+
+static bool next_path(void) //false when everything has been explored
+{
+	while(depth)
+	{
+		depth--;
+		if(path[depth]+1<branching[depth])
+		{
+			path[depth]++;
+			prefix_len=depth+1;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static uint8_t spi(nRF_t * const module, uint8_t * const bytes, const uint8_t length) //returns STATUS
+{
+	csn_nRF(module, 0);
+	uint8_t i;
+	for(i=0; i<length; i++)
+		bytes[i]=spi_nRF(module, bytes[i]);
+	csn_nRF(module, 1);
+
+	return bytes[0];
+}
+
+static void write_reg(nRF_t * const module, const uint8_t reg, const uint8_t value)
+{
+	uint8_t bytes[2]={W_REGISTER|reg, value};
+	spi(module, bytes, 2);
+}
+
+static uint8_t read_reg(nRF_t * const module, const uint8_t reg)
+{
+	uint8_t bytes[2]={R_REGISTER|reg, nRF_NOP};
+	spi(module, bytes, 2);
+	return bytes[1];
+}
+
+static void ptx_send_next(firmware_t * const fw)
+{
+	if(fw->sent==options.packets)
+		return;
+
+	uint8_t bytes[1+SZ_PAYLOAD]={W_TX_PAYLOAD, fw->id, fw->sent, 0xa5, 0x5a};
+	spi(fw->nRF, bytes, sizeof(bytes));
+	fw->sent++;
+}
+
+static avr_cycle_count_t cb_firmware_start(avr_t * avr, avr_cycle_count_t when, void * param)
+{
+	(void)avr;
+	(void)when;
+
+	firmware_t * const fw=(firmware_t*)param;
+	nRF_t * const module=fw->nRF;
+
+	if(fw->id==MODULE_PRX)
+	{
+		write_reg(module, REG_RX_PW_P0, SZ_PAYLOAD);
+		write_reg(module, REG_RX_PW_P1, SZ_PAYLOAD);
+		write_reg(module, REG_CONFIG, (1<<EN_CRC)|(1<<PWR_UP)|(1<<PRIM_RX));
+	}
+	else
+	{
+		if(fw->id!=0) //on pipe 1 of the PRX
+		{
+			uint8_t addr[6]={W_REGISTER|REG_TX_ADDR, 0xc2, 0xc2, 0xc2, 0xc2, 0xc2};
+			spi(module, addr, sizeof(addr));
+			addr[0]=W_REGISTER|REG_RX_ADDR_P0;
+			memset(&addr[1], 0xc2, 5);
+			spi(module, addr, sizeof(addr));
+		}
+		write_reg(module, REG_SETUP_RETR, (options.ard<<ARD)|(options.arc<<ARC));
+		write_reg(module, REG_CONFIG, (1<<EN_CRC)|(1<<PWR_UP));
+		ptx_send_next(fw);
+	}
+
+	avr_raise_irq(&pins[2*fw->id], 1); //CE
+
+	return 0;
+}
+
+static avr_cycle_count_t cb_firmware_irq(avr_t * avr, avr_cycle_count_t when, void * param)
+{
+	firmware_t * const fw=(firmware_t*)param;
+	nRF_t * const module=fw->nRF;
+
+	uint8_t nop=nRF_NOP;
+	const uint8_t status=spi(module, &nop, 1);
+
+	if(fw->id==MODULE_PRX)
+	{
+		while(!(read_reg(module, REG_FIFO_STATUS)&(1<<FIFO_RX_EMPTY)))
+		{
+			uint8_t bytes[1+SZ_PAYLOAD]={R_RX_PAYLOAD, nRF_NOP, nRF_NOP, nRF_NOP, nRF_NOP};
+			spi(module, bytes, sizeof(bytes));
+
+			const uint8_t ptx=bytes[1];
+			const uint8_t seq=bytes[2];
+			if(ptx>=NB_MODULES_MAX || seq>=32)
+				finding(FINDING_DUPLICATE, "PRX received garbage %02x %02x %02x %02x", bytes[1], bytes[2], bytes[3], bytes[4]);
+			else if(fw->received[ptx]&(1UL<<seq))
+				finding(FINDING_DUPLICATE, "PRX received payload %u of %s twice", seq, names[ptx]);
+			else
+				fw->received[ptx]|=(1UL<<seq);
+		}
+	}
+	else
+	{
+		if(status&(1<<TX_DS))
+			fw->acked++;
+		if(status&(1<<MAX_RT))
+		{
+			fw->max_rt++;
+			uint8_t flush=FLUSH_TX;
+			spi(module, &flush, 1);
+		}
+		if(status&(1<<RX_DR)) //no ACK-payloads are sent, but don't get stuck on them
+		{
+			uint8_t flush=FLUSH_RX;
+			spi(module, &flush, 1);
+		}
+	}
+
+	write_reg(module, REG_STATUS, status&((1<<RX_DR)|(1<<TX_DS)|(1<<MAX_RT)));
+
+	if(fw->id!=MODULE_PRX && fw->acked+fw->max_rt==fw->sent)
+		ptx_send_next(fw);
+
+	if(!module->pin_IRQ) //a new flag was set in between, no falling edge will come
+		return when+US_TO_CYCLES(avr, options.latency_us);
+
+	return 0;
+}
+
+static void cb_irq_pin(struct avr_irq_t * irq, uint32_t value, void * param)
+{
+	(void)irq;
+
+	firmware_t * const fw=(firmware_t*)param;
+
+	if(!value)
+		avr_cycle_timer_register(fw->nRF->avr, US_TO_CYCLES(fw->nRF->avr, options.latency_us), &cb_firmware_irq, fw);
+}
+
+static bool all_done(void)
+{
+	uint8_t i;
+	for(i=0; i<options.nb_modules; i++)
+	{
+		if(i!=MODULE_PRX && firmwares[i].acked+firmwares[i].max_rt<options.packets)
+			return false;
+	}
+
+	return true;
+}
+
+static void check_stuck(void)
+{
+	uint8_t i;
+	for(i=0; i<options.nb_modules; i++)
+	{
+		nRF_t const * const m=nRF[i];
+
+		const bool transient=!(m->state==NRF_POWER_DOWN || m->state==NRF_STANDBY1 || m->state==NRF_RX_MODE || (m->state==NRF_STANDBY2 && !m->tx_wait_for_ack));
+		if(transient && m->avr->cycle-m->cycle_state_entered>MS_TO_CYCLES(m->avr, options.stuck_ms))
+		{
+			finding(FINDING_STUCK, "nRF %s in state %u for more than %ums", m->cold->name, m->state, options.stuck_ms);
+			return;
+		}
+	}
+}
+
+static void print_outcome(void)
+{
+	uint8_t i;
+	for(i=0; i<options.nb_modules; i++)
+	{
+		if(i==MODULE_PRX)
+			continue;
+		fprintf(stderr, "  %s: %u sent, %u ACKed, %u MAX_RT, PRX received mask 0x%x\n", names[i], firmwares[i].sent, firmwares[i].acked, firmwares[i].max_rt, firmwares[MODULE_PRX].received[i]);
+	}
+}
+
+static void run(void)
+{
+	shim_reset();
+	depth=0;
+	pruned=false;
+	run_done=false;
+
+	in_run=true;
+	if(setjmp(run_env)) //errx() inside simavr-nRF24
+	{
+		in_run=false;
+		return;
+	}
+
+	nRF_global_init();
+	nRF_stop_on_error(false); //errors of the firmware are not findings
+	nRF_set_log_level(replay?NRF_LOG_VERBOSE:NRF_LOG_ERROR);
+	nRF_set_lost_packets(options.lost, 0);
+	srand(1); //lost packets are the same in every replay of a path
+
+	pins=avr_alloc_irq(NULL, 0, 2*options.nb_modules, pin_names);
+
+	uint8_t i;
+	for(i=0; i<options.nb_modules; i++)
+	{
+		uint16_t index=nRF[i]->index; //set by make_new_nRF()
+		nRF_cold_t * const cold=nRF[i]->cold; //allocated by make_new_nRF()
+		free(cold->advisor);
+		free(cold->model);
+		memset(cold, 0, sizeof(nRF_cold_t));
+		memset(nRF[i], 0, sizeof(nRF_t));
+		nRF[i]->index=index;
+		nRF[i]->cold=cold;
+		nRF_init(avr[i], nRF[i], names[i]);
+		nRF_connect(nRF[i], &pins[2*i], &pins[2*i+1]);
+
+		memset(&firmwares[i], 0, sizeof(firmware_t));
+		firmwares[i].nRF=nRF[i];
+		firmwares[i].id=i;
+		avr_irq_register_notify(&pins[2*i+1], &cb_irq_pin, &firmwares[i]);
+	}
+
+	for(i=0; i<options.nb_modules; i++)
+	{
+		const uint32_t offset_us=i?choose(options.offset_max_us/OFFSET_STEP_US+1)*OFFSET_STEP_US:0; //the first module is the reference
+		avr_cycle_timer_register(avr[i], US_TO_CYCLES(avr[i], offset_us), &cb_firmware_start, &firmwares[i]);
+	}
+
+	uint64_t now_ns=0;
+	while(!run_done && !pruned)
+	{
+		now_ns+=STEP_US*1000ULL;
+		shim_run_until(now_ns);
+
+		if(run_done || pruned)
+			break;
+
+		if(all_done())
+		{
+			run_done=true;
+			if(replay)
+				fprintf(stderr, "finished at %.3fms\n", now_ns/1E6);
+			break;
+		}
+
+		check_stuck();
+
+		if(!run_done && shim_nb_timers()==0)
+			finding(FINDING_DEADLOCK, "nothing left to do at %.3fms but not all packets are ACKed or given up", now_ns/1E6);
+
+		if(!run_done && now_ns>=options.time_ms*1000000ULL)
+			finding(FINDING_UNFINISHED, "not all packets ACKed or given up after %ums", options.time_ms);
+	}
+
+	in_run=false;
+
+	if(replay)
+		print_outcome();
+}
+
+static void parse_path(char const * const str)
+{
+	char const * p=str;
+	while(*p)
+	{
+		if(prefix_len==DEPTH_MAX)
+			errx(1, "path too long");
+		char * end;
+		path[prefix_len++]=strtoul(p, &end, 10);
+		if(end==p || (*end && *end!=','))
+			errx(1, "invalid path \"%s\"", str);
+		p=*end?end+1:end;
+	}
+}
+
+static void usage(char const * const name)
+{
+	errx(1, "usage: %s [-n 2|3] [-k packets] [-w window_us] [-a ARD] [-c ARC] [-o offset_max_us] [-l lost_packets] [-i irq_latency_us] [-t ms] [-s stuck_ms] [-r max_runs] [-p path]", name);
+}
+
+int main(int argc, char ** argv)
+{
+	char const * replay_path=NULL;
+
+	int opt;
+	while((opt=getopt(argc, argv, "n:k:w:a:c:o:l:i:t:s:r:p:"))!=-1)
+	{
+		switch(opt)
+		{
+			case 'n': options.nb_modules=strtoul(optarg, NULL, 10); break;
+			case 'k': options.packets=strtoul(optarg, NULL, 10); break;
+			case 'w': options.window_us=strtoul(optarg, NULL, 10); break;
+			case 'a': options.ard=strtoul(optarg, NULL, 10); break;
+			case 'c': options.arc=strtoul(optarg, NULL, 10); break;
+			case 'o': options.offset_max_us=strtoul(optarg, NULL, 10); break;
+			case 'l': options.lost=strtoul(optarg, NULL, 10); break;
+			case 'i': options.latency_us=strtoul(optarg, NULL, 10); break;
+			case 't': options.time_ms=strtoul(optarg, NULL, 10); break;
+			case 's': options.stuck_ms=strtoul(optarg, NULL, 10); break;
+			case 'r': options.max_runs=strtoull(optarg, NULL, 10); break;
+			case 'p': replay_path=optarg; break;
+			default: usage(argv[0]);
+		}
+	}
+
+	if(optind!=argc || options.nb_modules<2 || options.nb_modules>NB_MODULES_MAX || options.packets<1 || options.packets>32 || options.ard>15 || options.arc>15 || options.latency_us<1)
+		usage(argv[0]);
+
+	if(options.nb_modules>NB_NRF_MAX)
+		errx(1, "%u nRF need NB_NRF_MAX>=%u in nRF_config.h", options.nb_modules, options.nb_modules);
+
+	if(!replay_path && freopen("/dev/null", "w", stdout)==NULL) //log of simavr-nRF24, only errors are printed while exploring
+		err(1, "freopen");
+
+	uint8_t i;
+	for(i=0; i<options.nb_modules; i++)
+	{
+		avr[i]=shim_make_avr(frequencies[i]);
+		nRF[i]=make_new_nRF();
+	}
+
+	shim_set_chooser(&choose, options.window_us*1000ULL);
+
+	if(replay_path)
+	{
+		replay=true;
+		parse_path(replay_path);
+		run();
+		fflush(stdout);
+		print_path();
+		return (nb_findings[FINDING_INTERNAL_ERROR]+nb_findings[FINDING_DEADLOCK]+nb_findings[FINDING_STUCK]+nb_findings[FINDING_DUPLICATE]+nb_findings[FINDING_UNFINISHED])?1:0;
+	}
+
+	uint64_t nb_runs=0;
+	bool complete;
+	do
+	{
+		run();
+		nb_runs++;
+
+		if(nb_runs%PROGRESS_RUNS==0)
+			fprintf(stderr, "%lu runs, %lu states, depth %u\n", (unsigned long)nb_runs, (unsigned long)nb_visited, depth_max);
+
+		complete=!next_path();
+	} while(!complete && (!options.max_runs || nb_runs<options.max_runs));
+
+	fprintf(stderr, "%s after %lu runs: %lu states visited, %lu runs pruned, at most %u choice points per run\n", complete?"explored everything":"stopped", (unsigned long)nb_runs, (unsigned long)nb_visited, (unsigned long)nb_pruned, depth_max);
+
+	bool found=false;
+	finding_t kind;
+	for(kind=0; kind<NB_FINDING_KINDS; kind++)
+	{
+		if(nb_findings[kind])
+		{
+			fprintf(stderr, "%lu %s\n", (unsigned long)nb_findings[kind], finding_names[kind]);
+			found=true;
+		}
+	}
+
+	return found?1:0;
+}
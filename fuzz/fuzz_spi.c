@@ -0,0 +1,229 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <time.h>
+#include <err.h>
+
+#include "sim_avr.h"
+#include "sim_irq.h"
+
+#include "nRF.h"
+#include "nRF_defs.h"
+
+#include "sim_shim.h"
+
+/*
+fuzzing harness for the SPI command stream of simavr-nRF24
+
+Two nRF without AVR cores are driven by the fuzzer input, see README for the format. Every errx() of simavr-nRF24 (internal errors) and every broken invariant is turned into an abort() so the fuzzer reports it as a finding with the input that triggered it.
+
+libFuzzer entry point: LLVMFuzzerTestOneInput(). Compile with -DNRF_FUZZ_REPLAY to get a standalone driver replaying files.
+
+(c) 2022 by kittennbfive
+
+AGPLv3+ and NO WARRANTY!
+*/
+
+#define NB_MODULES 2
+
+#define OP_SPI 0 //arg+2 bytes CSN-framed, first is the command
+#define OP_CE 1 //CE=arg&1
+#define OP_WAIT_SHORT 2 //(arg+1)*10µs
+#define OP_WAIT_LONG 3 //(arg+1)*500µs
+
+static avr_t * avr[NB_MODULES];
+static nRF_t * nRF[NB_MODULES];
+static avr_irq_t * pins; //per module: CE (output to nRF) and IRQ (input from nRF)
+static uint64_t now_ns;
+static bool verbose;
+static bool in_run; //errx() is a finding only inside LLVMFuzzerTestOneInput()
+
+void __real_errx(int eval, const char * fmt, ...) __attribute__((noreturn));
+void __wrap_errx(int eval, const char * fmt, ...) __attribute__((noreturn));
+
+void __wrap_errx(int eval, const char * fmt, ...)
+{
+	char msg[256];
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, args);
+	va_end(args);
+
+	if(!in_run || !strncmp(msg, "shim:", 5)) //error of the harness itself
+		__real_errx(eval, "%s", msg);
+
+	fprintf(stderr, "finding: %s\n", msg);
+
+	abort();
+}
+
+static void finding(nRF_t const * const module, char const * const what)
+{
+	fprintf(stderr, "finding: nRF %s: %s\n", module->cold->name, what);
+	abort();
+}
+
+static void check_invariants(nRF_t const * const module)
+{
+	if(module->fifo_tx_entries>3 || module->fifo_rx_entries>3 || module->ack_payloads_entries>3)
+		finding(module, "fifo entries out of range");
+	if(module->fifo_tx_entries+module->ack_payloads_entries>3)
+		finding(module, "TX fifo and ACK-payloads use more than 3 entries");
+	if(module->state>=NRF_NB_STATES || module->state_next>=NRF_NB_STATES)
+		finding(module, "invalid state");
+	if(module->spi_nb_bytes>module->spi_length_bytes && module->state_spi!=NRF_SPI_IDLE)
+		finding(module, "SPI access past the register");
+	if(module->fifo_tx_entries && module->cold->fifo_tx[0].nb_bytes>32)
+		finding(module, "TX payload longer than 32 bytes");
+}
+
+static void advance(const uint32_t us)
+{
+	now_ns+=us*1000ULL;
+	shim_run_until(now_ns);
+}
+
+int LLVMFuzzerInitialize(int * argc, char *** argv)
+{
+	(void)argc;
+	(void)argv;
+
+	verbose=getenv("NRF_FUZZ_VERBOSE")!=NULL;
+	if(!verbose && freopen("/dev/null", "w", stdout)==NULL) //errors of simavr-nRF24 are always printed
+		err(1, "freopen");
+
+	avr[0]=shim_make_avr(10000000);
+	avr[1]=shim_make_avr(8000000);
+
+	uint8_t i;
+	for(i=0; i<NB_MODULES; i++)
+		nRF[i]=make_new_nRF();
+
+	return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t * data, size_t size)
+{
+	static const char * names[NB_MODULES]={"nRF1", "nRF2"};
+	static const char * pin_names[2*NB_MODULES]={"CE1", "IRQ1", "CE2", "IRQ2"};
+
+	in_run=true;
+	shim_reset();
+	now_ns=0;
+
+	nRF_global_init();
+	nRF_stop_on_error(false); //firmware errors are not findings
+	nRF_set_log_level(verbose?NRF_LOG_VERBOSE:NRF_LOG_ERROR);
+
+	pins=avr_alloc_irq(NULL, 0, 2*NB_MODULES, pin_names);
+
+	uint8_t i;
+	for(i=0; i<NB_MODULES; i++)
+	{
+		uint16_t index=nRF[i]->index; //set by make_new_nRF()
+		nRF_cold_t * const cold=nRF[i]->cold; //allocated by make_new_nRF()
+		free(cold->advisor);
+		free(cold->model);
+		memset(cold, 0, sizeof(nRF_cold_t));
+		memset(nRF[i], 0, sizeof(nRF_t));
+		nRF[i]->index=index;
+		nRF[i]->cold=cold;
+		nRF_init(avr[i], nRF[i], names[i]);
+		nRF_connect(nRF[i], &pins[2*i], &pins[2*i+1]);
+	}
+
+	size_t pos=0;
+	while(pos<size)
+	{
+		const uint8_t op=data[pos++];
+		nRF_t * const module=nRF[op&1];
+		const uint8_t arg=op>>3;
+
+		switch((op>>1)&3)
+		{
+			case OP_SPI:
+			{
+				csn_nRF(module, 0);
+				uint8_t n;
+				for(n=0; n<arg+2 && pos<size; n++)
+					spi_nRF(module, data[pos++]);
+				csn_nRF(module, 1);
+				break;
+			}
+
+			case OP_CE:
+				avr_raise_irq(&pins[2*(op&1)], arg&1);
+				break;
+
+			case OP_WAIT_SHORT:
+				advance((arg+1)*10);
+				break;
+
+			case OP_WAIT_LONG:
+				advance((arg+1)*500);
+				break;
+		}
+
+		check_invariants(nRF[0]);
+		check_invariants(nRF[1]);
+	}
+
+	//let pending transmissions and retransmissions finish
+	advance(20000);
+	check_invariants(nRF[0]);
+	check_invariants(nRF[1]);
+
+	in_run=false;
+	return 0;
+}
+
+#ifdef NRF_FUZZ_REPLAY
+int main(int argc, char ** argv)
+{
+	uint32_t repeat=1;
+	int first=1;
+
+	if(argc>2 && !strcmp(argv[1], "-r"))
+	{
+		repeat=strtoul(argv[2], NULL, 10);
+		first=3;
+	}
+
+	if(first>=argc)
+		errx(1, "usage: %s [-r repeat] input...", argv[0]);
+
+	LLVMFuzzerInitialize(&argc, &argv);
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	uint64_t nb_runs=0;
+	int i;
+	for(i=first; i<argc; i++)
+	{
+		FILE * f=fopen(argv[i], "rb");
+		if(!f)
+			err(1, "opening %s failed", argv[i]);
+
+		static uint8_t buf[1<<16];
+		size_t size=fread(buf, 1, sizeof(buf), f);
+		fclose(f);
+
+		fprintf(stderr, "replaying %s (%zu bytes)\n", argv[i], size);
+
+		uint32_t r;
+		for(r=0; r<repeat; r++)
+			LLVMFuzzerTestOneInput(buf, size);
+		nb_runs+=repeat;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double seconds=(end.tv_sec-start.tv_sec)+(end.tv_nsec-start.tv_nsec)/1E9;
+	fprintf(stderr, "%lu runs without finding, %.0f runs/s\n", (unsigned long)nb_runs, nb_runs/seconds);
+
+	return 0;
+}
+#endif
@@ -0,0 +1,312 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <err.h>
+
+#include "sim_avr.h"
+#include "sim_irq.h"
+#include "sim_vcd_file.h"
+
+#include "sim_shim.h"
+
+/*
+minimal replacement of the parts of simavr used by simavr-nRF24 (IRQ and cycle timers), so nRF can be driven without any AVR core
+
+Everything is allocated from fixed arenas that are emptied by shim_reset(), so nothing is malloc'ed for every run of the fuzzer.
+
+(c) 2022 by kittennbfive
+
+AGPLv3+ and NO WARRANTY!
+*/
+
+#define SZ_IRQS 256
+#define SZ_HOOKS 256
+#define NB_TIMERS_MAX 64
+#define NB_AVRS_MAX 8
+
+typedef struct
+{
+	avr_t * avr;
+	avr_cycle_count_t when; //absolute
+	avr_cycle_timer_t timer;
+	void * param;
+} shim_timer_t;
+
+static avr_irq_t irqs[SZ_IRQS];
+static uint16_t nb_irqs=0;
+
+static avr_irq_hook_t hooks[SZ_HOOKS];
+static uint16_t nb_hooks=0;
+
+static shim_timer_t timers[NB_TIMERS_MAX];
+static uint8_t nb_timers=0;
+
+static avr_t * avrs[NB_AVRS_MAX];
+static uint8_t nb_avrs=0;
+
+static shim_choose_t choose=NULL;
+static uint64_t choose_window_ns;
+
+avr_t * shim_make_avr(const uint32_t frequency)
+{
+	if(nb_avrs==NB_AVRS_MAX)
+		errx(1, "shim: no more AVR, increase NB_AVRS_MAX");
+
+	avr_t * avr=calloc(1, sizeof(avr_t));
+	if(!avr)
+		err(1, "shim_make_avr");
+
+	avr->frequency=frequency;
+	avrs[nb_avrs++]=avr;
+
+	return avr;
+}
+
+void shim_reset(void)
+{
+	nb_irqs=0;
+	nb_hooks=0;
+	nb_timers=0;
+
+	uint8_t i;
+	for(i=0; i<nb_avrs; i++)
+		avrs[i]->cycle=0;
+}
+
+avr_irq_t * avr_alloc_irq(avr_irq_pool_t * pool, uint32_t base, uint32_t count, const char ** names)
+{
+	if(nb_irqs+count>SZ_IRQS)
+		errx(1, "shim: no more IRQ, increase SZ_IRQS");
+
+	avr_irq_t * irq=&irqs[nb_irqs];
+	nb_irqs+=count;
+
+	uint32_t i;
+	for(i=0; i<count; i++)
+	{
+		memset(&irq[i], 0, sizeof(avr_irq_t));
+		irq[i].pool=pool;
+		irq[i].irq=base+i;
+		irq[i].name=names?names[i]:NULL;
+	}
+
+	return irq;
+}
+
+static avr_irq_hook_t * alloc_hook(avr_irq_t * irq)
+{
+	if(nb_hooks==SZ_HOOKS)
+		errx(1, "shim: no more hooks, increase SZ_HOOKS");
+
+	avr_irq_hook_t * hook=&hooks[nb_hooks++];
+	memset(hook, 0, sizeof(avr_irq_hook_t));
+	hook->next=irq->hook;
+	irq->hook=hook;
+
+	return hook;
+}
+
+void avr_irq_register_notify(avr_irq_t * irq, avr_irq_notify_t notify, void * param)
+{
+	avr_irq_hook_t * hook=alloc_hook(irq);
+	hook->notify=notify;
+	hook->param=param;
+}
+
+void avr_connect_irq(avr_irq_t * src, avr_irq_t * dst)
+{
+	alloc_hook(src)->chain=dst;
+}
+
+void avr_raise_irq(avr_irq_t * irq, uint32_t value)
+{
+	avr_irq_hook_t * hook;
+	for(hook=irq->hook; hook; hook=hook->next)
+	{
+		if(hook->busy)
+			continue;
+
+		hook->busy=1;
+		if(hook->notify)
+			hook->notify(irq, value, hook->param);
+		if(hook->chain)
+			avr_raise_irq(hook->chain, value);
+		hook->busy=0;
+	}
+
+	irq->value=value;
+}
+
+static void timer_cancel(avr_t * avr, avr_cycle_timer_t timer, void * param)
+{
+	uint8_t i;
+	for(i=0; i<nb_timers; i++)
+	{
+		if(timers[i].avr==avr && timers[i].timer==timer && timers[i].param==param)
+		{
+			timers[i]=timers[--nb_timers];
+			return;
+		}
+	}
+}
+
+static void timer_add(avr_t * avr, avr_cycle_count_t when, avr_cycle_timer_t timer, void * param)
+{
+	timer_cancel(avr, timer, param); //like simavr: one timer per callback and parameter
+
+	if(nb_timers==NB_TIMERS_MAX)
+		errx(1, "shim: no more timers, increase NB_TIMERS_MAX");
+
+	timers[nb_timers].avr=avr;
+	timers[nb_timers].when=when;
+	timers[nb_timers].timer=timer;
+	timers[nb_timers].param=param;
+	nb_timers++;
+}
+
+void avr_cycle_timer_register(avr_t * avr, avr_cycle_count_t when, avr_cycle_timer_t timer, void * param)
+{
+	timer_add(avr, avr->cycle+when, timer, param);
+}
+
+void avr_cycle_timer_cancel(avr_t * avr, avr_cycle_timer_t timer, void * param)
+{
+	timer_cancel(avr, timer, param);
+}
+
+static uint64_t cycles_to_ns(avr_t const * const avr, const avr_cycle_count_t cycles)
+{
+	return (cycles*1000000000ULL+avr->frequency-1)/avr->frequency; //rounded up so a timer is due at this time
+}
+
+static avr_cycle_count_t ns_to_cycles(avr_t const * const avr, const uint64_t ns)
+{
+	return (ns*avr->frequency)/1000000000ULL;
+}
+
+static void set_time(const uint64_t ns)
+{
+	uint8_t i;
+	for(i=0; i<nb_avrs; i++)
+	{
+		avr_cycle_count_t cycle=ns_to_cycles(avrs[i], ns);
+		if(cycle>avrs[i]->cycle)
+			avrs[i]->cycle=cycle;
+	}
+}
+
+void shim_set_chooser(shim_choose_t cb, const uint64_t window_ns)
+{
+	choose=cb;
+	choose_window_ns=window_ns;
+}
+
+static int8_t choose_timer(const int8_t first, const uint64_t first_ns)
+{
+	//every timer due within the window after the first one may fire first, the others fire late (at the time already reached)
+	int8_t candidates[NB_TIMERS_MAX];
+	uint64_t candidates_ns[NB_TIMERS_MAX];
+	uint8_t nb_candidates=0;
+
+	uint8_t i;
+	for(i=0; i<nb_timers; i++)
+	{
+		uint64_t t_ns=cycles_to_ns(timers[i].avr, timers[i].when);
+		if(t_ns>first_ns+choose_window_ns)
+			continue;
+
+		uint8_t pos=nb_candidates++; //sorted by time, then by position in timers[]
+		while(pos && candidates_ns[pos-1]>t_ns)
+		{
+			candidates[pos]=candidates[pos-1];
+			candidates_ns[pos]=candidates_ns[pos-1];
+			pos--;
+		}
+		candidates[pos]=i;
+		candidates_ns[pos]=t_ns;
+	}
+
+	if(nb_candidates<2)
+		return first;
+
+	return candidates[choose(nb_candidates)];
+}
+
+void shim_run_until(const uint64_t ns)
+{
+	while(1)
+	{
+		//timers of all AVR are fired in time order and all AVR are kept at the same time, so a callback of one nRF acting on the other sees the right time
+		int8_t next=-1;
+		uint64_t next_ns=0;
+		uint8_t i;
+		for(i=0; i<nb_timers; i++)
+		{
+			uint64_t t_ns=cycles_to_ns(timers[i].avr, timers[i].when);
+			if(t_ns<=ns && (next<0 || t_ns<next_ns))
+			{
+				next=i;
+				next_ns=t_ns;
+			}
+		}
+
+		if(next<0)
+			break;
+
+		if(choose)
+		{
+			next=choose_timer(next, next_ns);
+			next_ns=cycles_to_ns(timers[next].avr, timers[next].when);
+		}
+
+		shim_timer_t t=timers[next];
+		timers[next]=timers[--nb_timers];
+
+		set_time(next_ns);
+		if(t.when>t.avr->cycle) //not if it fires late, see shim_set_chooser()
+			t.avr->cycle=t.when;
+		avr_cycle_count_t again=t.timer(t.avr, t.when, t.param);
+		if(again>t.when)
+			timer_add(t.avr, again, t.timer, t.param);
+	}
+
+	set_time(ns);
+}
+
+uint8_t shim_nb_timers(void)
+{
+	return nb_timers;
+}
+
+uint64_t shim_hash_timers(void)
+{
+	//independent of the order in timers[], times are relative to the AVR of each timer
+	uint64_t hash=0;
+	uint8_t i;
+	for(i=0; i<nb_timers; i++)
+	{
+		uint64_t h=14695981039346656037ULL; //FNV-1a
+		const uint64_t values[4]={(uintptr_t)timers[i].avr, (uintptr_t)timers[i].timer, (uintptr_t)timers[i].param, timers[i].when-timers[i].avr->cycle};
+		uint8_t const * const bytes=(uint8_t const *)values;
+		uint8_t b;
+		for(b=0; b<sizeof(values); b++)
+		{
+			h^=bytes[b];
+			h*=1099511628211ULL;
+		}
+		hash+=h;
+	}
+
+	return hash;
+}
+
+int avr_vcd_add_signal(avr_vcd_t * vcd, avr_irq_t * signal_irq, int signal_bit_size, const char * name)
+{
+	(void)vcd;
+	(void)signal_irq;
+	(void)signal_bit_size;
+	(void)name;
+
+	return 0;
+}
@@ -0,0 +1,26 @@
+#ifndef __SIM_SHIM_H__
+#define __SIM_SHIM_H__
+#include <stdint.h>
+
+#include "sim_avr.h"
+#include "sim_irq.h"
+
+/*
+minimal replacement of the parts of simavr used by simavr-nRF24 (IRQ and cycle timers), so nRF can be driven without any AVR core
+
+(c) 2022 by kittennbfive
+
+AGPLv3+ and NO WARRANTY!
+*/
+
+//picks which of nb_candidates timers (sorted by time) fires next, see shim_set_chooser()
+typedef uint8_t (*shim_choose_t)(const uint8_t nb_candidates);
+
+avr_t * shim_make_avr(const uint32_t frequency);
+void shim_reset(void);
+void shim_set_chooser(shim_choose_t cb, const uint64_t window_ns);
+void shim_run_until(const uint64_t ns);
+uint8_t shim_nb_timers(void);
+uint64_t shim_hash_timers(void);
+
+#endif
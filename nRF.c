@@ -6,15 +6,22 @@
 #include <time.h>
 #include <err.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
 
 #include "nRF.h"
 #include "nRF_internals.h"
 #include "nRF_defs.h"
+#include "nRF_telemetry.h"
 
 #include "sim_avr.h"
 #include "avr_spi.h"
 #include "avr_ioport.h"
 #include "sim_time.h"
+#include "sim_vcd_file.h"
 
 /*
 simavr-nRF24
@@ -33,34 +40,159 @@ version 11.05.22 00:54
 static nRF_log_level_t loglevel=NRF_LOG_WARNING;
 static bool stop_on_error=false;
 
+static uint64_t profile_enter(void);
+static void profile_leave(const profile_point_t point, const uint64_t start);
+
 #define LOG(level, msg, ...) \
 do \
 { \
 	if(level==NRF_LOG_ERROR && stop_on_error) \
 		errx(1, msg, ##__VA_ARGS__); \
 	if(loglevel>=level) \
+	{ \
+		const uint64_t profile_log_start=profile_enter(); \
 		printf(msg, ##__VA_ARGS__); \
+		profile_leave(NRF_PROFILE_LOG, profile_log_start); \
+	} \
 } while(0)
 
 
 static nRF_t * modules[NB_NRF_MAX];
-static uint8_t nb_modules=0;
+static uint16_t nb_modules=0;
 
 static config_lost_packets_t lost;
 
 static packets_stats_t stats;
 
+static config_bit_errors_t bit_errors;
+
+static nRF_telemetry_t * telemetry=NULL;
+
+static event_callback_t event_callbacks[NRF_NB_EVENTS][NRF_EVENT_CALLBACKS_MAX];
+static uint8_t nb_event_callbacks[NRF_NB_EVENTS];
+
+static FILE * trace=NULL;
+static uint64_t trace_flow_id=0;
+
+static double supply_voltage=3.0;
+
+static bool advisor=false;
+
+static until_t untils[NRF_UNTIL_MAX];
+static uint8_t nb_untils=0;
+static uint8_t nb_untils_register=0; //checked after every register write and state change
+static bool until_done=false;
+static int until_result;
+
+static bool profile=false;
+static profile_stats_t profile_stats[NRF_NB_PROFILE_POINTS];
+static uint8_t profile_depth;
+static uint64_t profile_children_ns[NRF_PROFILE_DEPTH_MAX]; //time of nested calls, per depth
+static uint64_t profile_outer_ns; //time spent in simavr-nRF24 (outermost calls only)
+static uint64_t profile_start_ns;
+
+//hot per-module radio state needed to find the receivers of a packet, kept in contiguous arrays so the search doesn't touch the (big) nRF_t of every module
+static uint32_t air_key[NB_NRF_MAX]; //0 if not in RX-mode, else channel, data rate and CRC length
+static uint8_t air_pipes[NB_NRF_MAX]; //EN_RXADDR
+static uint64_t air_addr[NB_NRF_MAX][6];
+
+//current consumption from datasheet, section 6.2
+static const double current_tx_uA[4]={7000, 7500, 9000, 11300}; //by RF_PWR: -18dBm, -12dBm, -6dBm, 0dBm
+static const double tx_power_dBm[4]={-18, -12, -6, 0}; //by RF_PWR
+
+static link_map_t path_loss_dB; //for the received power seen by RPD, see nRF_set_path_loss(), only the links given are stored
+
+static medium_shm_t * medium=NULL;
+static uint8_t medium_process;
+static uint8_t medium_nb_processes;
+static uint64_t medium_horizon_ns;
+static uint32_t medium_nb_late=0; //packets and ACKs delivered after their end on air, see nRF_medium_sync()
+static nRF_t * medium_proxies[NRF_MEDIUM_PROCESSES_MAX][NB_NRF_MAX];
+static medium_pending_t medium_pending[NRF_MEDIUM_PROCESSES_MAX*NRF_MEDIUM_SZ_RING];
+
+static uint16_t crc16_table[256];
+static uint8_t crc8_table[256];
+
+//fault injection timeline, see nRF_fault_channel() and the following
+static fault_t * faults=NULL;
+static uint32_t nb_faults=0;
+static uint32_t sz_faults=0;
+static fault_edge_t * fault_edges=NULL; //sorted by time once the timeline runs, a single cycle timer is armed for the next one
+static uint32_t nb_fault_edges=0;
+static uint32_t next_fault_edge=0;
+static bool fault_edges_sorted=true; //false: edges were appended after next_fault_edge
+static avr_cycle_count_t fault_timer_cycle=0; //when cb_fault_timeline is due, 0: not armed
+static uint32_t * faults_active=NULL; //indexes in faults[], only scanned when a fault starts or ends
+static uint32_t nb_faults_active=0;
+//state of the faults in progress, checked for every packet
+static uint32_t fault_channel_lost[128]; //0: no fault, else 1 out of N packets lost
+static link_map_t fault_link_lost; //(PTX, PRX), only links with a fault given are stored
+static uint32_t nb_fault_lost_packets=0;
+static uint32_t nb_fault_lost_acks=0;
+
 enum
 {
 	NRF24_CE_IN=0,
 	NRF24_IRQ_OUT,
 
+	//only for tracing, e.g. in a VCD-file
+	NRF24_CSN_OUT,
+	NRF24_STATE_OUT,
+	NRF24_FIFO_TX_OUT,
+	NRF24_FIFO_RX_OUT,
+	NRF24_ON_AIR_OUT,
+
 	NRF24_IRQ_COUNT
 };
 
 static const char * irq_names[NRF24_IRQ_COUNT]={
 	[NRF24_CE_IN]="nRF_CE",
-	[NRF24_IRQ_OUT]="nRF_IRQ"
+	[NRF24_IRQ_OUT]="nRF_IRQ",
+	[NRF24_CSN_OUT]="nRF_CSN",
+	[NRF24_STATE_OUT]="nRF_state",
+	[NRF24_FIFO_TX_OUT]="nRF_fifo_tx",
+	[NRF24_FIFO_RX_OUT]="nRF_fifo_rx",
+	[NRF24_ON_AIR_OUT]="nRF_on_air"
+};
+
+static const uint8_t irq_bits[NRF24_IRQ_COUNT]={
+	[NRF24_CE_IN]=1,
+	[NRF24_IRQ_OUT]=1,
+	[NRF24_CSN_OUT]=1,
+	[NRF24_STATE_OUT]=4,
+	[NRF24_FIFO_TX_OUT]=2,
+	[NRF24_FIFO_RX_OUT]=2,
+	[NRF24_ON_AIR_OUT]=1
+};
+
+static const char * profile_names[NRF_NB_PROFILE_POINTS]={
+	[NRF_PROFILE_SPI]="spi_nRF",
+	[NRF_PROFILE_CSN]="csn_nRF",
+	[NRF_PROFILE_FINISH_SPI]="finish_spi",
+	[NRF_PROFILE_UPDATE_NRF]="update_nRF",
+	[NRF_PROFILE_DISPATCH]="dispatch_sent_packet",
+	[NRF_PROFILE_CB_CE]="cb_ce",
+	[NRF_PROFILE_CB_TX_FINISHED]="cb_tx_finished",
+	[NRF_PROFILE_CB_RX_ACK_TIMEOUT]="cb_rx_ack_timeout",
+	[NRF_PROFILE_CB_ARD_ELAPSED]="cb_ard_elapsed",
+	[NRF_PROFILE_CB_DELAY_TIMER]="cb_delay_timer",
+	[NRF_PROFILE_CB_MEDIUM_DELIVER]="cb_medium_deliver",
+	[NRF_PROFILE_LOG]="logging"
+};
+
+static const char * state_names[NRF_NB_STATES]={
+	[NRF_POWER_DOWN]="Power Down",
+	[NRF_START_UP]="Start up",
+	[NRF_STANDBY1]="Standby-I",
+	[NRF_RX_SETTLING]="RX Settling",
+	[NRF_RX_MODE]="RX Mode",
+	[NRF_TX_SETTLING]="TX Settling",
+	[NRF_TX_MODE]="TX Mode",
+	[NRF_STANDBY2]="Standby-II",
+	[NRF_RX_SETTLING_FOR_ACK]="RX Settling for ACK",
+	[NRF_RX_MODE_FOR_ACK]="RX Mode for ACK",
+	[NRF_TX_SETTLING_FOR_ACK]="TX Settling for ACK",
+	[NRF_TX_MODE_FOR_ACK]="TX Mode for ACK"
 };
 
 static const uint8_t regs_len_bytes[30]={1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 5, 5, 1, 1, 1, 1, 5, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 1, 1};
@@ -68,15 +200,502 @@ static const uint8_t regs_len_bytes[30]={1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 5, 5, 1,
 static void handle_pin_IRQ(nRF_t * nRF);
 static void update_nRF(nRF_t * nRF);
 static void update_fifo_status(nRF_t * nRF);
+static void reset_nRF(nRF_t * nRF);
 static void do_TX(nRF_t * nRF);
 static void do_TX_ack(nRF_t * nRF);
+static void reg_write(nRF_t * const nRF, const uint8_t reg, const uint64_t value);
+static void air_update_state(nRF_t const * const nRF);
+static void air_update_config(nRF_t const * const nRF);
 static avr_cycle_count_t cb_delay_timer(avr_t * avr, avr_cycle_count_t when, void * param);
 static avr_cycle_count_t cb_tx_finished(avr_t * avr, avr_cycle_count_t when, void * param);
 static avr_cycle_count_t cb_ard_elapsed(avr_t * avr, avr_cycle_count_t when, void * param);
+static avr_cycle_count_t cb_rx_ack_timeout(avr_t * avr, avr_cycle_count_t when, void * param);
+static avr_cycle_count_t cb_model_irq(avr_t * avr, avr_cycle_count_t when, void * param);
+static avr_cycle_count_t cb_fault_timeline(avr_t * avr, avr_cycle_count_t when, void * param);
+static void medium_send_packet(nRF_t * nRF, const uint32_t time_on_air_us);
+static void medium_send_ack(nRF_t * nRF, const uint32_t time_on_air_us);
+
+static uint64_t profile_now_ns(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec*1000000000ULL+now.tv_nsec;
+}
+
+static uint64_t profile_enter(void) //returns 0 if the profiler is off
+{
+	if(!profile)
+		return 0;
+
+	if(profile_depth<NRF_PROFILE_DEPTH_MAX)
+		profile_children_ns[profile_depth]=0;
+	profile_depth++;
+
+	return profile_now_ns();
+}
+
+static uint16_t profile_bucket(const uint64_t ns)
+{
+	if(ns<4)
+		return ns;
+
+	const uint8_t msb=63-__builtin_clzll(ns);
+	return 4*(msb-1)+((ns>>(msb-2))&3);
+}
+
+static uint64_t profile_bucket_end_ns(const uint16_t bucket) //first value of the next bucket
+{
+	const uint16_t next=bucket+1;
+	if(next<4)
+		return next;
+
+	return (uint64_t)(4+next%4)<<(next/4-1);
+}
+
+static void profile_leave(const profile_point_t point, const uint64_t start)
+{
+	if(!start || !profile_depth) //profiler switched on or off in between
+		return;
+
+	const uint64_t ns=profile_now_ns()-start;
+	uint64_t children=0;
+
+	profile_depth--;
+	if(profile_depth<NRF_PROFILE_DEPTH_MAX)
+		children=profile_children_ns[profile_depth];
+
+	if(profile_depth==0)
+		profile_outer_ns+=ns;
+	else if(profile_depth-1<NRF_PROFILE_DEPTH_MAX)
+		profile_children_ns[profile_depth-1]+=ns;
+
+	profile_stats_t * const stat=&profile_stats[point];
+	stat->nb_calls++;
+	stat->total_ns+=ns;
+	stat->self_ns+=(children<ns)?(ns-children):0;
+	stat->histogram[profile_bucket(ns)]++;
+}
+
+static uint64_t profile_percentile_ns(profile_stats_t const * const stat, const double percentile)
+{
+	const uint64_t rank=stat->nb_calls*percentile;
+	uint64_t count=0;
+
+	uint16_t i;
+	for(i=0; i<NRF_PROFILE_NB_BUCKETS; i++)
+	{
+		count+=stat->histogram[i];
+		if(count>rank)
+			return profile_bucket_end_ns(i);
+	}
+
+	return profile_bucket_end_ns(NRF_PROFILE_NB_BUCKETS-1);
+}
+
+static void profile_report(void)
+{
+	const uint64_t wall_ns=profile_now_ns()-profile_start_ns;
+
+	printf("nRF: self-profiler, %.3fs wall clock time, %.3fs (%.1f%%) in simavr-nRF24, %.3fs (%.1f%%) in AVR cores and the rest of simavr\n", wall_ns/1E9, \
+			profile_outer_ns/1E9, 100.0*profile_outer_ns/wall_ns, (wall_ns-profile_outer_ns)/1E9, 100.0*(wall_ns-profile_outer_ns)/wall_ns);
+	printf("nRF: %-20s %12s %12s %12s %10s %10s %10s\n", "entry point", "calls", "total ms", "self ms", "p50 ns", "p99 ns", "p99.9 ns");
+
+	uint8_t i;
+	for(i=0; i<NRF_NB_PROFILE_POINTS; i++)
+	{
+		profile_stats_t const * const stat=&profile_stats[i];
+		if(!stat->nb_calls)
+			continue;
+
+		printf("nRF: %-20s %12lu %12.3f %12.3f %10lu %10lu %10lu\n", profile_names[i], (unsigned long)stat->nb_calls, stat->total_ns/1E6, stat->self_ns/1E6, \
+				(unsigned long)profile_percentile_ns(stat, 0.5), (unsigned long)profile_percentile_ns(stat, 0.99), (unsigned long)profile_percentile_ns(stat, 0.999));
+	}
+
+	uint16_t m;
+	for(m=0; m<nb_modules; m++)
+	{
+		const double simulated_s=CYCLES_TO_MS_FLOAT(modules[m]->avr, modules[m]->avr->cycle-modules[m]->cold->profile_cycle_start)/1E3;
+		printf("nRF %s: AVR simulated %.3fs, %.3f simulated seconds per wall clock second\n", modules[m]->cold->name, simulated_s, simulated_s/(wall_ns/1E9));
+	}
+}
+
+//only raise on a change to avoid redundant entries in VCD-files
+static void raise_trace_irq(nRF_t const * const nRF, const uint8_t irq, const uint32_t value)
+{
+	if(nRF->remote)
+		return;
+
+	if(nRF->irq[irq].value!=value)
+		avr_raise_irq(nRF->irq+irq, value);
+}
+
+static void until_reached(until_t const * const until, nRF_t const * const nRF, char const * const what)
+{
+	if(until_done)
+		return;
+
+	until_done=true;
+	until_result=until->result;
+
+	printf("nRF: run until: %s", what);
+	if(nRF)
+		printf(" (nRF %s, %.3fms)", nRF->cold->name, CYCLES_TO_MS_FLOAT(nRF->avr, nRF->avr->cycle));
+	printf(", result %d\n", until->result);
+}
+
+static void until_event(const nRF_event_t event, nRF_t const * const nRF, nRF_t const * const peer)
+{
+	uint8_t i;
+	for(i=0; i<nb_untils; i++)
+	{
+		until_t * const until=&untils[i];
+
+		if(until->type==NRF_UNTIL_DELIVERED && event==NRF_EVENT_RX_DELIVERED && (!until->nRF || until->nRF==nRF) && (!until->peer || until->peer==peer))
+		{
+			if(++until->count==until->nb_packets)
+				until_reached(until, nRF, "packets delivered");
+		}
+		else if(until->type==NRF_UNTIL_MAX_RT && event==NRF_EVENT_MAX_RT && (!until->nRF || until->nRF==nRF))
+			until_reached(until, nRF, "MAX_RT");
+	}
+}
+
+static void until_registers(nRF_t const * const nRF)
+{
+	uint8_t i;
+	for(i=0; i<nb_untils; i++)
+	{
+		until_t const * const until=&untils[i];
+		if(until->type==NRF_UNTIL_REGISTER && until->nRF==nRF && (nRF->regs[until->reg]&until->mask)==until->value)
+			until_reached(until, nRF, "register value");
+	}
+}
+
+static void fire_event(const nRF_event_t event, nRF_t const * const nRF, nRF_t const * const peer, packet_tx_t const * const packet)
+{
+	if(nb_untils)
+		until_event(event, nRF, peer);
+
+	uint8_t i;
+	for(i=0; i<nb_event_callbacks[event]; i++)
+		event_callbacks[event][i].cb(event, nRF, peer, packet, event_callbacks[event][i].param);
+}
+
+static uint8_t fifo_tx_used(nRF_t const * const nRF)
+{
+	return nRF->fifo_tx_entries+nRF->ack_payloads_entries;
+}
+
+static void flush_ack_payloads(nRF_t * const nRF)
+{
+	nRF->ack_payloads_entries=0;
+	nRF->ack_payloads_free=0b111;
+	memset(nRF->cold->ack_queue_len, 0, sizeof(nRF->cold->ack_queue_len));
+}
+
+static void fifo_tx_push(nRF_t * const nRF) //fifo_tx[fifo_tx_entries] has been written
+{
+	nRF->cold->fifo_tx[nRF->fifo_tx_entries].PID=nRF->PID;
+	nRF->PID=(nRF->PID+1)&3;
+	nRF->fifo_tx_entries++;
+	update_fifo_status(nRF);
+	nRF->tx_in_progress=false;
+	nRF->tx_finished=false;
+	nRF->ard_has_elapsed=false;
+	nRF->nb_retries=0;
+	nRF->rx_ack_timeout=false;
+}
+
+static behavioral_model_t * model_of(nRF_t * const nRF)
+{
+	if(!nRF->cold->model)
+	{
+		nRF->cold->model=calloc(1, sizeof(behavioral_model_t));
+		if(!nRF->cold->model)
+			err(1, "nRF %s: allocating behavioral model failed", nRF->cold->name);
+		nRF->cold->model->cycle_last_payload=nRF->cold->model_cycle_init;
+	}
+	return nRF->cold->model;
+}
+
+static void model_learn(nRF_t * const nRF) //the firmware has written fifo_tx[fifo_tx_entries]
+{
+	behavioral_model_t * const model=model_of(nRF);
+
+	model->packets[model->head]=nRF->cold->fifo_tx[nRF->fifo_tx_entries];
+	model->intervals[model->head]=nRF->avr->cycle-model->cycle_last_payload;
+	model->cycle_last_payload=nRF->avr->cycle;
+	model->head=(model->head+1)%NRF_MODEL_PACKETS;
+	if(model->nb_packets<NRF_MODEL_PACKETS)
+		model->nb_packets++;
+}
+
+static void telemetry_publish(nRF_t const * const nRF)
+{
+	if(!telemetry || nRF->remote)
+		return;
+
+	nRF_telemetry_slot_t * const slot=&telemetry->slots[nRF->index];
+	uint32_t seq=slot->seq;
+
+	__atomic_store_n(&slot->seq, seq+1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	memcpy(slot->name, nRF->cold->name, NRF_SZ_NAME);
+	slot->state=nRF->state;
+	slot->pin_CE=nRF->pin_CE;
+	slot->pin_IRQ=nRF->pin_IRQ;
+	slot->reg_status=nRF->regs[REG_STATUS];
+	slot->fifo_tx_entries=fifo_tx_used(nRF);
+	slot->fifo_rx_entries=nRF->fifo_rx_entries;
+	slot->nb_retries=nRF->nb_retries;
+	slot->time_ms=CYCLES_TO_MS_FLOAT(nRF->avr, nRF->avr->cycle);
+
+	slot->nb_packets_sent=nRF->cold->stats.nb_packets_sent;
+	slot->nb_packets_received=nRF->cold->stats.nb_packets_received;
+	slot->nb_acks_sent=nRF->cold->stats.nb_acks_sent;
+	slot->nb_acks_received=nRF->cold->stats.nb_acks_received;
+	slot->nb_retransmissions=nRF->cold->stats.nb_retransmissions;
+	slot->nb_max_rt=nRF->cold->stats.nb_max_rt;
+
+	slot->last_tx_time_ms=CYCLES_TO_MS_FLOAT(nRF->avr, nRF->cold->avr_cycle_last_tx);
+	slot->last_tx_is_ack=nRF->rx_send_ack;
+	slot->last_tx_PID=nRF->cold->packet_being_sent.PID;
+	slot->last_tx_nb_bytes=nRF->cold->packet_being_sent.nb_bytes;
+
+	slot->last_rx_valid=nRF->last_rx_valid;
+	slot->last_rx_PID=nRF->cold->last_rx.PID;
+	slot->last_rx_pipe=nRF->cold->last_rx.pipe;
+	slot->last_rx_nb_bytes=nRF->cold->last_rx.nb_bytes;
+
+	__atomic_store_n(&slot->seq, seq+2, __ATOMIC_RELEASE);
+}
+
+//Chrome trace / Perfetto JSON, one process per nRF with a thread for its states and one for the packets on air
+#define TRACE_US(nRF, cycles) (CYCLES_TO_MS_FLOAT((nRF)->avr, (cycles))*1E3)
+#define TRACE_TID_STATE 1
+#define TRACE_TID_AIR 2
+
+static void trace_metadata(nRF_t const * const nRF)
+{
+	fprintf(trace, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,\"args\":{\"name\":\"%s\"}},\n", nRF->index+1, nRF->cold->name);
+	fprintf(trace, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":%u,\"args\":{\"name\":\"state\"}},\n", nRF->index+1, TRACE_TID_STATE);
+	fprintf(trace, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":%u,\"args\":{\"name\":\"air\"}},\n", nRF->index+1, TRACE_TID_AIR);
+}
+
+static void trace_state(nRF_t const * const nRF, const state_nRF_t state)
+{
+	fprintf(trace, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f},\n", state_names[state], nRF->index+1, TRACE_TID_STATE, \
+			TRACE_US(nRF, nRF->cycle_state_entered), TRACE_US(nRF, nRF->avr->cycle-nRF->cycle_state_entered));
+}
+
+static void trace_airtime(nRF_t * const nRF, const bool is_ack, const uint32_t time_on_air_us)
+{
+	double ts=TRACE_US(nRF, nRF->avr->cycle);
+
+	fprintf(trace, "{\"name\":\"%s PID %u, %u bytes\",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f,\"dur\":%u},\n", is_ack?"ACK":"TX", nRF->cold->packet_being_sent.PID, nRF->cold->packet_being_sent.nb_bytes, \
+			nRF->index+1, TRACE_TID_AIR, ts, time_on_air_us);
+
+	if(!is_ack)
+	{
+		nRF->cold->trace_flow=++trace_flow_id;
+		fprintf(trace, "{\"name\":\"ACK\",\"cat\":\"ack\",\"ph\":\"s\",\"id\":%lu,\"pid\":%u,\"tid\":%u,\"ts\":%.3f},\n", (unsigned long)nRF->cold->trace_flow, nRF->index+1, TRACE_TID_AIR, ts);
+	}
+	else if(nRF->cold->trace_flow)
+	{
+		fprintf(trace, "{\"name\":\"ACK\",\"cat\":\"ack\",\"ph\":\"f\",\"bp\":\"e\",\"id\":%lu,\"pid\":%u,\"tid\":%u,\"ts\":%.3f},\n", (unsigned long)nRF->cold->trace_flow, nRF->index+1, TRACE_TID_AIR, ts);
+		nRF->cold->trace_flow=0;
+	}
+}
+
+static void trace_irq(nRF_t const * const nRF)
+{
+	fprintf(trace, "{\"name\":\"IRQ %s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f},\n", nRF->pin_IRQ?"high":"low", nRF->index+1, TRACE_TID_STATE, TRACE_US(nRF, nRF->avr->cycle));
+}
+
+static retransmit_advisor_t * advisor_of(nRF_t * const nRF)
+{
+	if(!nRF->cold->advisor)
+	{
+		nRF->cold->advisor=calloc(1, sizeof(retransmit_advisor_t));
+		if(!nRF->cold->advisor)
+			err(1, "nRF %s: allocating retransmit advisor failed", nRF->cold->name);
+	}
+	return nRF->cold->advisor;
+}
+
+static void advisor_tx(nRF_t * const nRF, const uint32_t time_on_air_us)
+{
+	retransmit_advisor_t * const a=advisor_of(nRF);
+
+	a->nb_attempts++;
+	a->airtime_us+=time_on_air_us;
+	a->payload_bytes+=nRF->cold->packet_being_sent.nb_bytes;
+}
+
+static void advisor_tx_end(nRF_t * const nRF)
+{
+	retransmit_advisor_t * const a=advisor_of(nRF);
+
+	a->cycle_tx_end=nRF->avr->cycle;
+	if((nRF->regs[REG_SETUP_RETR]>>ARD)>a->ard_max)
+		a->ard_max=nRF->regs[REG_SETUP_RETR]>>ARD;
+}
+
+static void advisor_ack(nRF_t * const nRF_PTX, nRF_t const * const nRF_PRX, const bool late)
+{
+	retransmit_advisor_t * const a=advisor_of(nRF_PTX);
+	uint32_t delay_us=CYCLES_TO_NS(nRF_PTX->avr, nRF_PTX->avr->cycle-a->cycle_tx_end)/1000;
+	int32_t margin_us=((nRF_PTX->regs[REG_SETUP_RETR]>>ARD)+1)*250-(int32_t)delay_us;
+
+	if(a->nb_acks==0 || margin_us<a->margin_min_us)
+		a->margin_min_us=margin_us;
+	if(delay_us>a->ack_delay_max_us)
+		a->ack_delay_max_us=delay_us;
+	if(nRF_PRX->cold->packet_being_sent.nb_bytes>a->ack_payload_max)
+		a->ack_payload_max=nRF_PRX->cold->packet_being_sent.nb_bytes;
+	a->nb_acks++;
+	strncpy(a->peer, nRF_PRX->cold->name, NRF_SZ_NAME);
+
+	if(late)
+		a->nb_acks_late++;
+	else
+		a->retries[nRF_PTX->nb_retries&0x0f]++;
+}
+
+static void advisor_report(nRF_t const * const nRF)
+{
+	retransmit_advisor_t const * const a=nRF->cold->advisor;
+
+	if(!a || a->nb_attempts==0 || (a->nb_acks==0 && nRF->cold->stats.nb_max_rt==0))
+		return; //not a PTX using auto-retransmit
+
+	if(a->nb_acks==0)
+	{
+		printf("nRF %s: advisor: %u attempts and no ACK at all, check addresses, channel and data rate\n", nRF->cold->name, a->nb_attempts);
+		return;
+	}
+
+	printf("nRF %s -> %s: advisor: %u ACKs (%u late), ACK-payload up to %u bytes, ACK arrives at most %uµs after end of packet, smallest margin %dµs\n", \
+			nRF->cold->name, a->peer, a->nb_acks, a->nb_acks_late, a->ack_payload_max, a->ack_delay_max_us, a->margin_min_us);
+
+	printf("nRF %s: advisor: retries needed:", nRF->cold->name);
+	uint8_t i;
+	for(i=0; i<16; i++)
+		if(a->retries[i])
+			printf(" %u:%u", i, a->retries[i]);
+	printf("\n");
+
+	if(a->ack_delay_max_us>16*250)
+	{
+		printf("nRF %s: advisor: ACK arrives after the largest possible ARD, lower the ACK-payload size or raise the data rate\n", nRF->cold->name);
+		return;
+	}
+
+	uint8_t ard=(a->ack_delay_max_us+249)/250-1;
+	if(a->ack_delay_max_us==0)
+		ard=0;
+
+	uint32_t nb_acks_in_time=a->nb_acks-a->nb_acks_late;
+	if(nb_acks_in_time==0)
+	{
+		printf("nRF %s: advisor: recommending ARD=%u (%uµs), no ACK arrived in time so no ARC can be recommended\n", nRF->cold->name, ard, (ard+1)*250);
+		return;
+	}
+
+	//per-attempt loss, assumed independent from one attempt to the next
+	double p=1.0-(double)nb_acks_in_time/a->nb_attempts;
+	if(p<0)
+		p=0;
+
+	//with a constant per-attempt loss every attempt costs the same airtime and ARD, so the goodput is the same for all ARC and only the residual loss after ARC retries changes: take the smallest ARC reaching the target (ARC=0 would disable auto-retransmit and ACK)
+	uint8_t arc=1;
+	double residual=p*p;
+	while(arc<15 && residual>NRF_ADVISOR_RESIDUAL_LOSS)
+	{
+		arc++;
+		residual*=p;
+	}
+
+	double attempts_per_packet=(p<1.0)?(1.0-residual)/(1.0-p):arc+1;
+	double attempt_us=130+(double)a->airtime_us/a->nb_attempts+(ard+1)*250;
+	double goodput_kbps=1000.0*8*a->payload_bytes/a->nb_attempts*(1.0-residual)/(attempts_per_packet*attempt_us);
+
+	printf("nRF %s: advisor: per-attempt loss %.2f%%, recommending ARD=%u (%uµs) and ARC=%u, expected residual loss %.4f%% and goodput %.1fkbps (currently ARD up to %u)\n", \
+			nRF->cold->name, 100*p, ard, (ard+1)*250, arc, 100*residual, goodput_kbps, a->ard_max);
+}
+
+static double state_current_uA(nRF_t const * const nRF)
+{
+	switch(nRF->state)
+	{
+		case NRF_POWER_DOWN:
+			return 0.9;
+
+		case NRF_START_UP:
+			return 400;
+
+		case NRF_STANDBY1:
+			return 26;
+
+		case NRF_STANDBY2:
+			return 320;
+
+		case NRF_RX_SETTLING:
+		case NRF_RX_SETTLING_FOR_ACK:
+			return 8900;
+
+		case NRF_TX_SETTLING:
+		case NRF_TX_SETTLING_FOR_ACK:
+			return 8000;
+
+		case NRF_RX_MODE:
+		case NRF_RX_MODE_FOR_ACK:
+			if(nRF->regs[REG_RF_SETUP]&(1<<RF_DR_LOW))
+				return 12600; //250kbps
+			else if(nRF->regs[REG_RF_SETUP]&(1<<RF_DR_HIGH))
+				return 13500; //2Mbps
+			else
+				return 13100; //1Mbps
+
+		case NRF_TX_MODE:
+		case NRF_TX_MODE_FOR_ACK:
+			return current_tx_uA[(nRF->regs[REG_RF_SETUP]>>RF_PWR)&0b11];
+
+		default:
+			errx(1, "nRF: internal error: state_current_uA: invalid state %u for nRF %s", nRF->state, nRF->cold->name);
+	}
+}
+
+//integrate the time spent in the previous state, to be called after every possible state change
+static void account_energy(nRF_t * const nRF)
+{
+	if(nRF->remote)
+		return;
+
+	avr_cycle_count_t cycles=nRF->avr->cycle-nRF->cold->energy_cycle_last;
+
+	if(nRF->state!=nRF->cold->energy_state)
+	{
+		if(trace)
+			trace_state(nRF, nRF->cold->energy_state);
+		nRF->cycle_state_entered=nRF->avr->cycle;
+		raise_trace_irq(nRF, NRF24_STATE_OUT, nRF->state);
+	}
+
+	nRF->cold->residency_cycles[nRF->cold->energy_state]+=cycles;
+	nRF->cold->charge_uC+=nRF->cold->energy_current_uA*cycles/nRF->avr->frequency;
+
+	nRF->cold->energy_cycle_last=nRF->avr->cycle;
+	nRF->cold->energy_state=nRF->state;
+	nRF->cold->energy_current_uA=state_current_uA(nRF);
+}
 
 static void finish_spi(nRF_t * const nRF)
 {
-	LOG(NRF_LOG_DEBUG, "nRF %s: finish_spi called\n", nRF->name);
+	const uint64_t profile_start=profile_enter();
+
+	LOG(NRF_LOG_DEBUG, "nRF %s: finish_spi called\n", nRF->cold->name);
 
 	switch(nRF->state_spi)
 	{
@@ -98,29 +717,27 @@ static void finish_spi(nRF_t * const nRF)
 						nRF->regs[REG_STATUS]&=~(1<<MAX_RT);
 					break;
 				case REG_RF_CH:
-					nRF->regs[REG_RF_CH]=nRF->spi_value;
+					reg_write(nRF, REG_RF_CH, nRF->spi_value);
 					nRF->regs[REG_OBSERVE_TX]&=~(0b1111<<PLOS_CNT);
 					break;
+				case REG_OBSERVE_TX:
+				case REG_RPD:
+					LOG(NRF_LOG_WARNING, "WARNING: nRF %s: register 0x%02x is read-only, write ignored\n", nRF->cold->name, nRF->spi_reg_index);
+					break;
 				default:
-					nRF->regs[nRF->spi_reg_index]=nRF->spi_value;
+					reg_write(nRF, nRF->spi_reg_index, nRF->spi_value);
 					break;
 			}
+			air_update_config(nRF);
 			break;
 
 		case NRF_SPI_W_TX_PAYLOAD:
-			nRF->fifo_tx[nRF->fifo_tx_entries].PID=nRF->PID;
-			nRF->PID=(nRF->PID+1)&3;
-			nRF->fifo_tx_entries++;
-			update_fifo_status(nRF);
-			nRF->tx_in_progress=false;
-			nRF->tx_finished=false;
-			nRF->ard_has_elapsed=false;
-			nRF->nb_retries=0;
-			nRF->rx_ack_timeout=false;
+			model_learn(nRF);
+			fifo_tx_push(nRF);
 			break;
 
 		case NRF_SPI_R_RX_PAYLOAD:
-			memmove(&nRF->fifo_rx[0], &nRF->fifo_rx[1], 2*sizeof(packet_rx_t));
+			memmove(&nRF->cold->fifo_rx[0], &nRF->cold->fifo_rx[1], 2*sizeof(packet_rx_t));
 			nRF->fifo_rx_entries--;
 			update_fifo_status(nRF);
 			break;
@@ -128,26 +745,39 @@ static void finish_spi(nRF_t * const nRF)
 		case NRF_SPI_READ_LENGTH_PAYLOAD: //nothing to do
 			break;
 
+		case NRF_SPI_IGNORE: //nothing to do
+			break;
+
 		case NRF_SPI_WRITE_ACK_PAYLOAD:
-			nRF->fifo_tx_entries++;
+		{
+			uint8_t slot=nRF->cold->ack_payload_writing;
+			uint8_t pipe=nRF->cold->ack_payloads[slot].ack_packet.pipe;
+			nRF->cold->ack_queue[pipe][(nRF->cold->ack_queue_head[pipe]+nRF->cold->ack_queue_len[pipe])%3]=slot;
+			nRF->cold->ack_queue_len[pipe]++;
+			nRF->ack_payloads_entries++;
 			update_fifo_status(nRF);
 			break;
+		}
 	}
 
 	nRF->state_spi=NRF_SPI_IDLE;
 
 	update_nRF(nRF);
 	handle_pin_IRQ(nRF);
+
+	profile_leave(NRF_PROFILE_FINISH_SPI, profile_start);
 }
 
 static void update_nRF(nRF_t * const nRF)
 {
+	const uint64_t profile_start=profile_enter();
+
 	switch(nRF->state)
 	{
 		case NRF_POWER_DOWN:
 			if(nRF->regs[REG_CONFIG]&(1<<PWR_UP))
 			{
-				LOG(NRF_LOG_VERBOSE, "nRF %s: waking up...\n", nRF->name);
+				LOG(NRF_LOG_VERBOSE, "nRF %s: waking up...\n", nRF->cold->name);
 				nRF->state=NRF_START_UP;
 				nRF->state_next=NRF_STANDBY1;
 				avr_cycle_timer_register(nRF->avr, MS_TO_CYCLES(nRF->avr, 1.5), &cb_delay_timer, nRF);
@@ -160,42 +790,42 @@ static void update_nRF(nRF_t * const nRF)
 		case NRF_STANDBY1:
 			if(!(nRF->regs[REG_CONFIG]&(1<<PWR_UP)))
 			{
-				LOG(NRF_LOG_VERBOSE, "nRF %s: going to power down\n", nRF->name);
+				LOG(NRF_LOG_VERBOSE, "nRF %s: going to power down\n", nRF->cold->name);
 				nRF->state=NRF_POWER_DOWN;
 			}
 			else if(!(nRF->regs[REG_CONFIG]&(1<<PRIM_RX)) && nRF->pin_CE && nRF->fifo_tx_entries)
 			{
-				LOG(NRF_LOG_VERBOSE, "nRF %s: going to TX-mode\n", nRF->name);
+				LOG(NRF_LOG_VERBOSE, "nRF %s: going to TX-mode\n", nRF->cold->name);
 				nRF->state=NRF_TX_SETTLING;
 				nRF->state_next=NRF_TX_MODE;
 				avr_cycle_timer_register(nRF->avr, US_TO_CYCLES(nRF->avr, 10+130), &cb_delay_timer, nRF); //HACK, TODO: check if CE was high for >=10µs
 			}
 			else if(nRF->regs[REG_CONFIG]&(1<<PRIM_RX) && nRF->pin_CE)
 			{
-				LOG(NRF_LOG_VERBOSE, "nRF %s: going to RX-mode\n", nRF->name);
+				LOG(NRF_LOG_VERBOSE, "nRF %s: going to RX-mode\n", nRF->cold->name);
 				nRF->state=NRF_RX_SETTLING;
 				nRF->state_next=NRF_RX_MODE;
 				avr_cycle_timer_register(nRF->avr, US_TO_CYCLES(nRF->avr, 130), &cb_delay_timer, nRF);
 			}
 			else if(!(nRF->regs[REG_CONFIG]&(1<<PRIM_RX)) && nRF->pin_CE && nRF->fifo_tx_entries==0)
 			{
-				LOG(NRF_LOG_VERBOSE, "nRF %s: no packets to TX, going into Standby2\n", nRF->name);
+				LOG(NRF_LOG_VERBOSE, "nRF %s: no packets to TX, going into Standby2\n", nRF->cold->name);
 				nRF->state=NRF_STANDBY2;
 			}
 			else
-				LOG(NRF_LOG_DEBUG, "nRF %s: no action, remaining in Standby1, CE=%u CSN=%u IRQ=%u\n", nRF->name, nRF->pin_CE, nRF->pin_CSN, nRF->pin_IRQ);
+				LOG(NRF_LOG_DEBUG, "nRF %s: no action, remaining in Standby1, CE=%u CSN=%u IRQ=%u\n", nRF->cold->name, nRF->pin_CE, nRF->pin_CSN, nRF->pin_IRQ);
 			break;
 
 		case NRF_RX_SETTLING:
 			if(!(nRF->regs[REG_CONFIG]&(1<<PWR_UP)))
 			{
-				LOG(NRF_LOG_VERBOSE, "nRF %s: going to power down\n", nRF->name);
+				LOG(NRF_LOG_VERBOSE, "nRF %s: going to power down\n", nRF->cold->name);
 				nRF->state=NRF_POWER_DOWN;
 				nRF->state_next=NRF_POWER_DOWN; //there might be a timer firing that will set state to state_next, so write both
 			}
 			else if(!nRF->pin_CE)
 			{
-				LOG(NRF_LOG_VERBOSE, "nRF %s: RX Settling aborted because CE went low, going into Standby1\n", nRF->name);
+				LOG(NRF_LOG_VERBOSE, "nRF %s: RX Settling aborted because CE went low, going into Standby1\n", nRF->cold->name);
 				nRF->state=NRF_STANDBY1;
 				nRF->state_next=NRF_STANDBY1;
 			}
@@ -204,7 +834,7 @@ static void update_nRF(nRF_t * const nRF)
 		case NRF_TX_SETTLING:
 			if(!(nRF->regs[REG_CONFIG]&(1<<PWR_UP)))
 			{
-				LOG(NRF_LOG_VERBOSE, "nRF %s: going to power down\n", nRF->name);
+				LOG(NRF_LOG_VERBOSE, "nRF %s: going to power down\n", nRF->cold->name);
 				nRF->state=NRF_POWER_DOWN;
 				nRF->state_next=NRF_POWER_DOWN; //there might be a timer firing that will set state to state_next, so write both
 			}
@@ -213,7 +843,7 @@ static void update_nRF(nRF_t * const nRF)
 		case NRF_TX_MODE:
 			if(nRF->tx_finished && nRF->tx_wait_for_ack)
 			{
-				LOG(NRF_LOG_VERBOSE, "nRF %s: going into RX-mode to receive ACK, registering cb_delay_timer\n", nRF->name);
+				LOG(NRF_LOG_VERBOSE, "nRF %s: going into RX-mode to receive ACK, registering cb_delay_timer\n", nRF->cold->name);
 				nRF->tx_finished=false;
 				nRF->state=NRF_RX_SETTLING_FOR_ACK;
 				nRF->state_next=NRF_RX_MODE_FOR_ACK;
@@ -221,18 +851,18 @@ static void update_nRF(nRF_t * const nRF)
 			}
 			else if(nRF->tx_finished && !nRF->pin_CE)
 			{
-				LOG(NRF_LOG_VERBOSE, "nRF %s: going to Standby1-mode\n", nRF->name);
+				LOG(NRF_LOG_VERBOSE, "nRF %s: going to Standby1-mode\n", nRF->cold->name);
 				nRF->tx_finished=false;
 				nRF->state=NRF_STANDBY1;
 			}
 			else if(!(nRF->regs[REG_CONFIG]&(1<<PWR_UP)))
 			{
-				LOG(NRF_LOG_VERBOSE, "nRF %s: going to power down\n", nRF->name);
+				LOG(NRF_LOG_VERBOSE, "nRF %s: going to power down\n", nRF->cold->name);
 				nRF->state=NRF_POWER_DOWN;
 			}
 			else if(nRF->pin_CE && nRF->fifo_tx_entries==0)
 			{
-				LOG(NRF_LOG_VERBOSE, "nRF %s: no packets to TX, going into Standby2\n", nRF->name);
+				LOG(NRF_LOG_VERBOSE, "nRF %s: no packets to TX, going into Standby2\n", nRF->cold->name);
 				nRF->state=NRF_STANDBY2;
 			}
 			break;
@@ -240,12 +870,12 @@ static void update_nRF(nRF_t * const nRF)
 		case NRF_RX_MODE:
 			if(!nRF->pin_CE)
 			{
-				LOG(NRF_LOG_VERBOSE, "nRF %s: leaving RX-mode for Standby1\n", nRF->name);
+				LOG(NRF_LOG_VERBOSE, "nRF %s: leaving RX-mode for Standby1\n", nRF->cold->name);
 				nRF->state=NRF_STANDBY1;
 			}
 			else if(!(nRF->regs[REG_CONFIG]&(1<<PWR_UP)))
 			{
-				LOG(NRF_LOG_VERBOSE, "nRF %s: going to power down\n", nRF->name);
+				LOG(NRF_LOG_VERBOSE, "nRF %s: going to power down\n", nRF->cold->name);
 				nRF->state=NRF_POWER_DOWN;
 			}
 			break;
@@ -253,12 +883,12 @@ static void update_nRF(nRF_t * const nRF)
 		case NRF_STANDBY2:
 			if(!(nRF->regs[REG_CONFIG]&(1<<PWR_UP)))
 			{
-				LOG(NRF_LOG_VERBOSE, "nRF %s: going to power down\n", nRF->name);
+				LOG(NRF_LOG_VERBOSE, "nRF %s: going to power down\n", nRF->cold->name);
 				nRF->state=NRF_POWER_DOWN;
 			}
 			else if(nRF->pin_CE && nRF->fifo_tx_entries)
 			{
-				LOG(NRF_LOG_VERBOSE, "nRF %s: going to TX-mode\n", nRF->name);
+				LOG(NRF_LOG_VERBOSE, "nRF %s: going to TX-mode\n", nRF->cold->name);
 				nRF->state=NRF_TX_SETTLING;
 				nRF->state_next=NRF_TX_MODE;
 				avr_cycle_timer_register(nRF->avr, US_TO_CYCLES(nRF->avr, 130), &cb_delay_timer, nRF);
@@ -268,18 +898,23 @@ static void update_nRF(nRF_t * const nRF)
 				if(nRF->ard_has_elapsed)
 				{
 					nRF->tx_wait_for_ack=false; //prevent cb_delay_timer to register cb_rx_ack_timeout before the new transmission has even started
-					LOG(NRF_LOG_VERBOSE, "nRF %s: ARD has elapsed\n", nRF->name);
+					LOG(NRF_LOG_VERBOSE, "nRF %s: ARD has elapsed\n", nRF->cold->name);
 					if(nRF->nb_retries==(nRF->regs[REG_SETUP_RETR]&(0b1111<<ARC)))
 					{
-						LOG(NRF_LOG_VERBOSE, "nRF %s: ARC reached, setting MAX_RT, going into Standby1\n", nRF->name);
+						LOG(NRF_LOG_VERBOSE, "nRF %s: ARC reached, setting MAX_RT, going into Standby1\n", nRF->cold->name);
+						nRF->cold->stats.nb_max_rt++;
+						if((nRF->regs[REG_OBSERVE_TX]>>PLOS_CNT)<15) //saturates, cleared by writing RF_CH
+							nRF->regs[REG_OBSERVE_TX]+=(1<<PLOS_CNT);
+						fire_event(NRF_EVENT_MAX_RT, nRF, NULL, &nRF->cold->fifo_tx[0]);
 						nRF->regs[REG_STATUS]|=(1<<MAX_RT);
 						handle_pin_IRQ(nRF);
 						nRF->state=NRF_STANDBY1;
 					}
 					else
 					{
-						LOG(NRF_LOG_VERBOSE, "nRF %s: going into TX to send again\n", nRF->name);
+						LOG(NRF_LOG_VERBOSE, "nRF %s: going into TX to send again\n", nRF->cold->name);
 						nRF->nb_retries++;
+						nRF->cold->stats.nb_retransmissions++;
 						nRF->state=NRF_TX_SETTLING;
 						nRF->state_next=NRF_TX_MODE;
 						avr_cycle_timer_register(nRF->avr, US_TO_CYCLES(nRF->avr, 130), &cb_delay_timer, nRF);
@@ -294,15 +929,17 @@ static void update_nRF(nRF_t * const nRF)
 		case NRF_RX_MODE_FOR_ACK:
 			if(nRF->tx_ack_received)
 			{
-				LOG(NRF_LOG_VERBOSE, "nRF %s: ACK received, going into Standby1\n", nRF->name);
+				LOG(NRF_LOG_VERBOSE, "nRF %s: ACK received, going into Standby1\n", nRF->cold->name);
 				nRF->state=NRF_STANDBY1;
+				avr_cycle_timer_cancel(nRF->avr, &cb_rx_ack_timeout, nRF); //would otherwise fire during the next transmission
+				avr_cycle_timer_cancel(nRF->avr, &cb_ard_elapsed, nRF);
 				nRF->tx_wait_for_ack=false;
 				nRF->tx_receive_ack_from=NULL;
 				nRF->rx_send_ack_to=NULL;
 			}
 			else if(nRF->rx_ack_timeout)
 			{
-				LOG(NRF_LOG_VERBOSE, "nRF %s: timeout while waiting for ACK, going into Standby2\n", nRF->name);
+				LOG(NRF_LOG_VERBOSE, "nRF %s: timeout while waiting for ACK, going into Standby2\n", nRF->cold->name);
 				nRF->rx_ack_timeout=false;
 				nRF->state=NRF_STANDBY2;
 			}
@@ -317,14 +954,14 @@ static void update_nRF(nRF_t * const nRF)
 				nRF->tx_finished=false;
 				if(nRF->pin_CE)
 				{
-					LOG(NRF_LOG_VERBOSE, "nRF %s: ACK transmitted, going back to RX-mode\n", nRF->name);
+					LOG(NRF_LOG_VERBOSE, "nRF %s: ACK transmitted, going back to RX-mode\n", nRF->cold->name);
 					nRF->state=NRF_RX_SETTLING;
 					nRF->state_next=NRF_RX_MODE;
 					avr_cycle_timer_register(nRF->avr, US_TO_CYCLES(nRF->avr, 130), &cb_delay_timer, nRF);
 				}
 				else
 				{
-					LOG(NRF_LOG_VERBOSE, "nRF %s: ACK transmitted, CE is low, going into Standby1\n", nRF->name);
+					LOG(NRF_LOG_VERBOSE, "nRF %s: ACK transmitted, CE is low, going into Standby1\n", nRF->cold->name);
 					nRF->state=NRF_STANDBY1;
 				}
 			}
@@ -333,6 +970,15 @@ static void update_nRF(nRF_t * const nRF)
 
 	do_TX(nRF);
 	do_TX_ack(nRF);
+
+	account_energy(nRF);
+	air_update_state(nRF);
+	telemetry_publish(nRF);
+
+	if(nb_untils_register)
+		until_registers(nRF);
+
+	profile_leave(NRF_PROFILE_UPDATE_NRF, profile_start);
 }
 
 static void update_fifo_status(nRF_t * const nRF)
@@ -347,15 +993,15 @@ static void update_fifo_status(nRF_t * const nRF)
 	else
 	{
 		nRF->regs[REG_STATUS]&=~(0b111<<RX_P_NO);
-		nRF->regs[REG_STATUS]|=(1<<RX_DR)|(nRF->fifo_rx[0].pipe<<RX_P_NO);
+		nRF->regs[REG_STATUS]|=(1<<RX_DR)|(nRF->cold->fifo_rx[0].pipe<<RX_P_NO);
 	}
 
-	if(nRF->fifo_tx_entries==3)
+	if(fifo_tx_used(nRF)==3)
 		nRF->regs[REG_STATUS]|=(1<<TX_FULL);
 	else
 		nRF->regs[REG_STATUS]&=~(1<<TX_FULL);
 
-	switch(nRF->fifo_tx_entries)
+	switch(fifo_tx_used(nRF))
 	{
 		case 0:
 			nRF->regs[REG_FIFO_STATUS]|=(1<<FIFO_TX_EMPTY);
@@ -378,7 +1024,7 @@ static void update_fifo_status(nRF_t * const nRF)
 			break;
 
 		default:
-			errx(1, "nRF: internal error: update_fifo_status: fifo_tx_entries>3 for nRF %s", nRF->name);
+			errx(1, "nRF: internal error: update_fifo_status: fifo_tx_entries>3 for nRF %s", nRF->cold->name);
 	}
 
 	switch(nRF->fifo_rx_entries)
@@ -404,12 +1050,20 @@ static void update_fifo_status(nRF_t * const nRF)
 			break;
 
 		default:
-			errx(1, "nRF: internal error: update_fifo_status: fifo_rx_entries>3 for nRF %s", nRF->name);
+			errx(1, "nRF: internal error: update_fifo_status: fifo_rx_entries>3 for nRF %s", nRF->cold->name);
 	}
+
+	raise_trace_irq(nRF, NRF24_FIFO_TX_OUT, fifo_tx_used(nRF));
+	raise_trace_irq(nRF, NRF24_FIFO_RX_OUT, nRF->fifo_rx_entries);
+
+	telemetry_publish(nRF);
 }
 
 static void handle_pin_IRQ(nRF_t * const nRF)
 {
+	if(nRF->remote) //proxy, the real nRF is handled by its own process
+		return;
+
 	bool IRQ=1;
 
 	if(!(nRF->regs[REG_CONFIG]&(1<<MASK_RX_DR)) && nRF->regs[REG_STATUS]&(1<<RX_DR))
@@ -419,123 +1073,461 @@ static void handle_pin_IRQ(nRF_t * const nRF)
 	if(!(nRF->regs[REG_CONFIG]&(1<<MASK_MAX_RT)) && nRF->regs[REG_STATUS]&(1<<MAX_RT))
 		IRQ=0;
 
+	bool edge=(IRQ!=nRF->pin_IRQ);
+
 	nRF->pin_IRQ=IRQ;
 
-	LOG(NRF_LOG_DEBUG, "handle_pin_IRQ nRF %s: IRQ set to %u\n", nRF->name, nRF->pin_IRQ);
+	if(nRF->cold->model && nRF->cold->model->active && edge && !IRQ)
+		avr_cycle_timer_register(nRF->avr, US_TO_CYCLES(nRF->avr, NRF_MODEL_IRQ_LATENCY_US), &cb_model_irq, nRF);
+
+	if(trace && edge)
+		trace_irq(nRF);
+
+	LOG(NRF_LOG_DEBUG, "handle_pin_IRQ nRF %s: IRQ set to %u\n", nRF->cold->name, nRF->pin_IRQ);
 
 	avr_raise_irq(nRF->irq+NRF24_IRQ_OUT, nRF->pin_IRQ);
+
+	telemetry_publish(nRF);
 }
 
 static void log_to_file(nRF_t * const nRF, const bool is_ack_packet, const uint8_t bytes_payload) //TODO improve this
 {
 	if(!is_ack_packet)
-		fprintf(nRF->log, "[%10.3fms] [delta %7.3fms] TX %2u bytes\n", CYCLES_TO_MS_FLOAT(nRF->avr, nRF->avr->cycle), CYCLES_TO_MS_FLOAT(nRF->avr, nRF->avr->cycle-nRF->avr_cycle_last_tx), bytes_payload);
+		fprintf(nRF->cold->log, "[%10.3fms] [delta %7.3fms] TX %2u bytes\n", CYCLES_TO_MS_FLOAT(nRF->avr, nRF->avr->cycle), CYCLES_TO_MS_FLOAT(nRF->avr, nRF->avr->cycle-nRF->cold->avr_cycle_last_tx), bytes_payload);
 	else
-		fprintf(nRF->log, "[%10.3fms] [delta %7.3fms] ACK %2u bytes\n", CYCLES_TO_MS_FLOAT(nRF->avr, nRF->avr->cycle), CYCLES_TO_MS_FLOAT(nRF->avr, nRF->avr->cycle-nRF->avr_cycle_last_tx), bytes_payload);
-
-	nRF->avr_cycle_last_tx=nRF->avr->cycle;
+		fprintf(nRF->cold->log, "[%10.3fms] [delta %7.3fms] ACK %2u bytes\n", CYCLES_TO_MS_FLOAT(nRF->avr, nRF->avr->cycle), CYCLES_TO_MS_FLOAT(nRF->avr, nRF->avr->cycle-nRF->cold->avr_cycle_last_tx), bytes_payload);
 }
 
-static void do_TX(nRF_t * const nRF)
+static void init_crc_tables(void)
 {
-	if(nRF->state!=NRF_TX_MODE || nRF->tx_in_progress || nRF->state_spi!=NRF_SPI_IDLE)
-		return;
+	uint16_t i;
+	uint8_t bit;
 
-	nRF->packet_being_sent.PID=nRF->fifo_tx[0].PID;
-	nRF->packet_being_sent.regular_packet.nb_bytes_addr=nRF->fifo_tx[0].regular_packet.nb_bytes_addr;
-	nRF->packet_being_sent.regular_packet.addr=nRF->fifo_tx[0].regular_packet.addr;
-	nRF->packet_being_sent.nb_bytes=nRF->fifo_tx[0].nb_bytes;
-	memcpy(nRF->packet_being_sent.data, nRF->fifo_tx[0].data, nRF->fifo_tx[0].nb_bytes);
-	nRF->packet_being_sent_valid=true;
-
-	uint8_t bytes_addr=nRF->packet_being_sent.regular_packet.nb_bytes_addr;
-	uint8_t bytes_payload=nRF->packet_being_sent.nb_bytes;
-	uint8_t bytes_crc=(nRF->regs[REG_CONFIG]&(1<<CRCO))?2:1;
-	uint32_t data_rate=(nRF->regs[REG_RF_SETUP]&(1<<RF_DR_LOW))?250E3:((nRF->regs[REG_RF_SETUP]&(1<<RF_DR_HIGH))?2E6:1E6);
-	uint32_t time_on_air_us=1.0E6*(8*(1+bytes_addr+bytes_payload+bytes_crc)+9)/data_rate;
-
-	LOG(NRF_LOG_VERBOSE, "nRF %s: transmitting %u bytes of payload, time on air is %u µs\n", nRF->name, bytes_payload, time_on_air_us);
-
-	if(nRF->log_tx_to_file)
+	for(i=0; i<256; i++)
 	{
-		LOG(NRF_LOG_VERBOSE, "nRF %s: logging TX to file\n", nRF->name);
-		log_to_file(nRF, false, bytes_payload);
-	}
+		uint16_t crc16=i<<8;
+		uint8_t crc8=i;
 
-	avr_cycle_timer_register(nRF->avr, US_TO_CYCLES(nRF->avr, time_on_air_us), &cb_tx_finished, nRF);
+		for(bit=0; bit<8; bit++)
+		{
+			crc16=(crc16&0x8000)?((crc16<<1)^0x1021):(crc16<<1); //CRC-16-CCITT
+			crc8=(crc8&0x80)?((crc8<<1)^0x07):(crc8<<1);
+		}
 
-	nRF->tx_in_progress=true;
+		crc16_table[i]=crc16;
+		crc8_table[i]=crc8;
+	}
 }
 
-static void do_TX_ack(nRF_t * const nRF)
+//CRC over nb_bits starting right after the preamble (address, PCF and payload) - whole bytes go through the table, only the last bit(s) shifted in by the 9 bit PCF are done bitwise
+static uint16_t frame_crc(uint8_t const * const frame, const uint16_t nb_bits, const uint8_t bytes_crc)
 {
-	if(nRF->state!=NRF_TX_MODE_FOR_ACK || nRF->tx_in_progress || nRF->state_spi!=NRF_SPI_IDLE)
-		return;
-
-	if(!nRF->last_rx_valid)
-		errx(1, "nRF: internal error: do_TX_ack: last_rx_valid==false for nRF %s", nRF->name);
+	uint8_t const * const data=&frame[1];
+	uint16_t nb_bytes=nb_bits>>3;
+	uint16_t i;
+	uint8_t bit;
 
-	if(nRF->regs[REG_FEATURE]&(1<<EN_ACK_PAY) && nRF->fifo_tx_entries)
+	if(bytes_crc==2)
 	{
-		LOG(NRF_LOG_DEBUG, "nRF %s: EN_ACK_PAY enabled, pending ACK-payload will be sent\n", nRF->name);
+		uint16_t crc=0xffff;
 
-		uint8_t i;
-		bool found=false;
-		for(i=0; i<nRF->fifo_tx_entries; i++)
+		for(i=0; i<nb_bytes; i++)
+			crc=(crc<<8)^crc16_table[((crc>>8)^data[i])&0xff];
+
+		for(bit=0; bit<(nb_bits&7); bit++)
 		{
-			if(nRF->fifo_tx[i].ack_packet.pipe==nRF->last_rx.pipe)
-			{
-				found=true;
-				break;
-			}
+			crc^=((data[nb_bytes]>>(7-bit))&1)<<15;
+			crc=(crc&0x8000)?((crc<<1)^0x1021):(crc<<1);
+		}
+
+		return crc;
+	}
+	else
+	{
+		uint8_t crc=0xff;
+
+		for(i=0; i<nb_bytes; i++)
+			crc=crc8_table[crc^data[i]];
+
+		for(bit=0; bit<(nb_bits&7); bit++)
+		{
+			crc^=((data[nb_bytes]>>(7-bit))&1)<<7;
+			crc=(crc&0x80)?((crc<<1)^0x07):(crc<<1);
 		}
 
-		if(!found)
-			errx(1, "nRF: internal error: do_TX_ack: not found for nRF %s", nRF->name);
+		return crc;
+	}
+}
+
+static void frame_put_byte(uint8_t * const frame, const uint16_t pos, const uint8_t byte)
+{
+	uint8_t shift=pos&7;
+
+	frame[pos>>3]|=byte>>shift;
+	if(shift)
+		frame[(pos>>3)+1]|=byte<<(8-shift);
+}
+
+static uint8_t frame_get_byte(uint8_t const * const frame, const uint16_t pos)
+{
+	uint8_t shift=pos&7;
+
+	if(shift)
+		return (frame[pos>>3]<<shift)|(frame[(pos>>3)+1]>>(8-shift));
+	else
+		return frame[pos>>3];
+}
+
+static uint64_t pipe_address(nRF_t const * const nRF, const uint8_t pipe)
+{
+	uint64_t nb_bytes_addr=(nRF->regs[REG_SETUP_AW]&(0b11<<AW))+2;
+	uint64_t addr_mask=(1UL<<(8*nb_bytes_addr))-1;
+
+	if(pipe<2)
+		return nRF->addr[ADDR_RX_P0+pipe]&addr_mask;
+	else
+		return ((nRF->addr[ADDR_RX_P1]&0xffffffff00)|nRF->regs[REG_RX_ADDR_P0+pipe])&addr_mask;
+}
+
+static uint64_t reg_read(nRF_t const * const nRF, const uint8_t reg)
+{
+	switch(reg)
+	{
+		case REG_RX_ADDR_P0: return nRF->addr[ADDR_RX_P0];
+		case REG_RX_ADDR_P1: return nRF->addr[ADDR_RX_P1];
+		case REG_TX_ADDR: return nRF->addr[ADDR_TX];
+		default: return nRF->regs[reg];
+	}
+}
+
+static void reg_write(nRF_t * const nRF, const uint8_t reg, const uint64_t value)
+{
+	switch(reg)
+	{
+		case REG_RX_ADDR_P0: nRF->addr[ADDR_RX_P0]=value; break;
+		case REG_RX_ADDR_P1: nRF->addr[ADDR_RX_P1]=value; break;
+		case REG_TX_ADDR: nRF->addr[ADDR_TX]=value; break;
+		default: nRF->regs[reg]=(value&~nRF->cold->regs_override_mask[reg])|nRF->cold->regs_override_value[reg]; break;
+	}
+}
+
+static uint32_t air_key_of(nRF_t const * const nRF)
+{
+	return (1<<24)|((nRF->regs[REG_CONFIG]&(1<<CRCO))<<16)|((nRF->regs[REG_RF_SETUP]&((1<<RF_DR_LOW)|(1<<RF_DR_HIGH)))<<8)|nRF->regs[REG_RF_CH];
+}
+
+static void air_update_state(nRF_t const * const nRF)
+{
+	if(nRF->remote) //proxies are not in modules[]
+		return;
+
+	air_key[nRF->index]=(nRF->state==NRF_RX_MODE && !nRF->brownout)?air_key_of(nRF):0; //a module without power receives nothing
+}
+
+static void air_update_config(nRF_t const * const nRF)
+{
+	if(nRF->remote)
+		return;
+
+	uint8_t pipe;
+	for(pipe=0; pipe<6; pipe++)
+		air_addr[nRF->index][pipe]=pipe_address(nRF, pipe);
+	air_pipes[nRF->index]=nRF->regs[REG_EN_RXADDR];
+	air_update_state(nRF);
+}
+
+static void build_frame(nRF_t * const nRF, const uint64_t addr, const uint8_t bytes_addr, const uint8_t bytes_crc)
+{
+	packet_tx_t const * const pkt=&nRF->cold->packet_being_sent;
+	uint16_t pos=8;
+	uint8_t i;
+
+	memset(nRF->cold->frame, 0, NRF_SZ_FRAME);
+
+	for(i=0; i<bytes_addr; i++, pos+=8) //address is sent MSByte first
+		frame_put_byte(nRF->cold->frame, pos, (addr>>(8*(bytes_addr-1-i)))&0xff);
+
+	nRF->cold->frame[0]=(nRF->cold->frame[1]&0x80)?0xaa:0x55; //preamble must end with a bit different from the first address bit
+
+	//PCF: 6 bits length, 2 bits PID, 1 bit NO_ACK (always 0, W_TX_PAYLOAD_NOACK is unimplemented)
+	uint16_t pcf=(pkt->nb_bytes<<3)|((pkt->PID&3)<<1);
+	frame_put_byte(nRF->cold->frame, pos, pcf>>1);
+	frame_put_byte(nRF->cold->frame, pos+8, (pcf&1)<<7);
+	pos+=9;
+
+	for(i=0; i<pkt->nb_bytes; i++, pos+=8)
+		frame_put_byte(nRF->cold->frame, pos, pkt->data[i]);
+
+	uint16_t crc=frame_crc(nRF->cold->frame, pos-8, bytes_crc);
+	if(bytes_crc==2)
+	{
+		frame_put_byte(nRF->cold->frame, pos, crc>>8);
+		pos+=8;
+	}
+	frame_put_byte(nRF->cold->frame, pos, crc&0xff);
+	pos+=8;
+
+	nRF->cold->frame_nb_bits=pos;
+	nRF->cold->frame_bytes_crc=bytes_crc;
+}
+
+static bool frame_crc_ok(nRF_t const * const nRF)
+{
+	uint16_t nb_bits=nRF->cold->frame_nb_bits-8-8*nRF->cold->frame_bytes_crc;
+	uint16_t crc=frame_crc(nRF->cold->frame, nb_bits, nRF->cold->frame_bytes_crc);
+
+	if(nRF->cold->frame_bytes_crc==2)
+		return crc==((frame_get_byte(nRF->cold->frame, 8+nb_bits)<<8)|frame_get_byte(nRF->cold->frame, 16+nb_bits));
+	else
+		return crc==frame_get_byte(nRF->cold->frame, 8+nb_bits);
+}
+
+static void synthesize_frame(nRF_t * const nRF, const bool is_ack, const uint64_t addr, const uint8_t bytes_addr, const uint8_t bytes_crc)
+{
+	build_frame(nRF, addr, bytes_addr, bytes_crc);
+
+	if(bit_errors.corrupt_frames && (rand()%bit_errors.divider_frames)==0)
+	{
+		uint16_t bit=rand()%nRF->cold->frame_nb_bits;
+		nRF->cold->frame[bit>>3]^=(0x80>>(bit&7));
+		bit_errors.nb_corrupted_frames++;
+		LOG(NRF_LOG_VERBOSE, "nRF %s: simulating bit error, flipped bit %u of frame, total %u corrupted\n", nRF->cold->name, bit, bit_errors.nb_corrupted_frames);
+	}
+
+	if(nRF->cold->capture)
+	{
+		uint8_t i;
+		fprintf(nRF->cold->capture, "[%10.3fms] %-3s AW%u CRC%u %3u bits:", CYCLES_TO_MS_FLOAT(nRF->avr, nRF->avr->cycle), is_ack?"ACK":"TX", bytes_addr, bytes_crc, nRF->cold->frame_nb_bits);
+		for(i=0; i<(nRF->cold->frame_nb_bits+7)/8; i++)
+			fprintf(nRF->cold->capture, " %02x", nRF->cold->frame[i]);
+		fprintf(nRF->cold->capture, "\n");
+	}
+}
+
+static void do_TX(nRF_t * const nRF)
+{
+	if(nRF->state!=NRF_TX_MODE || nRF->tx_in_progress || nRF->state_spi!=NRF_SPI_IDLE)
+		return;
+
+	nRF->cold->packet_being_sent.PID=nRF->cold->fifo_tx[0].PID;
+	nRF->cold->packet_being_sent.regular_packet.nb_bytes_addr=nRF->cold->fifo_tx[0].regular_packet.nb_bytes_addr;
+	nRF->cold->packet_being_sent.regular_packet.addr=nRF->cold->fifo_tx[0].regular_packet.addr;
+	nRF->cold->packet_being_sent.nb_bytes=nRF->cold->fifo_tx[0].nb_bytes;
+	memcpy(nRF->cold->packet_being_sent.data, nRF->cold->fifo_tx[0].data, nRF->cold->fifo_tx[0].nb_bytes);
+	nRF->packet_being_sent_valid=true;
+
+	uint8_t bytes_addr=nRF->cold->packet_being_sent.regular_packet.nb_bytes_addr;
+	uint8_t bytes_payload=nRF->cold->packet_being_sent.nb_bytes;
+	uint8_t bytes_crc=(nRF->regs[REG_CONFIG]&(1<<CRCO))?2:1;
+	uint32_t data_rate=(nRF->regs[REG_RF_SETUP]&(1<<RF_DR_LOW))?250E3:((nRF->regs[REG_RF_SETUP]&(1<<RF_DR_HIGH))?2E6:1E6);
+	uint32_t time_on_air_us=1.0E6*(8*(1+bytes_addr+bytes_payload+bytes_crc)+9)/data_rate;
+
+	LOG(NRF_LOG_VERBOSE, "nRF %s: transmitting %u bytes of payload, time on air is %u µs\n", nRF->cold->name, bytes_payload, time_on_air_us);
+
+	if(nRF->cold->log_tx_to_file)
+	{
+		LOG(NRF_LOG_VERBOSE, "nRF %s: logging TX to file\n", nRF->cold->name);
+		log_to_file(nRF, false, bytes_payload);
+	}
+
+	if(trace)
+		trace_airtime(nRF, false, time_on_air_us);
+
+	raise_trace_irq(nRF, NRF24_ON_AIR_OUT, 1);
+
+	nRF->cold->avr_cycle_last_tx=nRF->avr->cycle;
+	nRF->cold->stats.nb_packets_sent++;
+	nRF->regs[REG_OBSERVE_TX]=(nRF->regs[REG_OBSERVE_TX]&~(0b1111<<ARC_CNT))|(nRF->nb_retries<<ARC_CNT); //0 for a new packet
+	if(advisor)
+		advisor_tx(nRF, time_on_air_us);
+	fire_event(NRF_EVENT_TX_START, nRF, NULL, &nRF->cold->packet_being_sent);
+
+	if(nRF->cold->frame_synthesis)
+		synthesize_frame(nRF, false, nRF->cold->packet_being_sent.regular_packet.addr, bytes_addr, bytes_crc);
 
-		nRF->packet_being_sent.ack_packet.pipe=nRF->fifo_tx[i].ack_packet.pipe;
-		nRF->packet_being_sent.nb_bytes=nRF->fifo_tx[i].nb_bytes;
-		memcpy(nRF->packet_being_sent.data, nRF->fifo_tx[i].data, nRF->fifo_tx[i].nb_bytes);
+	if(medium)
+		medium_send_packet(nRF, time_on_air_us);
+
+	avr_cycle_timer_register(nRF->avr, US_TO_CYCLES(nRF->avr, time_on_air_us), &cb_tx_finished, nRF);
+
+	nRF->tx_in_progress=true;
+}
+
+static void do_TX_ack(nRF_t * const nRF)
+{
+	if(nRF->state!=NRF_TX_MODE_FOR_ACK || nRF->tx_in_progress || nRF->state_spi!=NRF_SPI_IDLE)
+		return;
+
+	if(!nRF->last_rx_valid)
+		errx(1, "nRF: internal error: do_TX_ack: last_rx_valid==false for nRF %s", nRF->cold->name);
+
+	nRF->cold->packet_being_sent.PID=nRF->cold->last_rx.PID; //ACK carries the PID of the acknowledged packet
+
+	uint8_t pipe=nRF->cold->last_rx.pipe;
+
+	if(nRF->regs[REG_FEATURE]&(1<<EN_ACK_PAY) && nRF->cold->ack_queue_len[pipe])
+	{
+		LOG(NRF_LOG_DEBUG, "nRF %s: EN_ACK_PAY enabled, pending ACK-payload for pipe %u will be sent\n", nRF->cold->name, pipe);
+
+		uint8_t slot=nRF->cold->ack_queue[pipe][nRF->cold->ack_queue_head[pipe]];
+		nRF->cold->ack_queue_head[pipe]=(nRF->cold->ack_queue_head[pipe]+1)%3;
+		nRF->cold->ack_queue_len[pipe]--;
+
+		nRF->cold->packet_being_sent.ack_packet.pipe=pipe;
+		nRF->cold->packet_being_sent.nb_bytes=nRF->cold->ack_payloads[slot].nb_bytes;
+		memcpy(nRF->cold->packet_being_sent.data, nRF->cold->ack_payloads[slot].data, nRF->cold->ack_payloads[slot].nb_bytes);
 		nRF->packet_being_sent_valid=true;
 
-		if(i!=2)
-			memmove(&nRF->fifo_tx[i], &nRF->fifo_tx[i+1], (2-i)*sizeof(packet_tx_t));
-		nRF->fifo_tx_entries--;
+		nRF->ack_payloads_free|=(1<<slot);
+		nRF->ack_payloads_entries--;
 		update_fifo_status(nRF);
-
 	}
 	else
 	{
-		LOG(NRF_LOG_DEBUG, "nRF %s: EN_ACK_PAY not enabled or no pending ACK-payload, sending empty ACK\n", nRF->name);
-		nRF->packet_being_sent.ack_packet.pipe=nRF->last_rx.pipe;
-		nRF->packet_being_sent.nb_bytes=0;
+		LOG(NRF_LOG_DEBUG, "nRF %s: EN_ACK_PAY not enabled or no pending ACK-payload for pipe %u, sending empty ACK\n", nRF->cold->name, pipe);
+		nRF->cold->packet_being_sent.ack_packet.pipe=nRF->cold->last_rx.pipe;
+		nRF->cold->packet_being_sent.nb_bytes=0;
 		nRF->packet_being_sent_valid=true;
 	}
 
 	uint8_t bytes_addr=(nRF->regs[REG_SETUP_AW]&(0b11<<AW))+2;
-	uint8_t bytes_payload=nRF->packet_being_sent.nb_bytes;
+	uint8_t bytes_payload=nRF->cold->packet_being_sent.nb_bytes;
 	uint8_t bytes_crc=(nRF->regs[REG_CONFIG]&(1<<CRCO))?2:1;
 	uint32_t data_rate=(nRF->regs[REG_RF_SETUP]&(1<<RF_DR_LOW))?250E3:((nRF->regs[REG_RF_SETUP]&(1<<RF_DR_HIGH))?2E6:1E6);
 	uint32_t time_on_air_us=1.0E6*(8*(1+bytes_addr+bytes_payload+bytes_crc)+9)/data_rate;
 
-	LOG(NRF_LOG_VERBOSE, "nRF %s: transmitting ACK with %u bytes payload to %s, time on air is %u µs\n", nRF->name, bytes_payload, nRF->rx_send_ack_to->name, time_on_air_us);
+	LOG(NRF_LOG_VERBOSE, "nRF %s: transmitting ACK with %u bytes payload to %s, time on air is %u µs\n", nRF->cold->name, bytes_payload, nRF->rx_send_ack_to->cold->name, time_on_air_us);
 
-	if(nRF->log_tx_to_file)
+	if(nRF->cold->log_tx_to_file)
 	{
-		LOG(NRF_LOG_VERBOSE, "nRF %s: logging TX ACK to file\n", nRF->name);
+		LOG(NRF_LOG_VERBOSE, "nRF %s: logging TX ACK to file\n", nRF->cold->name);
 		log_to_file(nRF, true, bytes_payload);
 	}
 
+	if(trace)
+		trace_airtime(nRF, true, time_on_air_us);
+
+	raise_trace_irq(nRF, NRF24_ON_AIR_OUT, 1);
+
+	nRF->cold->avr_cycle_last_tx=nRF->avr->cycle;
+	nRF->cold->stats.nb_acks_sent++;
+	fire_event(NRF_EVENT_ACK_SENT, nRF, nRF->rx_send_ack_to, &nRF->cold->packet_being_sent);
+
+	if(nRF->cold->frame_synthesis)
+		synthesize_frame(nRF, true, pipe_address(nRF, nRF->cold->last_rx.pipe), bytes_addr, bytes_crc);
+
+	if(nRF->rx_send_ack_to->remote)
+		medium_send_ack(nRF, time_on_air_us);
+
 	avr_cycle_timer_register(nRF->avr, US_TO_CYCLES(nRF->avr, time_on_air_us), &cb_tx_finished, nRF);
 
 	nRF->tx_in_progress=true;
 }
 
+static uint32_t link_hash(const uint32_t key, const uint32_t size)
+{
+	return (key*2654435761u)&(size-1); //Knuth's multiplicative hash
+}
+
+static uint32_t link_map_get(link_map_t const * const map, nRF_t const * const from, nRF_t const * const to, const uint32_t value_default)
+{
+	if(!map->nb_entries)
+		return value_default;
+
+	const uint32_t key=((uint32_t)from->index<<16|to->index)+1;
+	uint32_t i;
+	for(i=link_hash(key, map->size); map->entries[i].key; i=(i+1)&(map->size-1))
+	{
+		if(map->entries[i].key==key)
+			return map->entries[i].value;
+	}
+
+	return value_default;
+}
+
+static void link_map_set(link_map_t * const map, nRF_t const * const from, nRF_t const * const to, const uint32_t value)
+{
+	const uint32_t key=((uint32_t)from->index<<16|to->index)+1;
+	uint32_t i;
+	if(map->size)
+	{
+		for(i=link_hash(key, map->size); map->entries[i].key; i=(i+1)&(map->size-1))
+		{
+			if(map->entries[i].key==key) //an update never grows the map
+			{
+				map->entries[i].value=value;
+				return;
+			}
+		}
+	}
+
+	if(2*(map->nb_entries+1)>map->size) //at most half full, so a lookup ends after a few entries
+	{
+		link_map_t grown={.size=map->size?2*map->size:16, .nb_entries=0};
+		grown.entries=calloc(grown.size, sizeof(link_entry_t));
+		if(!grown.entries)
+			err(1, "nRF: allocating map of links failed");
+
+		for(i=0; i<map->size; i++)
+		{
+			if(!map->entries[i].key)
+				continue;
+			uint32_t j=link_hash(map->entries[i].key, grown.size);
+			while(grown.entries[j].key)
+				j=(j+1)&(grown.size-1);
+			grown.entries[j]=map->entries[i];
+			grown.nb_entries++;
+		}
+
+		free(map->entries);
+		*map=grown;
+	}
+
+	for(i=link_hash(key, map->size); map->entries[i].key; i=(i+1)&(map->size-1))
+		;
+	map->entries[i].key=key;
+	map->entries[i].value=value;
+	map->nb_entries++;
+}
+
+static void link_map_free(link_map_t * const map)
+{
+	free(map->entries);
+	memset(map, 0, sizeof(link_map_t));
+}
+
+static bool fault_lost(const uint32_t lost) //lost: 0 (no fault) or 1 out of N
+{
+	return lost && (lost==1 || (rand()%lost)==0);
+}
+
+static bool rpd_detect(nRF_t const * const from, nRF_t const * const to) //received power above the threshold of RPD?
+{
+	const uint8_t loss=(from->remote || to->remote)?NRF_PATH_LOSS_DB:link_map_get(&path_loss_dB, from, to, NRF_PATH_LOSS_DB);
+	return tx_power_dBm[(from->regs[REG_RF_SETUP]>>RF_PWR)&0b11]-loss>=NRF_RPD_THRESHOLD_DBM;
+}
+
+static bool rpd_carrier(nRF_t const * const nRF) //CE set low in RX-mode: is something on air on this channel right now?
+{
+	if(fault_channel_lost[nRF->regs[REG_RF_CH]]) //jammed, e.g. by WiFi
+		return true;
+
+	uint16_t i;
+	for(i=0; i<nb_modules; i++)
+	{
+		if(modules[i]!=nRF && modules[i]->tx_in_progress && modules[i]->regs[REG_RF_CH]==nRF->regs[REG_RF_CH] && rpd_detect(modules[i], nRF))
+			return true;
+	}
+
+	return false;
+}
+
 static void handle_tx_ack(nRF_t * const nRF_PTX, nRF_t * const nRF_PRX)
 {
 	LOG(NRF_LOG_DEBUG, "handle_tx_ack: setting PRX to TX-settling, registering timer cb_delay_timer\n");
 
 	nRF_PTX->tx_receive_ack_from=nRF_PRX;
+	nRF_PRX->cold->trace_flow=nRF_PTX->cold->trace_flow;
 
 	nRF_PRX->state=NRF_TX_SETTLING_FOR_ACK;
 	nRF_PRX->state_next=NRF_TX_MODE_FOR_ACK;
@@ -543,99 +1535,109 @@ static void handle_tx_ack(nRF_t * const nRF_PTX, nRF_t * const nRF_PRX)
 	nRF_PRX->rx_send_ack_to=nRF_PTX;
 
 	avr_cycle_timer_register(nRF_PRX->avr, US_TO_CYCLES(nRF_PRX->avr, 130), &cb_delay_timer, nRF_PRX);
+
+	account_energy(nRF_PRX);
+	air_update_state(nRF_PRX);
+	telemetry_publish(nRF_PRX);
 }
 
 static void dispatch_sent_packet(nRF_t * const nRF)
 {
-	LOG(NRF_LOG_DEBUG, "dispatch_sent_packet: searching for receiver for packet from %s\n", nRF->name);
+	const uint64_t profile_start=profile_enter();
 
-	uint8_t i;
+	LOG(NRF_LOG_DEBUG, "dispatch_sent_packet: searching for receiver for packet from %s\n", nRF->cold->name);
+
+	if(nRF->brownout || fault_lost(fault_channel_lost[nRF->regs[REG_RF_CH]]))
+	{
+		nb_fault_lost_packets++;
+		LOG(NRF_LOG_VERBOSE, "nRF %s: packet lost to injected fault (%s), total %u lost\n", nRF->cold->name, nRF->brownout?"brownout":"channel", nb_fault_lost_packets);
+		fire_event(NRF_EVENT_PACKET_LOST, nRF, NULL, &nRF->cold->packet_being_sent);
+		profile_leave(NRF_PROFILE_DISPATCH, profile_start);
+		return;
+	}
+
+	const uint32_t key=air_key_of(nRF);
+	const uint64_t addr=nRF->cold->packet_being_sent.regular_packet.addr;
+
+	uint16_t i;
 	bool found=false;
 	for(i=0; i<nb_modules; i++)
 	{
-		if(modules[i]==nRF)
+		if(air_key[i]!=key || modules[i]==nRF) //module must be in RX mode on the same channel with same speed and CRC-setting
 			continue;
 
-		if(
-				modules[i]->state==NRF_RX_MODE //module is in RX mode
-			&&	modules[i]->regs[REG_RF_CH]==nRF->regs[REG_RF_CH] //module is listening on same channel
-			&&	(modules[i]->regs[REG_RF_SETUP]&0b00101000)==(nRF->regs[REG_RF_SETUP]&0b00101000) //module is using same speed
-			&&	(modules[i]->regs[REG_CONFIG]&(1<<CRCO))==(nRF->regs[REG_CONFIG]&(1<<CRCO)) //module is using same CRC-setting
-		  )
+		uint8_t pipe;
+		bool match=false; //found is for all modules
+
+		for(pipe=0; pipe<6; pipe++)
 		{
-			uint64_t nb_bytes_addr=(modules[i]->regs[REG_SETUP_AW]&(0b11<<AW))+2;
-			uint64_t addr_mask=(1UL<<(8*nb_bytes_addr))-1;
-			uint64_t addr_pipes[5];
-			addr_pipes[0]=(modules[i]->regs[REG_RX_ADDR_P0])&addr_mask;
-			addr_pipes[1]=(modules[i]->regs[REG_RX_ADDR_P1])&addr_mask;
-			addr_pipes[2]=((addr_pipes[1]&0xffffffff00)|modules[i]->regs[REG_RX_ADDR_P2])&addr_mask;
-			addr_pipes[3]=((addr_pipes[1]&0xffffffff00)|modules[i]->regs[REG_RX_ADDR_P3])&addr_mask;
-			addr_pipes[4]=((addr_pipes[1]&0xffffffff00)|modules[i]->regs[REG_RX_ADDR_P4])&addr_mask;
-			addr_pipes[5]=((addr_pipes[1]&0xffffffff00)|modules[i]->regs[REG_RX_ADDR_P5])&addr_mask;
-			uint8_t pipe;
-
-			for(pipe=0; pipe<5; pipe++)
+			//addr match for some pipe and this pipe enabled on RX side?
+			if(air_pipes[i]&(1<<pipe) && addr==air_addr[i][pipe])
 			{
-				//addr match for some pipe and this pipe enabled on RX side?
-				if(nRF->packet_being_sent.regular_packet.addr==addr_pipes[pipe] && modules[i]->regs[REG_EN_RXADDR]&(1<<pipe))
-				{
-					found=true;
-					break;
-				}
+				match=true;
+				found=true;
+				break;
 			}
+		}
+
+		if(match && !nRF->remote && fault_lost(link_map_get(&fault_link_lost, nRF, modules[i], 0)))
+		{
+			nb_fault_lost_packets++;
+			LOG(NRF_LOG_VERBOSE, "nRF %s: packet from %s lost to injected fault (link), total %u lost\n", modules[i]->cold->name, nRF->cold->name, nb_fault_lost_packets);
+			fire_event(NRF_EVENT_PACKET_LOST, nRF, modules[i], &nRF->cold->packet_being_sent);
+		}
+		else if(match)
+		{
+			bool discard_packet=false;
+
+			modules[i]->regs[REG_RPD]=rpd_detect(nRF, modules[i]); //latched for every valid packet
 
-			if(found)
+			if(modules[i]->last_rx_valid && modules[i]->cold->last_rx.PID==nRF->cold->packet_being_sent.PID && modules[i]->cold->last_rx.nb_bytes==nRF->cold->packet_being_sent.nb_bytes && modules[i]->cold->last_rx.pipe==pipe && !memcmp(modules[i]->cold->last_rx.data, nRF->cold->packet_being_sent.data, nRF->cold->packet_being_sent.nb_bytes))
 			{
-				bool discard_packet=false;
+				LOG(NRF_LOG_VERBOSE, "nRF %s: dropping duplicate packet with %u bytes payload\n", modules[i]->cold->name, nRF->cold->packet_being_sent.nb_bytes);
+				discard_packet=true;
+				fire_event(NRF_EVENT_DUPLICATE_DROPPED, modules[i], nRF, &nRF->cold->packet_being_sent);
+			}
 
-				if(modules[i]->last_rx_valid && modules[i]->last_rx.PID==nRF->packet_being_sent.PID && modules[i]->last_rx.nb_bytes==nRF->packet_being_sent.nb_bytes && modules[i]->last_rx.pipe==pipe && !memcmp(modules[i]->last_rx.data, nRF->packet_being_sent.data, nRF->packet_being_sent.nb_bytes))
+			if(modules[i]->fifo_rx_entries<3)
+			{
+				if(!discard_packet)
 				{
-					LOG(NRF_LOG_VERBOSE, "nRF %s: dropping duplicate packet with %u bytes payload\n", modules[i]->name, nRF->packet_being_sent.nb_bytes);
-					discard_packet=true;
+					modules[i]->cold->fifo_rx[modules[i]->fifo_rx_entries].PID=nRF->cold->packet_being_sent.PID;
+					modules[i]->cold->fifo_rx[modules[i]->fifo_rx_entries].pipe=pipe;
+					modules[i]->cold->fifo_rx[modules[i]->fifo_rx_entries].nb_bytes=nRF->cold->packet_being_sent.nb_bytes;
+					memcpy(modules[i]->cold->fifo_rx[modules[i]->fifo_rx_entries].data, nRF->cold->packet_being_sent.data, nRF->cold->packet_being_sent.nb_bytes);
+					modules[i]->fifo_rx_entries++;
+
+					modules[i]->cold->last_rx.PID=nRF->cold->packet_being_sent.PID;
+					modules[i]->cold->last_rx.pipe=pipe;
+					modules[i]->cold->last_rx.nb_bytes=nRF->cold->packet_being_sent.nb_bytes;
+					memcpy(modules[i]->cold->last_rx.data, nRF->cold->packet_being_sent.data, nRF->cold->packet_being_sent.nb_bytes);
+					modules[i]->last_rx_valid=true;
+					modules[i]->cold->stats.nb_packets_received++;
+					fire_event(NRF_EVENT_RX_DELIVERED, modules[i], nRF, &nRF->cold->packet_being_sent);
+
+					modules[i]->regs[REG_STATUS]|=(1<<RX_DR);
+					update_fifo_status(modules[i]);
+					LOG(NRF_LOG_DEBUG, "nRF %s has a new packet, fifo_rx_entries is %u\n", modules[i]->cold->name, modules[i]->fifo_rx_entries);
 				}
 
-				if(modules[i]->fifo_rx_entries<3)
-				{
-					if(!discard_packet)
-					{
-						modules[i]->fifo_rx[modules[i]->fifo_rx_entries].PID=nRF->packet_being_sent.PID;
-						modules[i]->fifo_rx[modules[i]->fifo_rx_entries].pipe=pipe;
-						modules[i]->fifo_rx[modules[i]->fifo_rx_entries].nb_bytes=nRF->packet_being_sent.nb_bytes;
-						memcpy(modules[i]->fifo_rx[modules[i]->fifo_rx_entries].data, nRF->packet_being_sent.data, nRF->packet_being_sent.nb_bytes);
-						modules[i]->fifo_rx_entries++;
-
-						modules[i]->last_rx.PID=nRF->packet_being_sent.PID;
-						modules[i]->last_rx.pipe=pipe;
-						modules[i]->last_rx.nb_bytes=nRF->packet_being_sent.nb_bytes;
-						memcpy(modules[i]->last_rx.data, nRF->packet_being_sent.data, nRF->packet_being_sent.nb_bytes);
-						modules[i]->last_rx_valid=true;
-
-						modules[i]->regs[REG_STATUS]|=(1<<RX_DR);
-						update_fifo_status(modules[i]);
-						LOG(NRF_LOG_DEBUG, "nRF %s has a new packet, fifo_rx_entries is %u\n", modules[i]->name, modules[i]->fifo_rx_entries);
-					}
-
-					if(modules[i]->regs[REG_EN_AA]&(1<<pipe))
-					{
-						if(lost.lose_acks && (rand()%lost.divider_acks)==0)
-						{
-							lost.nb_lost_acks++;
-							LOG(NRF_LOG_VERBOSE, "nRF %s: simulating lost ACK-packet, total %u lost\n", nRF->name, lost.nb_lost_acks);
-						}
-						else
-							handle_tx_ack(nRF, modules[i]);
-					}
-					else
-						LOG(NRF_LOG_WARNING, "WARNING: auto-ACK disabled for pipe %u on %s, not sending ACK\n", pipe, modules[i]->name);
-				}
+				if(modules[i]->regs[REG_EN_AA]&(1<<pipe))
+					handle_tx_ack(nRF, modules[i]); //a simulated loss of the ACK-packet is decided when it has been sent, see tx_finished()
 				else
-					LOG(NRF_LOG_WARNING, "WARNING: nRF %s has no free RX-slot and will miss a packet send by nRF %s\n", modules[i]->name, nRF->name);
+					LOG(NRF_LOG_WARNING, "WARNING: auto-ACK disabled for pipe %u on %s, not sending ACK\n", pipe, modules[i]->cold->name);
+			}
+			else
+			{
+				LOG(NRF_LOG_WARNING, "WARNING: nRF %s has no free RX-slot and will miss a packet send by nRF %s\n", modules[i]->cold->name, nRF->cold->name);
+				fire_event(NRF_EVENT_PACKET_LOST, nRF, modules[i], &nRF->cold->packet_being_sent);
 			}
 		}
 	}
-	if(!found)
-		LOG(NRF_LOG_WARNING, "WARNING: no receiver found for packet from nRF %s\n", nRF->name);
+	if(!found && !medium) //with a distributed medium the receiver may live in another process
+		LOG(NRF_LOG_WARNING, "WARNING: no receiver found for packet from nRF %s\n", nRF->cold->name);
 
+	profile_leave(NRF_PROFILE_DISPATCH, profile_start);
 }
 
 static void cb_ce(struct avr_irq_t * irq, uint32_t value, void * param) //RX/TX-enable
@@ -643,24 +1645,48 @@ static void cb_ce(struct avr_irq_t * irq, uint32_t value, void * param) //RX/TX-
 	(void)irq;
 
 	nRF_t * nRF=(nRF_t*)param;
+	if(nRF->cold->model && nRF->cold->model->active) //CE is driven by the model, the level set by the firmware is used again by nRF_model()
+		return;
+
+	const uint64_t profile_start=profile_enter();
+
+	if(nRF->pin_CE && !value && nRF->state==NRF_RX_MODE)
+		nRF->regs[REG_RPD]=rpd_carrier(nRF);
 
 	nRF->pin_CE=value;
 	update_nRF(nRF);
+
+	profile_leave(NRF_PROFILE_CB_CE, profile_start);
 }
 
-static avr_cycle_count_t cb_tx_finished(avr_t * avr, avr_cycle_count_t when, void * param)
+static void cb_csn(struct avr_irq_t * irq, uint32_t value, void * param) //SPI chip select, only with nRF_connect_spi()
 {
-	(void)avr;
-	(void)when;
+	(void)irq;
+
+	csn_nRF(param, value);
+}
+
+static void cb_spi(struct avr_irq_t * irq, uint32_t value, void * param) //byte sent by the AVR, only with nRF_connect_spi()
+{
+	(void)irq;
 
 	nRF_t * nRF=(nRF_t*)param;
 
-	LOG(NRF_LOG_DEBUG, "cb_tx_finished called for nRF %s in state %u\n", nRF->name, nRF->state);
+	if(nRF->pin_CSN) //not selected
+		return;
+
+	avr_raise_irq(nRF->spi_irq_in, spi_nRF(nRF, value));
+}
+
+static void tx_finished(nRF_t * const nRF)
+{
+	LOG(NRF_LOG_DEBUG, "cb_tx_finished called for nRF %s in state %u\n", nRF->cold->name, nRF->state);
 
 	if(!nRF->packet_being_sent_valid)
-		errx(1, "nRF: internal error: cb_tx_finished: packet_being_sent_valid==false for nRF %s", nRF->name);
+		errx(1, "nRF: internal error: cb_tx_finished: packet_being_sent_valid==false for nRF %s", nRF->cold->name);
 
 	nRF->tx_in_progress=false;
+	raise_trace_irq(nRF, NRF24_ON_AIR_OUT, 0);
 
 	if(nRF->rx_send_ack) //is this an ACK-packet from a PRX?
 	{
@@ -668,21 +1694,75 @@ static avr_cycle_count_t cb_tx_finished(avr_t * avr, avr_cycle_count_t when, voi
 
 		LOG(NRF_LOG_DEBUG, "cb_tx_finished: this is an ACK-packet from PRX\n");
 
+		if(nRF->rx_send_ack_to->remote)
+		{
+			LOG(NRF_LOG_DEBUG, "cb_tx_finished: PTX %s is simulated by process %u, ACK was sent through the medium\n", nRF->rx_send_ack_to->cold->name, nRF->rx_send_ack_to->remote_process);
+			nRF->packet_being_sent_valid=false;
+			update_nRF(nRF);
+			return;
+		}
+
+		//the advisor records an ACK that reached the PTX, late or in time; an ACK lost on the way leaves the attempt failed
 		if(nRF->rx_send_ack_to->ard_has_elapsed)
 		{
-			LOG(NRF_LOG_WARNING, "WARNING: nRF %s timed-out while receiving ACK from %s - did you set ARD correctly?\n", nRF->rx_send_ack_to->name, nRF->name);
+			if(advisor)
+				advisor_ack(nRF->rx_send_ack_to, nRF, true);
+			LOG(NRF_LOG_WARNING, "WARNING: nRF %s timed-out while receiving ACK from %s - did you set ARD correctly?\n", nRF->rx_send_ack_to->cold->name, nRF->cold->name);
+			fire_event(NRF_EVENT_PACKET_LOST, nRF, nRF->rx_send_ack_to, &nRF->cold->packet_being_sent);
 			nRF->rx_send_ack=false;
+			nRF->packet_being_sent_valid=false;
 			update_nRF(nRF->rx_send_ack_to);
-			return 0;
+			update_nRF(nRF); //back to RX-mode
+			return;
 		}
 
 		if(nRF->rx_send_ack_to->state!=NRF_RX_MODE_FOR_ACK)
 		{
-			LOG(NRF_LOG_WARNING, "WARNING: nRF %s is not in RX-mode (but mode %u) and will miss the ACK from %s - did you set ARD correctly?\n", nRF->rx_send_ack_to->name, nRF->rx_send_ack_to->state, nRF->name);
-			return 0;
+			if(advisor)
+				advisor_ack(nRF->rx_send_ack_to, nRF, true);
+			LOG(NRF_LOG_WARNING, "WARNING: nRF %s is not in RX-mode (but mode %u) and will miss the ACK from %s - did you set ARD correctly?\n", nRF->rx_send_ack_to->cold->name, nRF->rx_send_ack_to->state, nRF->cold->name);
+			fire_event(NRF_EVENT_PACKET_LOST, nRF, nRF->rx_send_ack_to, &nRF->cold->packet_being_sent);
+			nRF->packet_being_sent_valid=false;
+			update_nRF(nRF); //back to RX-mode
+			return;
+		}
+
+		if(lost.lose_acks && (rand()%lost.divider_acks)==0)
+		{
+			lost.nb_lost_acks++;
+			LOG(NRF_LOG_VERBOSE, "nRF %s: simulating lost ACK-packet from %s, total %u lost\n", nRF->rx_send_ack_to->cold->name, nRF->cold->name, lost.nb_lost_acks);
+			fire_event(NRF_EVENT_PACKET_LOST, nRF, nRF->rx_send_ack_to, &nRF->cold->packet_being_sent);
+			nRF->packet_being_sent_valid=false;
+			update_nRF(nRF);
+			return;
+		}
+
+		if(nRF->brownout || nRF->rx_send_ack_to->brownout || fault_lost(fault_channel_lost[nRF->regs[REG_RF_CH]]) || (!nRF->remote && !nRF->rx_send_ack_to->remote && fault_lost(link_map_get(&fault_link_lost, nRF->rx_send_ack_to, nRF, 0))))
+		{
+			nb_fault_lost_acks++;
+			LOG(NRF_LOG_VERBOSE, "nRF %s: ACK from %s lost to injected fault, total %u lost\n", nRF->rx_send_ack_to->cold->name, nRF->cold->name, nb_fault_lost_acks);
+			fire_event(NRF_EVENT_PACKET_LOST, nRF, nRF->rx_send_ack_to, &nRF->cold->packet_being_sent);
+			nRF->packet_being_sent_valid=false;
+			update_nRF(nRF);
+			return;
+		}
+
+		if(nRF->cold->frame_synthesis && !frame_crc_ok(nRF))
+		{
+			bit_errors.nb_dropped_frames++;
+			LOG(NRF_LOG_VERBOSE, "nRF %s: CRC mismatch, ACK from %s is dropped, total %u dropped\n", nRF->rx_send_ack_to->cold->name, nRF->cold->name, bit_errors.nb_dropped_frames);
+			fire_event(NRF_EVENT_PACKET_LOST, nRF, nRF->rx_send_ack_to, &nRF->cold->packet_being_sent);
+			nRF->packet_being_sent_valid=false;
+			update_nRF(nRF);
+			return;
 		}
 
+		if(advisor)
+			advisor_ack(nRF->rx_send_ack_to, nRF, false);
+
 		nRF->rx_send_ack_to->tx_ack_received=true;
+		nRF->rx_send_ack_to->cold->stats.nb_acks_received++;
+		nRF->rx_send_ack_to->regs[REG_RPD]=rpd_detect(nRF, nRF->rx_send_ack_to);
 		nRF->rx_send_ack_to->regs[REG_STATUS]&=~(1<<TX_FULL);
 		nRF->rx_send_ack_to->regs[REG_STATUS]|=(1<<TX_DS);
 		update_fifo_status(nRF);
@@ -690,18 +1770,19 @@ static avr_cycle_count_t cb_tx_finished(avr_t * avr, avr_cycle_count_t when, voi
 		nRF->regs[REG_STATUS]|=(1<<RX_DR);
 		handle_pin_IRQ(nRF);
 		stats.nb_acks++;
+		fire_event(NRF_EVENT_ACK_RECEIVED, nRF->rx_send_ack_to, nRF, &nRF->cold->packet_being_sent);
 
-		if(nRF->packet_being_sent.nb_bytes)
+		if(nRF->cold->packet_being_sent.nb_bytes)
 		{
 			LOG(NRF_LOG_DEBUG, "ACK has payload\n");
 
 			if(nRF->rx_send_ack_to->fifo_rx_entries==3) //TODO confirm with datasheet how to behave
-				LOG(NRF_LOG_WARNING, "WARNING: nRF %s: no free space in RX fifo for ACK-packet payload, data is lost\n", nRF->rx_send_ack_to->name);
+				LOG(NRF_LOG_WARNING, "WARNING: nRF %s: no free space in RX fifo for ACK-packet payload, data is lost\n", nRF->rx_send_ack_to->cold->name);
 			else
 			{
-				nRF->rx_send_ack_to->fifo_rx[nRF->rx_send_ack_to->fifo_rx_entries].pipe=nRF->packet_being_sent.ack_packet.pipe;
-				nRF->rx_send_ack_to->fifo_rx[nRF->rx_send_ack_to->fifo_rx_entries].nb_bytes=nRF->packet_being_sent.nb_bytes;
-				memcpy(nRF->rx_send_ack_to->fifo_rx[nRF->rx_send_ack_to->fifo_rx_entries].data, nRF->packet_being_sent.data, nRF->packet_being_sent.nb_bytes);
+				nRF->rx_send_ack_to->cold->fifo_rx[nRF->rx_send_ack_to->fifo_rx_entries].pipe=nRF->cold->packet_being_sent.ack_packet.pipe;
+				nRF->rx_send_ack_to->cold->fifo_rx[nRF->rx_send_ack_to->fifo_rx_entries].nb_bytes=nRF->cold->packet_being_sent.nb_bytes;
+				memcpy(nRF->rx_send_ack_to->cold->fifo_rx[nRF->rx_send_ack_to->fifo_rx_entries].data, nRF->cold->packet_being_sent.data, nRF->cold->packet_being_sent.nb_bytes);
 				nRF->rx_send_ack_to->fifo_rx_entries++;
 				update_fifo_status(nRF->rx_send_ack_to);
 				nRF->rx_send_ack_to->regs[REG_STATUS]|=(1<<TX_DS)|(1<<RX_DR);
@@ -713,7 +1794,7 @@ static avr_cycle_count_t cb_tx_finished(avr_t * avr, avr_cycle_count_t when, voi
 		nRF->packet_being_sent_valid=false;
 
 		LOG(NRF_LOG_DEBUG, "cb_tx_finished: ACK-received, removing packet from TX-fifo\n");
-		memmove(&nRF->rx_send_ack_to->fifo_tx[0], &nRF->rx_send_ack_to->fifo_tx[1], 2*sizeof(packet_tx_t));
+		memmove(&nRF->rx_send_ack_to->cold->fifo_tx[0], &nRF->rx_send_ack_to->cold->fifo_tx[1], 2*sizeof(packet_tx_t));
 		nRF->rx_send_ack_to->fifo_tx_entries--;
 		nRF->rx_send_ack_to->regs[REG_STATUS]|=(1<<TX_DS);
 		update_fifo_status(nRF->rx_send_ack_to);
@@ -725,10 +1806,19 @@ static avr_cycle_count_t cb_tx_finished(avr_t * avr, avr_cycle_count_t when, voi
 	{
 		LOG(NRF_LOG_DEBUG, "cb_tx_finished: this is a regular packet\n");
 
+		fire_event(NRF_EVENT_TX_END, nRF, NULL, &nRF->cold->packet_being_sent);
+
 		if(lost.lose_packets && (rand()%lost.divider_packets)==0)
 		{
 			lost.nb_lost_packets++;
-			LOG(NRF_LOG_VERBOSE, "nRF %s: simulating lost packet, total %u lost\n", nRF->name, lost.nb_lost_packets);
+			LOG(NRF_LOG_VERBOSE, "nRF %s: simulating lost packet, total %u lost\n", nRF->cold->name, lost.nb_lost_packets);
+			fire_event(NRF_EVENT_PACKET_LOST, nRF, NULL, &nRF->cold->packet_being_sent);
+		}
+		else if(nRF->cold->frame_synthesis && !frame_crc_ok(nRF))
+		{
+			bit_errors.nb_dropped_frames++;
+			LOG(NRF_LOG_VERBOSE, "nRF %s: CRC mismatch, packet is dropped by receivers, total %u dropped\n", nRF->cold->name, bit_errors.nb_dropped_frames);
+			fire_event(NRF_EVENT_PACKET_LOST, nRF, NULL, &nRF->cold->packet_being_sent);
 		}
 		else
 			dispatch_sent_packet(nRF);
@@ -741,6 +1831,9 @@ static avr_cycle_count_t cb_tx_finished(avr_t * avr, avr_cycle_count_t when, voi
 
 		if(nRF->regs[REG_SETUP_RETR]&(0b1111<<ARC)) //is auto-retransmit enabled? -> wait for ACK
 		{
+			if(advisor)
+				advisor_tx_end(nRF);
+
 			nRF->tx_wait_for_ack=true;
 			nRF->tx_ack_received=false;
 			nRF->rx_ack_timeout=false;
@@ -755,7 +1848,7 @@ static avr_cycle_count_t cb_tx_finished(avr_t * avr, avr_cycle_count_t when, voi
 		{
 			LOG(NRF_LOG_DEBUG, "cb_tx_finished: we are done with this packet, removing from TX-fifo\n");
 			//remove sent entry from FIFO
-			memmove(&nRF->fifo_tx[0], &nRF->fifo_tx[1], 2*sizeof(packet_tx_t));
+			memmove(&nRF->cold->fifo_tx[0], &nRF->cold->fifo_tx[1], 2*sizeof(packet_tx_t));
 			nRF->fifo_tx_entries--;
 			nRF->regs[REG_STATUS]|=(1<<TX_DS);
 			update_fifo_status(nRF);
@@ -764,10 +1857,22 @@ static avr_cycle_count_t cb_tx_finished(avr_t * avr, avr_cycle_count_t when, voi
 		}
 	}
 
-	LOG(NRF_LOG_DEBUG, "cb_tx_finished: calling update_nRF for %s\n", nRF->name);
+	LOG(NRF_LOG_DEBUG, "cb_tx_finished: calling update_nRF for %s\n", nRF->cold->name);
 	update_nRF(nRF);
 
 	LOG(NRF_LOG_DEBUG, "end of cb_tx_finished\n");
+}
+
+static avr_cycle_count_t cb_tx_finished(avr_t * avr, avr_cycle_count_t when, void * param)
+{
+	(void)avr;
+	(void)when;
+
+	const uint64_t profile_start=profile_enter();
+
+	tx_finished((nRF_t*)param);
+
+	profile_leave(NRF_PROFILE_CB_TX_FINISHED, profile_start);
 
 	return 0; //stop timer
 }
@@ -777,14 +1882,16 @@ static avr_cycle_count_t cb_rx_ack_timeout(avr_t * avr, avr_cycle_count_t when,
 	(void)avr;
 	(void)when;
 
+	const uint64_t profile_start=profile_enter();
+
 	LOG(NRF_LOG_DEBUG, "cb_rx_ack_timeout fired\n");
 
 	nRF_t * nRF=(nRF_t*)param;
 
 	if(nRF->tx_receive_ack_from)
-		LOG(NRF_LOG_DEBUG, "cb_rx_ack_timeout: tx_in_progress for %s is %u\n", nRF->tx_receive_ack_from->name, nRF->tx_receive_ack_from->tx_in_progress);
+		LOG(NRF_LOG_DEBUG, "cb_rx_ack_timeout: tx_in_progress for %s is %u\n", nRF->tx_receive_ack_from->cold->name, nRF->tx_receive_ack_from->tx_in_progress);
 	else
-		LOG(NRF_LOG_DEBUG, "cb_rx_ack_timeout: nRF->tx_receive_ack_from is NULL for nRF %s\n", nRF->name);
+		LOG(NRF_LOG_DEBUG, "cb_rx_ack_timeout: nRF->tx_receive_ack_from is NULL for nRF %s\n", nRF->cold->name);
 
 	if(nRF->ard_has_elapsed)
 	{
@@ -803,6 +1910,8 @@ static avr_cycle_count_t cb_rx_ack_timeout(avr_t * avr, avr_cycle_count_t when,
 	update_nRF(nRF);
 	update_nRF(nRF);
 
+	profile_leave(NRF_PROFILE_CB_RX_ACK_TIMEOUT, profile_start);
+
 	return 0;
 }
 
@@ -811,6 +1920,8 @@ static avr_cycle_count_t cb_ard_elapsed(avr_t * avr, avr_cycle_count_t when, voi
 	(void)avr;
 	(void)when;
 
+	const uint64_t profile_start=profile_enter();
+
 	LOG(NRF_LOG_DEBUG, "cb_ard_elapsed fired\n");
 
 	nRF_t * nRF=(nRF_t*)param;
@@ -821,11 +1932,13 @@ static avr_cycle_count_t cb_ard_elapsed(avr_t * avr, avr_cycle_count_t when, voi
 	{
 		nRF->tx_receive_ack_from->tx_in_progress=false;
 		nRF->rx_ack_timeout=true;
-		LOG(NRF_LOG_WARNING, "WARNING: ARD for nRF %s elapsed while nRF %s was still transmitting, ACK is lost\n", nRF->name, nRF->tx_receive_ack_from->name);
+		LOG(NRF_LOG_WARNING, "WARNING: ARD for nRF %s elapsed while nRF %s was still transmitting, ACK is lost\n", nRF->cold->name, nRF->tx_receive_ack_from->cold->name);
 	}
 
 	update_nRF(nRF);
 
+	profile_leave(NRF_PROFILE_CB_ARD_ELAPSED, profile_start);
+
 	return 0;
 }
 
@@ -834,75 +1947,1044 @@ static avr_cycle_count_t cb_delay_timer(avr_t * avr, avr_cycle_count_t when, voi
 	(void)avr;
 	(void)when;
 
+	const uint64_t profile_start=profile_enter();
+
 	nRF_t * nRF=(nRF_t*)param;
 
-	LOG(NRF_LOG_DEBUG, "cb_delay_timer fired for %s, old state was %u, new is %u\n", nRF->name, nRF->state, nRF->state_next);
+	LOG(NRF_LOG_DEBUG, "cb_delay_timer fired for %s, old state was %u, new is %u\n", nRF->cold->name, nRF->state, nRF->state_next);
 
 	nRF->state=nRF->state_next;
 
 	if(nRF->tx_wait_for_ack) //PTX waiting for ack
 	{
-		LOG(NRF_LOG_DEBUG, "cb_delay_timer: registering timer cb_rx_ack_timeout 250µs for %s\n", nRF->name);
+		LOG(NRF_LOG_DEBUG, "cb_delay_timer: registering timer cb_rx_ack_timeout 250µs for %s\n", nRF->cold->name);
 		avr_cycle_timer_register(nRF->avr, US_TO_CYCLES(nRF->avr, 250), &cb_rx_ack_timeout, nRF); //see footnote datasheet p. 59
 	}
 
 	update_nRF(nRF);
 
+	profile_leave(NRF_PROFILE_CB_DELAY_TIMER, profile_start);
+
 	return 0; //stop timer
 }
 
-////////////////////////////////////////////////////////////////////////
-
-//public functions
+//behavioral model replacing the firmware, see nRF_model()
 
-void nRF_global_init(void)
+static avr_cycle_count_t cb_model_ce_low(avr_t * avr, avr_cycle_count_t when, void * param)
 {
-	lost.lose_packets=false;
-	lost.lose_acks=false;
-	lost.nb_lost_packets=0;
+	(void)avr;
+	(void)when;
+
+	nRF_t * nRF=(nRF_t*)param;
+
+	nRF->pin_CE=0;
+	update_nRF(nRF);
+
+	return 0;
+}
+
+static avr_cycle_count_t cb_model_tx(avr_t * avr, avr_cycle_count_t when, void * param)
+{
+	nRF_t * nRF=(nRF_t*)param;
+	behavioral_model_t * const model=nRF->cold->model; //allocated by nRF_model()
+
+	if(nRF->regs[REG_CONFIG]&(1<<PRIM_RX))
+		LOG(NRF_LOG_VERBOSE, "nRF %s: model: in RX-mode, payload not sent\n", nRF->cold->name);
+	else if(fifo_tx_used(nRF)==3)
+		LOG(NRF_LOG_VERBOSE, "nRF %s: model: TX fifo full, payload not sent\n", nRF->cold->name);
+	else
+	{
+		LOG(NRF_LOG_VERBOSE, "nRF %s: model: sending learned payload %u\n", nRF->cold->name, model->replay);
+		nRF->cold->fifo_tx[nRF->fifo_tx_entries]=model->packets[model->replay];
+		fifo_tx_push(nRF);
+		model->nb_sent++;
+
+		//CE-pulse
+		nRF->pin_CE=1;
+		update_nRF(nRF);
+		avr_cycle_timer_register(avr, US_TO_CYCLES(avr, 15), &cb_model_ce_low, nRF);
+	}
+
+	model->cycle_last_payload=avr->cycle;
+	model->replay=(model->replay+1)%model->nb_packets;
+
+	const avr_cycle_count_t interval=model->intervals[model->replay];
+	return when+(interval?interval:1);
+}
+
+static avr_cycle_count_t cb_model_irq(avr_t * avr, avr_cycle_count_t when, void * param)
+{
+	(void)avr;
+	(void)when;
+
+	nRF_t * nRF=(nRF_t*)param;
+	behavioral_model_t * const model=nRF->cold->model; //allocated by nRF_model()
+
+	//what a simple firmware does in its interrupt handler: read all payloads, give up a packet after MAX_RT, clear the flags
+	if(nRF->regs[REG_STATUS]&(1<<MAX_RT))
+	{
+		model->nb_flushed+=nRF->fifo_tx_entries;
+		nRF->fifo_tx_entries=0;
+	}
+
+	model->nb_drained+=nRF->fifo_rx_entries;
+	nRF->fifo_rx_entries=0;
+	nRF->fifo_rx_readpos=0;
+
+	nRF->regs[REG_STATUS]&=~((1<<TX_DS)|(1<<RX_DR)|(1<<MAX_RT));
+	update_fifo_status(nRF);
+	handle_pin_IRQ(nRF);
+	update_nRF(nRF);
+
+	return 0;
+}
+
+static avr_cycle_count_t cb_until_time(avr_t * avr, avr_cycle_count_t when, void * param)
+{
+	(void)avr;
+	(void)when;
+
+	until_reached((until_t*)param, NULL, "simulated time reached");
+
+	return 0;
+}
+
+static avr_cycle_count_t until_stuck_check(until_t const * const until, nRF_t const * const nRF, avr_t * avr, avr_cycle_count_t when) //0 if reached
+{
+	const avr_cycle_count_t limit=MS_TO_CYCLES(avr, until->ms);
+	const avr_cycle_count_t in_state=avr->cycle-nRF->cycle_state_entered;
+
+	if(in_state<limit) //state changed in between, check again when it could be stuck for long enough
+		return when+limit-in_state;
+
+	if(until->state!=NRF_NB_STATES && nRF->state!=until->state)
+		return when+limit;
+
+	char what[64];
+	snprintf(what, sizeof(what), "stuck in state %s", state_names[nRF->state]);
+	until_reached(until, nRF, what);
+
+	return 0;
+}
+
+static avr_cycle_count_t cb_until_stuck(avr_t * avr, avr_cycle_count_t when, void * param)
+{
+	until_t const * const until=(until_t*)param;
+
+	return until_stuck_check(until, until->nRF, avr, when);
+}
+
+static avr_cycle_count_t cb_until_stuck_any(avr_t * avr, avr_cycle_count_t when, void * param)
+{
+	//one timer per nRF for all conditions without an nRF, they don't take one entry of untils[] per nRF
+	nRF_t const * const nRF=(nRF_t*)param;
+	avr_cycle_count_t next=0;
+
+	uint8_t i;
+	for(i=0; i<nb_untils && !until_done; i++)
+	{
+		if(untils[i].type!=NRF_UNTIL_STUCK || untils[i].nRF)
+			continue;
+
+		const avr_cycle_count_t check=until_stuck_check(&untils[i], nRF, avr, when);
+		if(!check)
+			return 0;
+		if(!next || check<next)
+			next=check;
+	}
+
+	return next;
+}
+
+static void fault_update(fault_t const * const fault) //a fault started or ended, recompute the state checked for every packet
+{
+	uint32_t lost=0; //strongest fault in progress for this channel or link
+	uint32_t i;
+	for(i=0; i<nb_faults_active; i++)
+	{
+		fault_t const * const f=&faults[faults_active[i]];
+		if(f->type!=fault->type || (f->type==NRF_FAULT_CHANNEL && f->channel!=fault->channel) || (f->type==NRF_FAULT_LINK && (f->nRF!=fault->nRF || f->peer!=fault->peer)))
+			continue;
+		if(!lost || f->lost<lost)
+			lost=f->lost;
+	}
+
+	if(fault->type==NRF_FAULT_CHANNEL)
+		fault_channel_lost[fault->channel]=lost;
+	else
+		link_map_set(&fault_link_lost, fault->nRF, fault->peer, lost);
+}
+
+static void fault_edge(fault_edge_t const * const edge)
+{
+	fault_t * const fault=&faults[edge->fault];
+
+	if(edge->start)
+	{
+		fault->active=true;
+		faults_active[nb_faults_active++]=edge->fault;
+	}
+	else
+	{
+		fault->active=false;
+		uint32_t i;
+		for(i=0; i<nb_faults_active; i++)
+		{
+			if(faults_active[i]==edge->fault)
+			{
+				faults_active[i]=faults_active[--nb_faults_active];
+				break;
+			}
+		}
+	}
+
+	switch(fault->type)
+	{
+		case NRF_FAULT_CHANNEL:
+			LOG(NRF_LOG_VERBOSE, "nRF: channel %u fault %s\n", fault->channel, edge->start?"starts":"ends");
+			fault_update(fault);
+			break;
+
+		case NRF_FAULT_LINK:
+			LOG(NRF_LOG_VERBOSE, "nRF: link %s->%s fault %s\n", fault->nRF->cold->name, fault->peer->cold->name, edge->start?"starts":"ends");
+			fault_update(fault);
+			break;
+
+		case NRF_FAULT_BROWNOUT:
+			//the registers are lost when the power goes away and again when it comes back, whatever the firmware wrote in between
+			if(edge->start)
+				fault->nRF->brownout++;
+			else
+				fault->nRF->brownout--;
+			LOG(NRF_LOG_VERBOSE, "nRF %s: brownout %s\n", fault->nRF->cold->name, edge->start?"starts":"ends");
+			reset_nRF(fault->nRF);
+			break;
+	}
+}
+
+static int compare_fault_edges(const void * a, const void * b)
+{
+	//faults given for the same time start and end in the order of the calls
+	fault_edge_t const * const e1=(fault_edge_t const*)a;
+	fault_edge_t const * const e2=(fault_edge_t const*)b;
+
+	if(e1->cycle!=e2->cycle)
+		return (e1->cycle<e2->cycle)?-1:1;
+	if(e1->fault!=e2->fault)
+		return (e1->fault<e2->fault)?-1:1;
+	return e2->start-e1->start;
+}
+
+static avr_cycle_count_t cb_fault_timeline(avr_t * avr, avr_cycle_count_t when, void * param)
+{
+	(void)avr;
+	(void)param;
+
+	if(!fault_edges_sorted) //all edges given so far are sorted at once
+	{
+		qsort(&fault_edges[next_fault_edge], nb_fault_edges-next_fault_edge, sizeof(fault_edge_t), &compare_fault_edges);
+		fault_edges_sorted=true;
+	}
+
+	while(next_fault_edge<nb_fault_edges && fault_edges[next_fault_edge].cycle<=when)
+		fault_edge(&fault_edges[next_fault_edge++]);
+
+	fault_timer_cycle=(next_fault_edge<nb_fault_edges)?fault_edges[next_fault_edge].cycle:0;
+	return fault_timer_cycle;
+}
+
+////////////////////////////////////////////////////////////////////////
+
+//distributed RF medium
+
+static nRF_t * medium_proxy(medium_msg_t const * const msg)
+{
+	nRF_t * proxy=medium_proxies[msg->process][msg->module];
+
+	if(!proxy)
+	{
+		proxy=calloc(1, sizeof(nRF_t));
+		if(proxy)
+			proxy->cold=calloc(1, sizeof(nRF_cold_t));
+		if(!proxy || !proxy->cold)
+			err(1, "nRF: allocating proxy for remote nRF %s failed", msg->name);
+
+		proxy->remote=true;
+		proxy->remote_process=msg->process;
+		proxy->remote_index=msg->module;
+		proxy->state=NRF_POWER_DOWN; //never leaves this state as PWR_UP is never set
+		strncpy(proxy->cold->name, msg->name, NRF_SZ_NAME);
+
+		medium_proxies[msg->process][msg->module]=proxy;
+	}
+
+	return proxy;
+}
+
+static avr_cycle_count_t cb_medium_deliver(avr_t * avr, avr_cycle_count_t when, void * param)
+{
+	const uint64_t profile_start=profile_enter();
+
+	medium_pending_t * const pending=(medium_pending_t*)param;
+	medium_msg_t const * const msg=&pending->msg;
+	nRF_t * const proxy=medium_proxy(msg);
+
+	LOG(NRF_LOG_DEBUG, "cb_medium_deliver: %s from remote nRF %s (process %u)\n", (msg->type==NRF_MEDIUM_MSG_ACK)?"ACK":"packet", msg->name, msg->process);
+
+	memcpy(&proxy->cold->packet_being_sent, &msg->packet, sizeof(packet_tx_t));
+	proxy->packet_being_sent_valid=true;
+
+	if(msg->type==NRF_MEDIUM_MSG_PACKET)
+	{
+		proxy->regs[REG_CONFIG]=msg->reg_config;
+		proxy->regs[REG_RF_CH]=msg->reg_rf_ch;
+		proxy->regs[REG_RF_SETUP]=msg->reg_rf_setup;
+
+		if(lost.lose_packets && (rand()%lost.divider_packets)==0)
+		{
+			lost.nb_lost_packets++;
+			LOG(NRF_LOG_VERBOSE, "nRF %s: simulating lost packet, total %u lost\n", proxy->cold->name, lost.nb_lost_packets);
+			fire_event(NRF_EVENT_PACKET_LOST, proxy, NULL, &proxy->cold->packet_being_sent);
+		}
+		else if(!msg->crc_ok)
+		{
+			bit_errors.nb_dropped_frames++;
+			LOG(NRF_LOG_VERBOSE, "nRF %s: CRC mismatch, packet is dropped by receivers, total %u dropped\n", proxy->cold->name, bit_errors.nb_dropped_frames);
+			fire_event(NRF_EVENT_PACKET_LOST, proxy, NULL, &proxy->cold->packet_being_sent);
+		}
+		else
+			dispatch_sent_packet(proxy);
+
+		proxy->packet_being_sent_valid=false;
+	}
+	else
+	{
+		nRF_t * const nRF_PTX=modules[msg->module_dest];
+
+		if(!msg->crc_ok)
+		{
+			proxy->tx_in_progress=false;
+			proxy->packet_being_sent_valid=false;
+			bit_errors.nb_dropped_frames++;
+			LOG(NRF_LOG_VERBOSE, "nRF %s: CRC mismatch, ACK from %s is dropped, total %u dropped\n", nRF_PTX->cold->name, proxy->cold->name, bit_errors.nb_dropped_frames);
+			fire_event(NRF_EVENT_PACKET_LOST, proxy, nRF_PTX, &proxy->cold->packet_being_sent);
+		}
+		else
+		{
+			proxy->rx_send_ack=true;
+			proxy->rx_send_ack_to=nRF_PTX;
+			cb_tx_finished(avr, when, proxy);
+		}
+	}
+
+	pending->used=false;
+
+	profile_leave(NRF_PROFILE_CB_MEDIUM_DELIVER, profile_start);
+
+	return 0;
+}
+
+static void medium_receive(medium_msg_t const * const msg)
+{
+	uint16_t i;
+	for(i=0; i<NRF_MEDIUM_PROCESSES_MAX*NRF_MEDIUM_SZ_RING; i++)
+	{
+		if(!medium_pending[i].used)
+			break;
+	}
+
+	if(i==NRF_MEDIUM_PROCESSES_MAX*NRF_MEDIUM_SZ_RING)
+		errx(1, "nRF: internal error: medium_receive: no free slot for pending packet");
+
+	medium_pending[i].used=true;
+	memcpy(&medium_pending[i].msg, msg, sizeof(medium_msg_t));
+
+	avr_t * avr;
+	if(msg->type==NRF_MEDIUM_MSG_ACK)
+	{
+		//the ACK is already on air, the PTX needs to know this for cb_ard_elapsed and cb_rx_ack_timeout
+		nRF_t * const proxy=medium_proxy(msg);
+		if(msg->module_dest>=nb_modules)
+			errx(1, "nRF: internal error: medium_receive: ACK from %s for inexistent nRF %u", msg->name, msg->module_dest);
+		proxy->tx_in_progress=true;
+		modules[msg->module_dest]->tx_receive_ack_from=proxy;
+		avr=modules[msg->module_dest]->avr;
+	}
+	else
+		avr=modules[0]->avr;
+
+	avr_cycle_count_t when=NS_TO_CYCLES(avr, msg->time_end_ns);
+	if(when<=avr->cycle)
+	{
+		medium_nb_late++;
+		LOG(NRF_LOG_WARNING, "WARNING: %s from nRF %s (process %u) arrived late by %lu cycles and is delivered now, call nRF_medium_sync() before every avr_run()\n", (msg->type==NRF_MEDIUM_MSG_ACK)?"ACK":"packet", msg->name, msg->process, (unsigned long)(avr->cycle-when));
+		when=avr->cycle+1;
+	}
+
+	avr_cycle_timer_register(avr, when-avr->cycle, &cb_medium_deliver, &medium_pending[i]);
+}
+
+static void medium_drain(void)
+{
+	uint8_t process;
+	for(process=0; process<medium_nb_processes; process++)
+	{
+		if(process==medium_process)
+			continue;
+
+		medium_ring_t * const ring=&medium->rings[process][medium_process];
+		uint32_t tail=ring->tail;
+
+		while(tail!=__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+		{
+			medium_receive(&ring->msgs[tail%NRF_MEDIUM_SZ_RING]);
+			tail++;
+			__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+		}
+	}
+}
+
+static void medium_send(medium_msg_t const * const msg, const uint8_t process_dest)
+{
+	medium_ring_t * const ring=&medium->rings[medium_process][process_dest];
+	uint32_t head=ring->head;
+
+	while(head-__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)==NRF_MEDIUM_SZ_RING)
+	{
+		medium_drain(); //the other process might be waiting for us to drain its ring
+		sched_yield();
+	}
+
+	memcpy(&ring->msgs[head%NRF_MEDIUM_SZ_RING], msg, sizeof(medium_msg_t));
+	__atomic_store_n(&ring->head, head+1, __ATOMIC_RELEASE);
+}
+
+static void medium_fill_msg(medium_msg_t * const msg, nRF_t const * const nRF, const uint32_t time_on_air_us)
+{
+	msg->process=medium_process;
+	msg->module=nRF->index;
+	strncpy(msg->name, nRF->cold->name, NRF_SZ_NAME);
+	msg->reg_config=nRF->regs[REG_CONFIG]&(1<<CRCO);
+	msg->reg_rf_ch=nRF->regs[REG_RF_CH];
+	msg->reg_rf_setup=nRF->regs[REG_RF_SETUP];
+	msg->crc_ok=!nRF->cold->frame_synthesis || frame_crc_ok(nRF);
+	msg->time_start_ns=CYCLES_TO_NS(nRF->avr, nRF->avr->cycle);
+	msg->time_end_ns=msg->time_start_ns+1000UL*time_on_air_us;
+	memcpy(&msg->packet, &nRF->cold->packet_being_sent, sizeof(packet_tx_t));
+}
+
+static void medium_send_packet(nRF_t * const nRF, const uint32_t time_on_air_us)
+{
+	medium_msg_t msg;
+
+	medium_fill_msg(&msg, nRF, time_on_air_us);
+	msg.type=NRF_MEDIUM_MSG_PACKET;
+	msg.module_dest=0;
+
+	uint8_t process;
+	for(process=0; process<medium_nb_processes; process++)
+	{
+		if(process!=medium_process)
+			medium_send(&msg, process);
+	}
+}
+
+static void medium_send_ack(nRF_t * const nRF, const uint32_t time_on_air_us)
+{
+	medium_msg_t msg;
+
+	medium_fill_msg(&msg, nRF, time_on_air_us);
+	msg.type=NRF_MEDIUM_MSG_ACK;
+	msg.module_dest=nRF->rx_send_ack_to->remote_index;
+
+	medium_send(&msg, nRF->rx_send_ack_to->remote_process);
+}
+
+static avr_cycle_count_t cb_medium_horizon(avr_t * avr, avr_cycle_count_t when, void * param)
+{
+	(void)avr;
+	(void)when;
+	(void)param;
+
+	return 0; //nothing to do, a sleeping AVR just must not skip over the horizon
+}
+
+static void medium_arm_horizon(void)
+{
+	if(medium_horizon_ns==UINT64_MAX)
+		return;
+
+	uint16_t i;
+	for(i=0; i<nb_modules; i++)
+	{
+		avr_t * const avr=modules[i]->avr;
+		const avr_cycle_count_t when=NS_TO_CYCLES(avr, medium_horizon_ns);
+		if(when>avr->cycle)
+			avr_cycle_timer_register(avr, when-avr->cycle, &cb_medium_horizon, modules[i]);
+	}
+}
+
+static uint64_t medium_local_time_ns(void)
+{
+	uint64_t time_ns=UINT64_MAX;
+
+	uint16_t i;
+	for(i=0; i<nb_modules; i++)
+	{
+		uint64_t t=CYCLES_TO_NS(modules[i]->avr, modules[i]->avr->cycle);
+		if(t<time_ns)
+			time_ns=t;
+	}
+
+	return time_ns;
+}
+
+static void power_on_reset(nRF_t * const nRF) //registers and internal state as after power-on, the connections and statistics are kept
+{
+	nRF->state_spi=NRF_SPI_IDLE;
+
+	//default values taken from datasheet
+	nRF->regs[REG_CONFIG]=(1<<EN_CRC);
+	nRF->regs[REG_EN_AA]=(1<<ENAA_P0)|(1<<ENAA_P1)|(1<<ENAA_P2)|(1<<ENAA_P3)|(1<<ENAA_P4)|(1<<ENAA_P5);
+	nRF->regs[REG_EN_RXADDR]=(1<<ERX_P0)|(1<<ERX_P1);
+	nRF->regs[REG_SETUP_AW]=(0b11<<AW);
+	nRF->regs[REG_SETUP_RETR]=(0b11<<ARC);
+	nRF->regs[REG_RF_CH]=2;
+	nRF->regs[REG_RF_SETUP]=(1<<RF_DR_HIGH)|(0b11<<RF_PWR);
+	nRF->regs[REG_STATUS]=(0b111<<RX_P_NO);
+	nRF->regs[REG_OBSERVE_TX]=0;
+	nRF->regs[REG_RPD]=0;
+	nRF->addr[ADDR_RX_P0]=0xe7e7e7e7e7;
+	nRF->addr[ADDR_RX_P1]=0xc2c2c2c2c2;
+	nRF->regs[REG_RX_ADDR_P2]=0xc3;
+	nRF->regs[REG_RX_ADDR_P3]=0xc4;
+	nRF->regs[REG_RX_ADDR_P4]=0xc5;
+	nRF->regs[REG_RX_ADDR_P5]=0xc6;
+	nRF->addr[ADDR_TX]=0xe7e7e7e7e7;
+	nRF->regs[REG_RX_PW_P0]=0;
+	nRF->regs[REG_RX_PW_P1]=0;
+	nRF->regs[REG_RX_PW_P2]=0;
+	nRF->regs[REG_RX_PW_P3]=0;
+	nRF->regs[REG_RX_PW_P4]=0;
+	nRF->regs[REG_RX_PW_P5]=0;
+	nRF->regs[REG_FIFO_STATUS]=(1<<FIFO_TX_EMPTY)|(1<<FIFO_RX_EMPTY);
+	nRF->regs[REG_DYNPD]=0; //TODO: not checked by code
+	nRF->regs[REG_FEATURE]=0; //TODO: only partially checked by code
+
+	uint8_t reg;
+	for(reg=0; reg<30; reg++) //overrides are part of the simulation, not of the nRF
+		nRF->regs[reg]=(nRF->regs[reg]&~nRF->cold->regs_override_mask[reg])|nRF->cold->regs_override_value[reg];
+
+	nRF->state=NRF_POWER_DOWN;
+
+	nRF->PID=0;
+
+	nRF->fifo_rx_entries=0;
+	nRF->fifo_rx_readpos=0;
+
+	nRF->fifo_tx_entries=0;
+
+	flush_ack_payloads(nRF);
+
+	nRF->tx_in_progress=false;
+
+	nRF->tx_finished=false;
+
+	nRF->tx_wait_for_ack=false;
+
+	nRF->ard_has_elapsed=false;
+
+	nRF->nb_retries=0;
+
+	nRF->rx_ack_timeout=false;
+
+	nRF->tx_ack_received=false;
+
+	nRF->rx_send_ack=false;
+
+	nRF->rx_send_ack_to=NULL;
+
+	nRF->tx_receive_ack_from=NULL;
+
+	nRF->last_rx_valid=false;
+
+	nRF->packet_being_sent_valid=false;
+}
+
+////////////////////////////////////////////////////////////////////////
+
+//public functions
+
+void nRF_global_init(void)
+{
+	lost.lose_packets=false;
+	lost.lose_acks=false;
+	lost.nb_lost_packets=0;
 	lost.nb_lost_acks=0;
 
-	stats.nb_packets=0;
-	stats.nb_acks=0;
+	stats.nb_packets=0;
+	stats.nb_acks=0;
+
+	bit_errors.corrupt_frames=false;
+	bit_errors.nb_corrupted_frames=0;
+	bit_errors.nb_dropped_frames=0;
+
+	init_crc_tables();
+
+	link_map_free(&path_loss_dB);
+
+	memset(nb_event_callbacks, 0, sizeof(nb_event_callbacks));
+
+	nb_untils=0;
+	nb_untils_register=0;
+	until_done=false;
+
+	nb_faults=0;
+	nb_fault_edges=0;
+	next_fault_edge=0;
+	nb_faults_active=0;
+	memset(fault_channel_lost, 0, sizeof(fault_channel_lost));
+	fault_edges_sorted=true;
+	fault_timer_cycle=0;
+	link_map_free(&fault_link_lost);
+	nb_fault_lost_packets=0;
+	nb_fault_lost_acks=0;
+}
+
+void nRF_stop_on_error(const bool yesno)
+{
+	stop_on_error=yesno;
+}
+
+void nRF_set_log_level(const nRF_log_level_t level)
+{
+	loglevel=level;
+}
+
+void nRF_log_to_file(nRF_t * const nRF, char const * const filename)
+{
+	nRF->cold->log=fopen(filename, "w");
+	if(nRF->cold->log==NULL)
+		err(1, "nRF %s: creating logfile %s failed", nRF->cold->name, filename);
+	nRF->cold->log_tx_to_file=true;
+
+	fprintf(nRF->cold->log, "LOGFILE FOR nRF %s\n", nRF->cold->name);
+
+	printf("nRF %s: logging enabled\n", nRF->cold->name);
+}
+
+void nRF_set_lost_packets(const uint32_t lost_packets, const uint32_t lost_acks)
+{
+	if(lost_packets)
+	{
+		lost.lose_packets=true;
+		lost.divider_packets=lost_packets;
+		printf("nRF: simulating 1 lost packet for %u packets sent\n", lost_packets);
+	}
+
+	if(lost_acks)
+	{
+		lost.lose_acks=true;
+		lost.divider_acks=lost_acks;
+		printf("nRF: simulating 1 lost ACK-packet for %u ACK-packets sent\n", lost_acks);
+	}
+}
+
+void nRF_capture_frames(nRF_t * const nRF, char const * const filename)
+{
+	nRF->cold->frame_synthesis=true;
+
+	if(filename)
+	{
+		nRF->cold->capture=fopen(filename, "w");
+		if(nRF->cold->capture==NULL)
+			err(1, "nRF %s: creating capture file %s failed", nRF->cold->name, filename);
+
+		fprintf(nRF->cold->capture, "FRAME CAPTURE FOR nRF %s\n", nRF->cold->name);
+	}
+
+	printf("nRF %s: frame synthesis enabled\n", nRF->cold->name);
+}
+
+void nRF_telemetry(char const * const filename)
+{
+	int fd=open(filename, O_RDWR|O_CREAT|O_TRUNC, 0644);
+	if(fd<0)
+		err(1, "nRF: creating telemetry file %s failed", filename);
+
+	if(ftruncate(fd, sizeof(nRF_telemetry_t)))
+		err(1, "nRF: resizing telemetry file %s failed", filename);
+
+	telemetry=mmap(NULL, sizeof(nRF_telemetry_t), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if(telemetry==MAP_FAILED)
+		err(1, "nRF: mapping telemetry file %s failed", filename);
+
+	close(fd); //mapping stays valid
+
+	telemetry->sz_slot=sizeof(nRF_telemetry_slot_t);
+	telemetry->nb_modules=nb_modules;
+	telemetry->version=NRF_TELEMETRY_VERSION;
+	__atomic_store_n(&telemetry->magic, NRF_TELEMETRY_MAGIC, __ATOMIC_RELEASE); //written last, readers can wait for it
+
+	uint16_t i;
+	for(i=0; i<nb_modules; i++)
+		telemetry_publish(modules[i]);
+
+	printf("nRF: publishing telemetry to %s\n", filename);
+}
+
+void nRF_medium_join(char const * const filename, const uint8_t process, const uint8_t nb_processes)
+{
+	if(nb_processes>NRF_MEDIUM_PROCESSES_MAX)
+		errx(1, "nRF_medium_join: too many processes, increase NRF_MEDIUM_PROCESSES_MAX");
+	if(process>=nb_processes)
+		errx(1, "nRF_medium_join: process %u out of range", process);
+	if(nb_modules==0)
+		errx(1, "nRF_medium_join: no nRF in this process, call make_new_nRF() and nRF_init() first");
+
+	int fd=open(filename, O_RDWR|O_CREAT, 0644);
+	if(fd<0)
+		err(1, "nRF: opening medium file %s failed", filename);
+
+	struct stat st;
+	if(fstat(fd, &st))
+		err(1, "nRF: stat of medium file %s failed", filename);
+
+	if(st.st_size<(off_t)sizeof(medium_shm_t) && ftruncate(fd, sizeof(medium_shm_t))) //never shrink, the other processes may have it mapped already
+		err(1, "nRF: resizing medium file %s failed", filename);
+
+	medium=mmap(NULL, sizeof(medium_shm_t), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if(medium==MAP_FAILED)
+		err(1, "nRF: mapping medium file %s failed", filename);
+
+	close(fd); //mapping stays valid
+
+	medium_process=process;
+	medium_nb_processes=nb_processes;
+	medium_horizon_ns=0;
+	medium_nb_late=0;
+
+	//process 0 clears what an earlier run left in the file, the others announce themselves until process 0 has seen them after that
+	if(process==0)
+	{
+		memset(medium, 0, sizeof(medium_shm_t));
+
+		uint8_t p;
+		for(p=1; p<nb_processes; p++)
+		{
+			while(!__atomic_load_n(&medium->joined[p], __ATOMIC_ACQUIRE))
+				sched_yield();
+		}
+		for(p=1; p<nb_processes; p++)
+			__atomic_store_n(&medium->welcome[p], 1, __ATOMIC_RELEASE);
+	}
+	else
+	{
+		__atomic_store_n(&medium->welcome[process], 0, __ATOMIC_RELEASE);
+		while(!__atomic_load_n(&medium->welcome[process], __ATOMIC_ACQUIRE))
+		{
+			__atomic_store_n(&medium->joined[process], 1, __ATOMIC_RELEASE); //again, process 0 may have cleared it
+			sched_yield();
+		}
+	}
+
+	printf("nRF: joined RF medium %s as process %u of %u\n", filename, process, nb_processes);
+}
+
+void nRF_medium_sync(void)
+{
+	if(!medium)
+		return;
+
+	uint64_t now_ns=medium_local_time_ns();
+	if(now_ns<medium_horizon_ns) //fast path, nothing can arrive before the horizon
+		return;
+
+	__atomic_store_n(&medium->time_ns[medium_process], now_ns, __ATOMIC_RELEASE);
+
+	while(1)
+	{
+		uint64_t min_ns=UINT64_MAX;
+
+		uint8_t process;
+		for(process=0; process<medium_nb_processes; process++)
+		{
+			if(process==medium_process)
+				continue;
+
+			uint64_t t=__atomic_load_n(&medium->time_ns[process], __ATOMIC_ACQUIRE);
+			if(t<min_ns)
+				min_ns=t;
+		}
+
+		//everything sent before the other processes published their time is visible now
+		medium_drain();
+
+		medium_horizon_ns=(min_ns>UINT64_MAX-NRF_MEDIUM_LOOKAHEAD_NS)?UINT64_MAX:(min_ns+NRF_MEDIUM_LOOKAHEAD_NS);
+		if(now_ns<medium_horizon_ns)
+		{
+			medium_arm_horizon();
+			break;
+		}
+
+		sched_yield();
+	}
+}
+
+void nRF_register_event_callback(const nRF_event_t event, nRF_event_cb_t cb, void * param)
+{
+	if(event>=NRF_NB_EVENTS)
+		errx(1, "nRF_register_event_callback: invalid event %u", event);
+
+	if(nb_event_callbacks[event]==NRF_EVENT_CALLBACKS_MAX)
+		errx(1, "nRF_register_event_callback: too many callbacks for event %u, increase NRF_EVENT_CALLBACKS_MAX", event);
+
+	event_callbacks[event][nb_event_callbacks[event]].cb=cb;
+	event_callbacks[event][nb_event_callbacks[event]].param=param;
+	nb_event_callbacks[event]++;
 }
 
-void nRF_stop_on_error(const bool yesno)
+void nRF_trace(char const * const filename)
 {
-	stop_on_error=yesno;
+	trace=fopen(filename, "w");
+	if(trace==NULL)
+		err(1, "nRF: creating trace file %s failed", filename);
+
+	setvbuf(trace, NULL, _IOFBF, 1<<20);
+
+	fprintf(trace, "[\n"); //JSON array format, the closing bracket is optional so the file can be loaded even if the simulation crashed
+
+	uint16_t i;
+	for(i=0; i<nb_modules; i++)
+		trace_metadata(modules[i]);
+
+	printf("nRF: writing trace to %s\n", filename);
 }
 
-void nRF_set_log_level(const nRF_log_level_t level)
+void nRF_retransmit_advisor(const bool yesno)
 {
-	loglevel=level;
+	advisor=yesno;
 }
 
-void nRF_log_to_file(nRF_t * const nRF, char const * const filename)
+void nRF_profile(const bool yesno)
+{
+	profile=yesno;
+	if(!yesno)
+		return;
+
+	memset(profile_stats, 0, sizeof(profile_stats));
+	profile_depth=0;
+	profile_outer_ns=0;
+	profile_start_ns=profile_now_ns();
+
+	uint16_t i;
+	for(i=0; i<nb_modules; i++)
+	{
+		if(modules[i]->avr) //else nRF_init() will do it
+			modules[i]->cold->profile_cycle_start=modules[i]->avr->cycle;
+	}
+}
+
+static until_t * until_add(const until_type_t type, nRF_t const * const nRF, const int result)
 {
-	nRF->log=fopen(filename, "w");
-	if(nRF->log==NULL)
-		err(1, "nRF %s: creating logfile %s failed", nRF->name, filename);
-	nRF->log_tx_to_file=true;
+	if(nb_untils==NRF_UNTIL_MAX)
+		errx(1, "nRF_until: too many conditions, increase NRF_UNTIL_MAX");
 
-	fprintf(nRF->log, "LOGFILE FOR nRF %s\n", nRF->name);
+	until_t * const until=&untils[nb_untils++];
+	memset(until, 0, sizeof(until_t));
+	until->type=type;
+	until->nRF=nRF;
+	until->state=NRF_NB_STATES;
+	until->result=result;
 
-	printf("nRF %s: logging enabled\n", nRF->name);
+	return until;
 }
 
-void nRF_set_lost_packets(const uint32_t lost_packets, const uint32_t lost_acks)
+void nRF_until_delivered(nRF_t const * const from, nRF_t const * const to, const uint32_t nb_packets, const int result)
 {
-	if(lost_packets)
+	until_t * const until=until_add(NRF_UNTIL_DELIVERED, to, result);
+	until->peer=from;
+	until->nb_packets=nb_packets;
+}
+
+void nRF_until_max_rt(nRF_t const * const nRF, const int result)
+{
+	until_add(NRF_UNTIL_MAX_RT, nRF, result);
+}
+
+void nRF_until_register(nRF_t const * const nRF, const uint8_t reg, const uint8_t mask, const uint8_t value, const int result)
+{
+	if(reg>=30 || regs_len_bytes[reg]!=1)
+		errx(1, "nRF_until_register: register 0x%02x can't be checked", reg);
+
+	until_t * const until=until_add(NRF_UNTIL_REGISTER, nRF, result);
+	until->reg=reg;
+	until->mask=mask;
+	until->value=value&mask;
+	nb_untils_register++;
+}
+
+void nRF_until_time(const uint32_t ms, const int result)
+{
+	if(nb_modules==0 || !modules[0]->avr)
+		errx(1, "nRF_until_time: call nRF_init() first");
+
+	until_t * const until=until_add(NRF_UNTIL_TIME, NULL, result);
+	until->ms=ms;
+
+	avr_t * const avr=modules[0]->avr; //all AVR are at about the same simulated time
+	const avr_cycle_count_t cycle=MS_TO_CYCLES(avr, ms);
+	if(avr->cycle>=cycle)
+		until_reached(until, NULL, "simulated time reached");
+	else
+		avr_cycle_timer_register(avr, cycle-avr->cycle, &cb_until_time, until);
+}
+
+void nRF_until_stuck(nRF_t const * const nRF, const state_nRF_t state, const uint32_t ms, const int result)
+{
+	uint16_t i;
+	for(i=0; i<nb_modules; i++)
 	{
-		lost.lose_packets=true;
-		lost.divider_packets=lost_packets;
-		printf("nRF: simulating 1 lost packet for %u packets sent\n", lost_packets);
+		if((!nRF || modules[i]==nRF) && !modules[i]->avr)
+			errx(1, "nRF_until_stuck: call nRF_init() first");
 	}
 
-	if(lost_acks)
+	until_t * const until=until_add(NRF_UNTIL_STUCK, nRF, result);
+	until->state=state;
+	until->ms=ms;
+
+	if(nRF)
 	{
-		lost.lose_acks=true;
-		lost.divider_acks=lost_acks;
-		printf("nRF: simulating 1 lost ACK-packet for %u ACK-packets sent\n", lost_acks);
+		avr_cycle_timer_register(nRF->avr, MS_TO_CYCLES(nRF->avr, ms), &cb_until_stuck, until);
+		return;
+	}
+
+	//any module: the timer of each nRF checks all these conditions, the earliest one is registered
+	for(i=0; i<nb_modules; i++)
+		avr_cycle_timer_register(modules[i]->avr, 1, &cb_until_stuck_any, modules[i]);
+}
+
+bool nRF_done(int * const result)
+{
+	if(until_done && result)
+		*result=until_result;
+
+	return until_done;
+}
+
+void nRF_set_supply_voltage(const double voltage)
+{
+	supply_voltage=voltage;
+}
+
+void nRF_get_energy(nRF_t * const nRF, nRF_energy_t * const energy)
+{
+	account_energy(nRF);
+
+	avr_cycle_count_t cycles_total=0;
+
+	uint8_t i;
+	for(i=0; i<NRF_NB_STATES; i++)
+	{
+		energy->residency_cycles[i]=nRF->cold->residency_cycles[i];
+		energy->residency_ms[i]=CYCLES_TO_MS_FLOAT(nRF->avr, nRF->cold->residency_cycles[i]);
+		cycles_total+=nRF->cold->residency_cycles[i];
+	}
+
+	energy->charge_uC=nRF->cold->charge_uC;
+	energy->energy_uJ=nRF->cold->charge_uC*supply_voltage;
+	energy->average_current_uA=cycles_total?(nRF->cold->charge_uC*nRF->avr->frequency/cycles_total):0;
+}
+
+void nRF_set_bit_errors(const uint32_t corrupted_frames)
+{
+	if(corrupted_frames)
+	{
+		bit_errors.corrupt_frames=true;
+		bit_errors.divider_frames=corrupted_frames;
+		printf("nRF: simulating 1 corrupted frame for %u frames sent\n", corrupted_frames);
+	}
+}
+
+static void fault_edge_append(const avr_cycle_count_t cycle, const uint32_t fault, const bool start)
+{
+	fault_edge_t * const edge=&fault_edges[nb_fault_edges++];
+	edge->cycle=cycle;
+	edge->fault=fault;
+	edge->start=start;
+	fault_edges_sorted=false;
+}
+
+static void fault_add(fault_t const * const fault, const uint32_t from_ms, const uint32_t to_ms, char const * const function)
+{
+	if(nb_modules==0 || !modules[0]->avr)
+		errx(1, "%s: call nRF_init() first", function);
+	if(to_ms<=from_ms)
+		errx(1, "%s: fault ends before it starts", function);
+
+	if(nb_faults==sz_faults)
+	{
+		sz_faults=sz_faults?2*sz_faults:16;
+		faults=realloc(faults, sz_faults*sizeof(fault_t));
+		faults_active=realloc(faults_active, sz_faults*sizeof(uint32_t));
+		fault_edges=realloc(fault_edges, 2*sz_faults*sizeof(fault_edge_t)); //start and end
+		if(!faults || !faults_active || !fault_edges)
+			err(1, "%s: realloc failed", function);
 	}
+
+	faults[nb_faults]=*fault;
+	faults[nb_faults].active=false;
+
+	avr_t * const avr=modules[0]->avr; //all AVR are at about the same simulated time
+	const avr_cycle_count_t from=MS_TO_CYCLES(avr, from_ms);
+	fault_edge_append(from, nb_faults, true);
+	fault_edge_append(MS_TO_CYCLES(avr, to_ms), nb_faults, false);
+	nb_faults++;
+
+	if(fault->type==NRF_FAULT_LINK && !link_map_get(&fault_link_lost, fault->nRF, fault->peer, 0))
+		link_map_set(&fault_link_lost, fault->nRF, fault->peer, 0); //stored now, not while the simulation runs
+
+	if(!fault_timer_cycle || from<fault_timer_cycle)
+	{
+		fault_timer_cycle=(from>avr->cycle)?from:avr->cycle+1;
+		avr_cycle_timer_register(avr, fault_timer_cycle-avr->cycle, &cb_fault_timeline, NULL);
+	}
+}
+
+void nRF_fault_channel(const uint8_t channel, const uint32_t from_ms, const uint32_t to_ms, const uint32_t lost_packets)
+{
+	if(channel>=128)
+		errx(1, "nRF_fault_channel: invalid channel %u", channel);
+
+	fault_t fault={.type=NRF_FAULT_CHANNEL, .channel=channel, .lost=lost_packets?lost_packets:1};
+	fault_add(&fault, from_ms, to_ms, "nRF_fault_channel");
+}
+
+void nRF_fault_link(nRF_t * const from, nRF_t const * const to, const uint32_t from_ms, const uint32_t to_ms, const uint32_t lost_packets)
+{
+	if(from->remote || to->remote)
+		errx(1, "nRF_fault_link: link %s->%s crosses processes", from->cold->name, to->cold->name);
+
+	fault_t fault={.type=NRF_FAULT_LINK, .nRF=from, .peer=to, .lost=lost_packets?lost_packets:1};
+	fault_add(&fault, from_ms, to_ms, "nRF_fault_link");
+}
+
+void nRF_fault_brownout(nRF_t * const nRF, const uint32_t from_ms, const uint32_t to_ms)
+{
+	if(nRF->remote)
+		errx(1, "nRF_fault_brownout: nRF %s is simulated by another process", nRF->cold->name);
+
+	fault_t fault={.type=NRF_FAULT_BROWNOUT, .nRF=nRF};
+	fault_add(&fault, from_ms, to_ms, "nRF_fault_brownout");
+}
+
+void nRF_set_path_loss(nRF_t const * const nRF1, nRF_t const * const nRF2, const uint8_t loss_dB)
+{
+	if(nRF1->remote || nRF2->remote)
+		errx(1, "nRF_set_path_loss: %s or %s is simulated by another process", nRF1->cold->name, nRF2->cold->name);
+
+	link_map_set(&path_loss_dB, nRF1, nRF2, loss_dB);
+	link_map_set(&path_loss_dB, nRF2, nRF1, loss_dB);
 }
 
 nRF_t * make_new_nRF(void)
@@ -911,9 +2993,17 @@ nRF_t * make_new_nRF(void)
 		errx(1, "make_new_nRF: no more space in modules[], increase NB_NRF_MAX");
 
 	nRF_t * ptr=malloc(sizeof(nRF_t));
+	if(ptr)
+		ptr->cold=calloc(1, sizeof(nRF_cold_t));
+	if(!ptr || !ptr->cold)
+		err(1, "make_new_nRF: allocating nRF failed");
 
+	ptr->index=nb_modules;
 	modules[nb_modules++]=ptr;
 
+	if(telemetry)
+		telemetry->nb_modules=nb_modules;
+
 	return ptr;
 }
 
@@ -923,71 +3013,180 @@ void nRF_init(struct avr_t * avr, nRF_t * const nRF, char const * const name)
 
 	nRF->irq=avr_alloc_irq(&avr->irq_pool, 0, NRF24_IRQ_COUNT, irq_names);
 
+	nRF->remote=false;
+
+	nRF->spi_irq_in=NULL;
+
 	avr_irq_register_notify(nRF->irq+NRF24_CE_IN, &cb_ce, nRF);
 
-	strncpy(nRF->name, name, NRF_SZ_NAME);
+	strncpy(nRF->cold->name, name, NRF_SZ_NAME-1);
+	nRF->cold->name[NRF_SZ_NAME-1]='\0';
 
 	nRF->pin_CSN=1;
 	nRF->pin_CE=0;
 	nRF->pin_IRQ=1;
 
-	//default values taken from datasheet
-	nRF->regs[REG_CONFIG]=(1<<EN_CRC);
-	nRF->regs[REG_EN_AA]=(1<<ENAA_P0)|(1<<ENAA_P1)|(1<<ENAA_P2)|(1<<ENAA_P3)|(1<<ENAA_P4)|(1<<ENAA_P5);
-	nRF->regs[REG_EN_RXADDR]=(1<<ERX_P0)|(1<<ERX_P1);
-	nRF->regs[REG_SETUP_AW]=(0b11<<AW);
-	nRF->regs[REG_SETUP_RETR]=(0b11<<ARC);
-	nRF->regs[REG_RF_CH]=2;
-	nRF->regs[REG_RF_SETUP]=(1<<RF_DR_HIGH)|(0b11<<RF_PWR);
-	nRF->regs[REG_STATUS]=(0b111<<RX_P_NO);
-	nRF->regs[REG_OBSERVE_TX]=0;
-	nRF->regs[REG_RPD]=0;
-	nRF->regs[REG_RX_ADDR_P0]=0xe7e7e7e7e7;
-	nRF->regs[REG_RX_ADDR_P1]=0xc2c2c2c2c2;
-	nRF->regs[REG_RX_ADDR_P2]=0xc3;
-	nRF->regs[REG_RX_ADDR_P3]=0xc4;
-	nRF->regs[REG_RX_ADDR_P4]=0xc5;
-	nRF->regs[REG_RX_ADDR_P5]=0xc6;
-	nRF->regs[REG_TX_ADDR]=0xe7e7e7e7e7;
-	nRF->regs[REG_RX_PW_P0]=0;
-	nRF->regs[REG_RX_PW_P1]=0;
-	nRF->regs[REG_RX_PW_P2]=0;
-	nRF->regs[REG_RX_PW_P3]=0;
-	nRF->regs[REG_RX_PW_P4]=0;
-	nRF->regs[REG_RX_PW_P5]=0;
-	nRF->regs[REG_FIFO_STATUS]=(1<<FIFO_TX_EMPTY)|(1<<FIFO_RX_EMPTY);
-	nRF->regs[REG_DYNPD]=0; //TODO: not checked by code
-	nRF->regs[REG_FEATURE]=0; //TODO: only partially checked by code
+	memset(nRF->cold->regs_override_mask, 0, sizeof(nRF->cold->regs_override_mask));
+	memset(nRF->cold->regs_override_value, 0, sizeof(nRF->cold->regs_override_value));
 
-	nRF->state=NRF_POWER_DOWN;
+	power_on_reset(nRF);
 
-	nRF->PID=0;
+	nRF->cold->log=NULL;
+	nRF->cold->log_tx_to_file=false;
+	nRF->cold->avr_cycle_last_tx=0;
 
-	nRF->fifo_rx_entries=0;
+	nRF->cold->frame_synthesis=false;
+	nRF->cold->frame_nb_bits=0;
+	nRF->cold->capture=NULL;
 
-	nRF->fifo_tx_entries=0;
+	memset(&nRF->cold->stats, 0, sizeof(module_stats_t));
+	free(nRF->cold->advisor);
+	nRF->cold->advisor=NULL;
+	free(nRF->cold->model);
+	nRF->cold->model=NULL;
+	nRF->cold->model_cycle_init=avr->cycle;
 
-	nRF->tx_in_progress=false;
+	nRF->cold->energy_state=NRF_POWER_DOWN;
+	nRF->cold->energy_cycle_last=avr->cycle;
+	nRF->cold->energy_current_uA=state_current_uA(nRF);
+	memset(nRF->cold->residency_cycles, 0, sizeof(nRF->cold->residency_cycles));
+	nRF->cold->charge_uC=0;
 
-	nRF->tx_finished=false;
+	nRF->cycle_state_entered=avr->cycle;
+	nRF->cold->profile_cycle_start=avr->cycle;
+	nRF->cold->trace_flow=0;
+	nRF->brownout=0;
 
-	nRF->tx_wait_for_ack=false;
+	air_update_config(nRF);
+}
 
-	nRF->tx_ack_received=false;
+static void rearm_timers(avr_t * const avr)
+{
+	//avr_reset() drops every cycle timer of an AVR, also those of the conditions, the fault timeline and the RF medium
+	uint16_t i;
+	for(i=0; i<nb_untils && !until_done; i++)
+	{
+		until_t * const until=&untils[i];
 
-	nRF->rx_send_ack=false;
+		if(until->type==NRF_UNTIL_TIME && avr==modules[0]->avr)
+		{
+			const avr_cycle_count_t cycle=MS_TO_CYCLES(avr, until->ms);
+			avr_cycle_timer_register(avr, (cycle>avr->cycle)?cycle-avr->cycle:1, &cb_until_time, until);
+		}
+		else if(until->type==NRF_UNTIL_STUCK && until->nRF && until->nRF->avr==avr)
+			avr_cycle_timer_register(avr, MS_TO_CYCLES(avr, until->ms), &cb_until_stuck, until);
+		else if(until->type==NRF_UNTIL_STUCK && !until->nRF)
+		{
+			uint16_t m;
+			for(m=0; m<nb_modules; m++)
+			{
+				if(modules[m]->avr==avr)
+					avr_cycle_timer_register(avr, 1, &cb_until_stuck_any, modules[m]);
+			}
+		}
+	}
 
-	nRF->rx_send_ack_to=NULL;
+	if(avr==modules[0]->avr && fault_timer_cycle)
+		avr_cycle_timer_register(avr, (fault_timer_cycle>avr->cycle)?fault_timer_cycle-avr->cycle:1, &cb_fault_timeline, NULL);
 
-	nRF->tx_receive_ack_from=NULL;
+	if(!medium)
+		return;
 
-	nRF->last_rx_valid=false;
+	for(i=0; i<NRF_MEDIUM_PROCESSES_MAX*NRF_MEDIUM_SZ_RING; i++)
+	{
+		medium_msg_t const * const msg=&medium_pending[i].msg;
+		if(!medium_pending[i].used || modules[(msg->type==NRF_MEDIUM_MSG_ACK)?msg->module_dest:0]->avr!=avr)
+			continue;
 
-	nRF->packet_being_sent_valid=false;
+		const avr_cycle_count_t when=NS_TO_CYCLES(avr, msg->time_end_ns);
+		avr_cycle_timer_register(avr, (when>avr->cycle)?when-avr->cycle:1, &cb_medium_deliver, &medium_pending[i]);
+	}
+
+	medium_arm_horizon();
+}
+
+static void reset_nRF(nRF_t * const nRF)
+{
+	avr_cycle_timer_cancel(nRF->avr, &cb_delay_timer, nRF);
+	avr_cycle_timer_cancel(nRF->avr, &cb_tx_finished, nRF);
+	avr_cycle_timer_cancel(nRF->avr, &cb_ard_elapsed, nRF);
+	avr_cycle_timer_cancel(nRF->avr, &cb_rx_ack_timeout, nRF);
 
-	nRF->log=NULL;
-	nRF->log_tx_to_file=false;
-	nRF->avr_cycle_last_tx=0;
+	if(nRF->tx_in_progress)
+		raise_trace_irq(nRF, NRF24_ON_AIR_OUT, 0);
+
+	power_on_reset(nRF);
+
+	LOG(NRF_LOG_VERBOSE, "nRF %s: reset to power-on defaults\n", nRF->cold->name);
+
+	account_energy(nRF);
+	air_update_config(nRF);
+	air_update_state(nRF);
+	handle_pin_IRQ(nRF);
+	raise_trace_irq(nRF, NRF24_FIFO_TX_OUT, 0);
+	raise_trace_irq(nRF, NRF24_FIFO_RX_OUT, 0);
+	telemetry_publish(nRF);
+}
+
+void nRF_reset(nRF_t * const nRF)
+{
+	reset_nRF(nRF);
+	rearm_timers(nRF->avr);
+}
+
+void nRF_override_register(nRF_t * const nRF, const uint8_t reg, const uint8_t mask, const uint8_t value)
+{
+	if(reg>=30 || regs_len_bytes[reg]!=1 || reg==REG_STATUS || reg==REG_OBSERVE_TX || reg==REG_RPD || reg==REG_FIFO_STATUS)
+		errx(1, "nRF_override_register: register 0x%02x can't be overridden", reg);
+
+	nRF->cold->regs_override_mask[reg]=mask;
+	nRF->cold->regs_override_value[reg]=value&mask;
+	nRF->regs[reg]=(nRF->regs[reg]&~mask)|(value&mask);
+	air_update_config(nRF);
+}
+
+void nRF_model(nRF_t * const nRF, const bool yesno)
+{
+	if(nRF->remote)
+		errx(1, "nRF_model: nRF %s is simulated by another process", nRF->cold->name);
+
+	if(yesno==(nRF->cold->model && nRF->cold->model->active))
+		return;
+
+	behavioral_model_t * const model=model_of(nRF);
+
+	if(yesno)
+	{
+		if(!nRF->pin_CSN) //the AVR stops in the middle of an SPI-access
+			csn_nRF(nRF, 1);
+
+		model->active=true;
+
+		if(model->nb_packets)
+		{
+			model->replay=(model->nb_packets==NRF_MODEL_PACKETS)?model->head:0; //oldest
+			const avr_cycle_count_t next=model->cycle_last_payload+model->intervals[model->replay];
+			avr_cycle_timer_register(nRF->avr, (next>nRF->avr->cycle)?next-nRF->avr->cycle:1, &cb_model_tx, nRF);
+		}
+
+		if(!nRF->pin_IRQ) //not handled by the firmware yet
+			avr_cycle_timer_register(nRF->avr, US_TO_CYCLES(nRF->avr, NRF_MODEL_IRQ_LATENCY_US), &cb_model_irq, nRF);
+
+		LOG(NRF_LOG_VERBOSE, "nRF %s: behavioral model replaces the firmware, %u payloads learned\n", nRF->cold->name, model->nb_packets);
+	}
+	else
+	{
+		avr_cycle_timer_cancel(nRF->avr, &cb_model_tx, nRF);
+		avr_cycle_timer_cancel(nRF->avr, &cb_model_ce_low, nRF);
+		avr_cycle_timer_cancel(nRF->avr, &cb_model_irq, nRF);
+
+		model->active=false;
+
+		nRF->pin_CE=nRF->irq[NRF24_CE_IN].value; //as left by the firmware
+		update_nRF(nRF);
+
+		LOG(NRF_LOG_VERBOSE, "nRF %s: firmware is running again\n", nRF->cold->name);
+	}
 }
 
 void nRF_connect(nRF_t * const nRF, avr_irq_t * pin_ce_irq, avr_irq_t * pin_irq_irq)
@@ -996,18 +3195,43 @@ void nRF_connect(nRF_t * const nRF, avr_irq_t * pin_ce_irq, avr_irq_t * pin_irq_
 	avr_connect_irq(nRF->irq+NRF24_IRQ_OUT, pin_irq_irq);
 
 	avr_raise_irq(nRF->irq+NRF24_IRQ_OUT, 1);
+	avr_raise_irq(nRF->irq+NRF24_CSN_OUT, 1);
+}
+
+void nRF_connect_spi(nRF_t * const nRF, avr_irq_t * spi_out_irq, avr_irq_t * spi_in_irq, avr_irq_t * pin_csn_irq)
+{
+	nRF->spi_irq_in=spi_in_irq;
+
+	avr_irq_register_notify(spi_out_irq, &cb_spi, nRF);
+	avr_irq_register_notify(pin_csn_irq, &cb_csn, nRF);
+}
+
+void nRF_vcd_add_signals(nRF_t * const nRF, avr_vcd_t * const vcd)
+{
+	uint8_t i;
+	for(i=NRF24_IRQ_OUT; i<NRF24_IRQ_COUNT; i++)
+	{
+		char name[64];
+		snprintf(name, sizeof(name), "%s_%s", nRF->cold->name, irq_names[i]+4); //skip "nRF_"
+		avr_vcd_add_signal(vcd, nRF->irq+i, irq_bits[i], name);
+	}
 }
 
 void csn_nRF(void * nRF, uint32_t value) //SPI
 {
+	const uint64_t profile_start=profile_enter();
+
 	((nRF_t*)nRF)->pin_CSN=value;
+	raise_trace_irq((nRF_t*)nRF, NRF24_CSN_OUT, value);
 	if(((nRF_t*)nRF)->pin_CSN==1)
 		finish_spi((nRF_t*)nRF);
+
+	profile_leave(NRF_PROFILE_CSN, profile_start);
 }
 
-uint8_t spi_nRF(nRF_t * nRF, const uint8_t rx)
+static uint8_t spi_byte(nRF_t * const nRF, const uint8_t rx)
 {
-	uint8_t ret;
+	uint8_t ret=0xff;
 
 	switch(nRF->state_spi)
 	{
@@ -1019,61 +3243,78 @@ uint8_t spi_nRF(nRF_t * nRF, const uint8_t rx)
 			else if((rx&0xe0)==0) //R_REGISTER
 			{
 				uint8_t reg_to_read=rx&0x1f;
+				if(reg_to_read>=30 || regs_len_bytes[reg_to_read]==0)
+				{
+					LOG(NRF_LOG_ERROR, "ERROR: nRF %s: tried to read inexistent register 0x%02x\n", nRF->cold->name, reg_to_read);
+					nRF->state_spi=NRF_SPI_IGNORE;
+					return ret;
+				}
 				nRF->spi_reg_index=reg_to_read;
-				nRF->spi_value=nRF->regs[reg_to_read];
+				nRF->spi_value=reg_read(nRF, reg_to_read);
 				nRF->spi_nb_bytes=0;
 				nRF->spi_length_bytes=regs_len_bytes[reg_to_read];
-				if(nRF->spi_length_bytes==0)
-					LOG(NRF_LOG_ERROR, "ERROR: nRF %s: tried to read inexistent register 0x%02x\n", nRF->name, reg_to_read);
 				nRF->state_spi=NRF_SPI_READ_REGISTER;
 			}
 			else if((rx&0xe0)==0x20) //W_REGISTER
 			{
 				uint8_t reg_to_write=rx&0x1f;
+				if(reg_to_write>=30 || regs_len_bytes[reg_to_write]==0)
+				{
+					LOG(NRF_LOG_ERROR, "ERROR: nRF %s: tried to write to inexistent register 0x%02x\n", nRF->cold->name, reg_to_write);
+					nRF->state_spi=NRF_SPI_IGNORE;
+					return ret;
+				}
 				nRF->spi_reg_index=reg_to_write;
 				nRF->spi_nb_bytes=0;
 				nRF->spi_value=0;
 				nRF->spi_length_bytes=regs_len_bytes[reg_to_write];
-				if(nRF->spi_length_bytes==0)
-					LOG(NRF_LOG_ERROR, "ERROR: nRF %s: tried to write to inexistent register 0x%02x\n", nRF->name, reg_to_write);
 				nRF->state_spi=NRF_SPI_WRITE_REGISTER;
 			}
 			else if(rx==R_RX_PAYLOAD)
 			{
-				LOG(NRF_LOG_DEBUG, "nRF %s: command R_RX_PAYLOAD\n", nRF->name);
+				LOG(NRF_LOG_DEBUG, "nRF %s: command R_RX_PAYLOAD\n", nRF->cold->name);
 				if(nRF->fifo_rx_entries==0)
-					LOG(NRF_LOG_ERROR, "ERROR: nRF %s: no entries in RX fifo\n", nRF->name);
+				{
+					LOG(NRF_LOG_ERROR, "ERROR: nRF %s: no entries in RX fifo\n", nRF->cold->name);
+					nRF->state_spi=NRF_SPI_IGNORE;
+					return ret;
+				}
 				nRF->fifo_rx_readpos=0;
 				nRF->state_spi=NRF_SPI_R_RX_PAYLOAD;
 			}
 			else if(rx==W_TX_PAYLOAD)
 			{
-				LOG(NRF_LOG_DEBUG, "nRF %s: command W_TX_PAYLOAD\n", nRF->name);
-				if(nRF->fifo_tx_entries==3)
+				LOG(NRF_LOG_DEBUG, "nRF %s: command W_TX_PAYLOAD\n", nRF->cold->name);
+				if(fifo_tx_used(nRF)==3)
 				{
-					LOG(NRF_LOG_ERROR, "ERROR: nRF %s: no space in TX fifo\n", nRF->name);
+					LOG(NRF_LOG_ERROR, "ERROR: nRF %s: no space in TX fifo\n", nRF->cold->name);
+					nRF->state_spi=NRF_SPI_IGNORE;
 					return ret;
 				}
-				nRF->fifo_tx[nRF->fifo_tx_entries].regular_packet.nb_bytes_addr=(nRF->regs[REG_SETUP_AW]&(0b11<<AW))+2;
-				nRF->fifo_tx[nRF->fifo_tx_entries].regular_packet.addr=nRF->regs[REG_TX_ADDR];
-				nRF->fifo_tx[nRF->fifo_tx_entries].nb_bytes=0;
+				nRF->cold->fifo_tx[nRF->fifo_tx_entries].regular_packet.nb_bytes_addr=(nRF->regs[REG_SETUP_AW]&(0b11<<AW))+2;
+				nRF->cold->fifo_tx[nRF->fifo_tx_entries].regular_packet.addr=nRF->addr[ADDR_TX];
+				nRF->cold->fifo_tx[nRF->fifo_tx_entries].nb_bytes=0;
 				nRF->state_spi=NRF_SPI_W_TX_PAYLOAD;
 			}
 			else if(rx==FLUSH_TX)
 			{
-				LOG(NRF_LOG_DEBUG, "nRF %s: flush TX\n", nRF->name);
+				LOG(NRF_LOG_DEBUG, "nRF %s: flush TX\n", nRF->cold->name);
 				nRF->fifo_tx_entries=0;
+				flush_ack_payloads(nRF);
 				update_fifo_status(nRF);
 			}
 			else if(rx==FLUSH_RX)
 			{
-				LOG(NRF_LOG_DEBUG, "nRF %s: flush RX\n", nRF->name);
+				LOG(NRF_LOG_DEBUG, "nRF %s: flush RX\n", nRF->cold->name);
 				nRF->fifo_rx_entries=0;
 				nRF->regs[REG_STATUS]|=(0b111<<RX_P_NO); //RX FIFO empty
 				update_fifo_status(nRF);
 			}
 			else if(rx==REUSE_TX_PL)
-				errx(1, "nRF: unimplemented command: REUSE_TX_PL");
+			{
+				LOG(NRF_LOG_ERROR, "ERROR: nRF %s: unimplemented command REUSE_TX_PL\n", nRF->cold->name);
+				nRF->state_spi=NRF_SPI_IGNORE;
+			}
 			else if(rx==R_RX_PL_WID)
 			{
 				//LOG(NRF_LOG_DEBUG, "nRF %s: command R_RX_PL_WID\n", nRF->name); //if polling is used this will flood the screen...
@@ -1082,19 +3323,39 @@ uint8_t spi_nRF(nRF_t * nRF, const uint8_t rx)
 			else if((rx&0xf8)==W_ACK_PAYLOAD)
 			{
 				uint8_t pipe=rx&0x07;
-				LOG(NRF_LOG_DEBUG, "nRF %s: command W_ACK_PAYLOAD pipe %u\n", nRF->name, pipe);
-				if(nRF->fifo_tx_entries==3)
+				LOG(NRF_LOG_DEBUG, "nRF %s: command W_ACK_PAYLOAD pipe %u\n", nRF->cold->name, pipe);
+				if(pipe>5)
 				{
-					LOG(NRF_LOG_ERROR, "ERROR: nRF %s: no space for ACK in TX fifo\n", nRF->name);
+					LOG(NRF_LOG_ERROR, "ERROR: nRF %s: W_ACK_PAYLOAD for inexistent pipe %u\n", nRF->cold->name, pipe);
+					nRF->state_spi=NRF_SPI_IGNORE;
 					return ret;
 				}
-				nRF->fifo_tx[nRF->fifo_tx_entries].ack_packet.pipe=pipe;
+				if(fifo_tx_used(nRF)==3)
+				{
+					LOG(NRF_LOG_ERROR, "ERROR: nRF %s: no space for ACK in TX fifo\n", nRF->cold->name);
+					nRF->state_spi=NRF_SPI_IGNORE;
+					return ret;
+				}
+				nRF->cold->ack_payload_writing=__builtin_ctz(nRF->ack_payloads_free);
+				nRF->ack_payloads_free&=~(1<<nRF->cold->ack_payload_writing);
+				nRF->cold->ack_payloads[nRF->cold->ack_payload_writing].ack_packet.pipe=pipe;
+				nRF->cold->ack_payloads[nRF->cold->ack_payload_writing].nb_bytes=0;
 				nRF->state_spi=NRF_SPI_WRITE_ACK_PAYLOAD;
 			}
 			else if(rx==W_TX_PAYLOAD_NOACK) //TODO
-				errx(1, "nRF: unimplemented command: W_TX_PAYLOAD_NOACK");
+			{
+				LOG(NRF_LOG_ERROR, "ERROR: nRF %s: unimplemented command W_TX_PAYLOAD_NOACK\n", nRF->cold->name);
+				nRF->state_spi=NRF_SPI_IGNORE;
+			}
 			else
-				LOG(NRF_LOG_ERROR, "ERROR: nRF %s: unknown command 0x%02x\n", nRF->name, rx);
+			{
+				LOG(NRF_LOG_ERROR, "ERROR: nRF %s: unknown command 0x%02x\n", nRF->cold->name, rx);
+				nRF->state_spi=NRF_SPI_IGNORE;
+			}
+			break;
+
+		case NRF_SPI_IGNORE:
+			ret=0xff;
 			break;
 
 		case NRF_SPI_READ_REGISTER:
@@ -1102,7 +3363,7 @@ uint8_t spi_nRF(nRF_t * nRF, const uint8_t rx)
 				ret=(nRF->spi_value>>(8*nRF->spi_nb_bytes++))&0xff;
 			else
 			{
-				LOG(NRF_LOG_WARNING, "WARNING: nRF %s: tried to read more bytes than available from register 0x%02x, returning 0xff\n", nRF->name, nRF->spi_reg_index);
+				LOG(NRF_LOG_WARNING, "WARNING: nRF %s: tried to read more bytes than available from register 0x%02x, returning 0xff\n", nRF->cold->name, nRF->spi_reg_index);
 				ret=0xff;
 			}
 			break;
@@ -1112,26 +3373,26 @@ uint8_t spi_nRF(nRF_t * nRF, const uint8_t rx)
 			if(nRF->spi_nb_bytes < nRF->spi_length_bytes)
 				nRF->spi_value|=(uint64_t)rx<<(8*nRF->spi_nb_bytes++);
 			else
-				LOG(NRF_LOG_WARNING, "WARNING: nRF %s: tried to write more bytes than possible to register 0x%02x, ignoring\n", nRF->name, nRF->spi_reg_index);
+				LOG(NRF_LOG_WARNING, "WARNING: nRF %s: tried to write more bytes than possible to register 0x%02x, ignoring\n", nRF->cold->name, nRF->spi_reg_index);
 			break;
 
 		case NRF_SPI_W_TX_PAYLOAD:
 			ret=0xff;
-			if(nRF->fifo_tx[nRF->fifo_tx_entries].nb_bytes==32)
+			if(nRF->cold->fifo_tx[nRF->fifo_tx_entries].nb_bytes==32)
 			{
-				LOG(NRF_LOG_ERROR, "ERROR: nRF %s: TX fifo overflow, tried to write more than 32 bytes\n", nRF->name);
+				LOG(NRF_LOG_ERROR, "ERROR: nRF %s: TX fifo overflow, tried to write more than 32 bytes\n", nRF->cold->name);
 				return ret;
 			}
-			nRF->fifo_tx[nRF->fifo_tx_entries].data[nRF->fifo_tx[nRF->fifo_tx_entries].nb_bytes++]=rx;
+			nRF->cold->fifo_tx[nRF->fifo_tx_entries].data[nRF->cold->fifo_tx[nRF->fifo_tx_entries].nb_bytes++]=rx;
 			break;
 
 		case NRF_SPI_R_RX_PAYLOAD:
-			if(nRF->fifo_rx_readpos==nRF->fifo_rx[0].nb_bytes)
+			if(nRF->fifo_rx_readpos==nRF->cold->fifo_rx[0].nb_bytes)
 			{
-				LOG(NRF_LOG_ERROR, "ERROR: nRF %s: no more bytes in RX fifo\n", nRF->name);
+				LOG(NRF_LOG_ERROR, "ERROR: nRF %s: no more bytes in RX fifo\n", nRF->cold->name);
 				return 0xff;
 			}
-			ret=nRF->fifo_rx[0].data[nRF->fifo_rx_readpos++];
+			ret=nRF->cold->fifo_rx[0].data[nRF->fifo_rx_readpos++];
 			break;
 
 		case NRF_SPI_READ_LENGTH_PAYLOAD:
@@ -1139,36 +3400,126 @@ uint8_t spi_nRF(nRF_t * nRF, const uint8_t rx)
 				ret=0;
 			else
 			{
-				LOG(NRF_LOG_DEBUG, "nRF %s: payload %u bytes\n", nRF->name, nRF->fifo_rx[0].nb_bytes);
-				ret=nRF->fifo_rx[0].nb_bytes;
+				LOG(NRF_LOG_DEBUG, "nRF %s: payload %u bytes\n", nRF->cold->name, nRF->cold->fifo_rx[0].nb_bytes);
+				ret=nRF->cold->fifo_rx[0].nb_bytes;
 			}
 			break;
 
 		case NRF_SPI_WRITE_ACK_PAYLOAD:
+		{
 			ret=0xff;
-			if(nRF->fifo_tx[nRF->fifo_tx_entries].nb_bytes==32)
+			packet_tx_t * const ack_payload=&nRF->cold->ack_payloads[nRF->cold->ack_payload_writing];
+			if(ack_payload->nb_bytes==32)
 			{
-				LOG(NRF_LOG_ERROR, "ERROR: nRF %s: fifo ACK payload overflow, tried to write more than 32 bytes\n", nRF->name);
+				LOG(NRF_LOG_ERROR, "ERROR: nRF %s: fifo ACK payload overflow, tried to write more than 32 bytes\n", nRF->cold->name);
 				return ret;
 			}
-			nRF->fifo_tx[nRF->fifo_tx_entries].data[nRF->fifo_tx[nRF->fifo_tx_entries].nb_bytes++]=rx;
-			LOG(NRF_LOG_DEBUG, "nRF %s: SPI_WRITE_ACK_PAYLOAD %u bytes written, last was 0x%02x\n", nRF->name, nRF->fifo_tx[nRF->fifo_tx_entries].nb_bytes, rx);
+			ack_payload->data[ack_payload->nb_bytes++]=rx;
+			LOG(NRF_LOG_DEBUG, "nRF %s: SPI_WRITE_ACK_PAYLOAD %u bytes written, last was 0x%02x\n", nRF->cold->name, ack_payload->nb_bytes, rx);
 			break;
+		}
 	}
 
 	return ret;
 }
 
+uint8_t spi_nRF(nRF_t * nRF, const uint8_t rx)
+{
+	const uint64_t profile_start=profile_enter();
+
+	const uint8_t ret=spi_byte(nRF, rx);
+
+	profile_leave(NRF_PROFILE_SPI, profile_start);
+
+	return ret;
+}
+
 void nRF_cleanup(void)
 {
 	printf("nRF: simulated loss of %u packets and %u ACK-packets\n", lost.nb_lost_packets, lost.nb_lost_acks);
 	printf("nRF: %u packets and %u ACK-packets successfully transmitted\n", stats.nb_packets, stats.nb_acks);
+	if(bit_errors.corrupt_frames)
+		printf("nRF: simulated %u corrupted frames, %u dropped because of CRC mismatch\n", bit_errors.nb_corrupted_frames, bit_errors.nb_dropped_frames);
+	if(nb_faults)
+		printf("nRF: %u faults injected, %u packets and %u ACK-packets lost to them\n", nb_faults, nb_fault_lost_packets, nb_fault_lost_acks);
+
+	if(profile)
+		profile_report();
+
+	uint16_t i;
+
+	if(trace)
+	{
+		for(i=0; i<nb_modules; i++)
+			trace_state(modules[i], modules[i]->state);
+		fprintf(trace, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,\"args\":{\"name\":\"simavr-nRF24\"}}\n]\n");
+		fclose(trace);
+		trace=NULL;
+	}
 
-	uint8_t i;
 	for(i=0; i<nb_modules; i++)
 	{
-		if(modules[i]->log)
-			fclose(modules[i]->log);
+		printf("nRF %s: %u packets sent (%u retransmissions, %u MAX_RT), %u received, %u ACK-packets sent, %u received\n", modules[i]->cold->name, modules[i]->cold->stats.nb_packets_sent, modules[i]->cold->stats.nb_retransmissions, modules[i]->cold->stats.nb_max_rt, modules[i]->cold->stats.nb_packets_received, modules[i]->cold->stats.nb_acks_sent, modules[i]->cold->stats.nb_acks_received);
+
+		if(advisor)
+			advisor_report(modules[i]);
+
+		behavioral_model_t const * const model=modules[i]->cold->model;
+		if(model && (model->nb_sent || model->nb_drained))
+			printf("nRF %s: behavioral model sent %u payloads, read %u received payloads, dropped %u payloads after MAX_RT\n", modules[i]->cold->name, model->nb_sent, model->nb_drained, model->nb_flushed);
+
+		nRF_energy_t energy;
+		nRF_get_energy(modules[i], &energy);
+		printf("nRF %s: %.3fµC / %.3fµJ consumed at %.2fV, average current %.1fµA\n", modules[i]->cold->name, energy.charge_uC, energy.energy_uJ, supply_voltage, energy.average_current_uA);
+		printf("nRF %s: power down %.3fms, standby-I %.3fms, standby-II %.3fms, RX %.3fms, TX %.3fms, settling %.3fms\n", modules[i]->cold->name, energy.residency_ms[NRF_POWER_DOWN], energy.residency_ms[NRF_STANDBY1], energy.residency_ms[NRF_STANDBY2], \
+				energy.residency_ms[NRF_RX_MODE]+energy.residency_ms[NRF_RX_MODE_FOR_ACK], energy.residency_ms[NRF_TX_MODE]+energy.residency_ms[NRF_TX_MODE_FOR_ACK], \
+				energy.residency_ms[NRF_START_UP]+energy.residency_ms[NRF_RX_SETTLING]+energy.residency_ms[NRF_RX_SETTLING_FOR_ACK]+energy.residency_ms[NRF_TX_SETTLING]+energy.residency_ms[NRF_TX_SETTLING_FOR_ACK]);
+
+		if(modules[i]->cold->log)
+			fclose(modules[i]->cold->log);
+		if(modules[i]->cold->capture)
+			fclose(modules[i]->cold->capture);
+		free(modules[i]->cold->advisor);
+		free(modules[i]->cold->model);
+		free(modules[i]->cold);
 		free(modules[i]);
 	}
+
+	if(medium)
+	{
+		printf("nRF: %u packets and ACK-packets from other processes arrived late\n", medium_nb_late);
+
+		__atomic_store_n(&medium->time_ns[medium_process], UINT64_MAX, __ATOMIC_RELEASE); //don't hold back the other processes
+
+		uint8_t process;
+		for(process=0; process<NRF_MEDIUM_PROCESSES_MAX; process++)
+		{
+			for(i=0; i<NB_NRF_MAX; i++)
+			{
+				if(medium_proxies[process][i])
+					free(medium_proxies[process][i]->cold);
+				free(medium_proxies[process][i]);
+				medium_proxies[process][i]=NULL;
+			}
+		}
+
+		munmap(medium, sizeof(medium_shm_t));
+		medium=NULL;
+	}
+
+	if(telemetry)
+	{
+		munmap(telemetry, sizeof(nRF_telemetry_t)); //the file is kept for post-mortem inspection
+		telemetry=NULL;
+	}
+
+	free(faults);
+	free(faults_active);
+	free(fault_edges);
+	faults=NULL;
+	faults_active=NULL;
+	fault_edges=NULL;
+	sz_faults=0;
+	link_map_free(&fault_link_lost);
+	link_map_free(&path_loss_dB);
 }
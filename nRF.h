@@ -5,6 +5,7 @@
 
 #include "sim_avr.h"
 #include "sim_irq.h"
+#include "sim_vcd_file.h"
 
 #include "nRF_internals.h"
 #include "nRF_config.h"
@@ -27,14 +28,49 @@ typedef enum
 	NRF_LOG_DEBUG
 } nRF_log_level_t;
 
+typedef struct
+{
+	uint64_t residency_cycles[NRF_NB_STATES]; //time spent in each state_nRF_t, in cycles of the AVR the nRF is connected to
+	double residency_ms[NRF_NB_STATES];
+	double charge_uC;
+	double energy_uJ;
+	double average_current_uA;
+} nRF_energy_t;
+
 void nRF_global_init(void);
 void nRF_stop_on_error(const bool yesno);
 void nRF_log_to_file(nRF_t * const nRF, char const * const filename);
 void nRF_set_log_level(const nRF_log_level_t level);
 void nRF_set_lost_packets(const uint32_t lost_packets, const uint32_t lost_acks);
+void nRF_capture_frames(nRF_t * const nRF, char const * const filename);
+void nRF_set_bit_errors(const uint32_t corrupted_frames);
+void nRF_fault_channel(const uint8_t channel, const uint32_t from_ms, const uint32_t to_ms, const uint32_t lost_packets);
+void nRF_fault_link(nRF_t * const from, nRF_t const * const to, const uint32_t from_ms, const uint32_t to_ms, const uint32_t lost_packets);
+void nRF_fault_brownout(nRF_t * const nRF, const uint32_t from_ms, const uint32_t to_ms);
+void nRF_set_path_loss(nRF_t const * const nRF1, nRF_t const * const nRF2, const uint8_t loss_dB);
+void nRF_telemetry(char const * const filename);
+void nRF_medium_join(char const * const filename, const uint8_t process, const uint8_t nb_processes);
+void nRF_medium_sync(void);
+void nRF_register_event_callback(const nRF_event_t event, nRF_event_cb_t cb, void * param);
+void nRF_trace(char const * const filename);
+void nRF_retransmit_advisor(const bool yesno);
+void nRF_profile(const bool yesno);
+void nRF_until_delivered(nRF_t const * const from, nRF_t const * const to, const uint32_t nb_packets, const int result);
+void nRF_until_max_rt(nRF_t const * const nRF, const int result);
+void nRF_until_register(nRF_t const * const nRF, const uint8_t reg, const uint8_t mask, const uint8_t value, const int result);
+void nRF_until_time(const uint32_t ms, const int result);
+void nRF_until_stuck(nRF_t const * const nRF, const state_nRF_t state, const uint32_t ms, const int result);
+bool nRF_done(int * const result);
+void nRF_set_supply_voltage(const double voltage);
+void nRF_get_energy(nRF_t * const nRF, nRF_energy_t * const energy);
 nRF_t * make_new_nRF(void);
 void nRF_init(struct avr_t * avr, nRF_t * const nRF, char const * const name);
+void nRF_reset(nRF_t * const nRF);
+void nRF_override_register(nRF_t * const nRF, const uint8_t reg, const uint8_t mask, const uint8_t value);
+void nRF_model(nRF_t * const nRF, const bool yesno);
 void nRF_connect(nRF_t * const nRF, avr_irq_t * pin_ce_irq, avr_irq_t * pin_irq_irq);
+void nRF_connect_spi(nRF_t * const nRF, avr_irq_t * spi_out_irq, avr_irq_t * spi_in_irq, avr_irq_t * pin_csn_irq);
+void nRF_vcd_add_signals(nRF_t * const nRF, avr_vcd_t * const vcd);
 void csn_nRF(void * nRF, uint32_t value);
 uint8_t spi_nRF(nRF_t * nRF, const uint8_t rx);
 void nRF_cleanup(void);
@@ -17,4 +17,28 @@ version 10.05.22 19:52
 //maximum length of the name of each nRF
 #define NRF_SZ_NAME 20
 
+//maximum number of callbacks for each event, see nRF_register_event_callback()
+#define NRF_EVENT_CALLBACKS_MAX 4
+
+//acceptable ratio of packets lost after ARC retransmissions, used by nRF_retransmit_advisor() to recommend ARC
+#define NRF_ADVISOR_RESIDUAL_LOSS 1E-3
+
+//maximum number of conditions ending the simulation, see nRF_until_delivered() and the like
+#define NRF_UNTIL_MAX 16
+
+//number of payloads (and the time between them) remembered for the behavioral model, see nRF_model()
+#define NRF_MODEL_PACKETS 8
+
+//time the behavioral model needs to react to the IRQ-pin, like the interrupt handler of a firmware
+#define NRF_MODEL_IRQ_LATENCY_US 20
+
+//attenuation between two nRF unless set with nRF_set_path_loss(), with the default of 60dB RPD only sees a sender at 0dBm
+#define NRF_PATH_LOSS_DB 60
+
+//maximum number of processes sharing a distributed RF medium, see nRF_medium_join()
+#define NRF_MEDIUM_PROCESSES_MAX 4
+
+//number of packets in flight between two processes of the distributed RF medium
+#define NRF_MEDIUM_SZ_RING 64
+
 #endif
@@ -23,6 +23,17 @@ version 10.05.22 19:49
 #define MS_TO_CYCLES(avr, ms) (avr_cycle_count_t)(((ms)*1E-3)/(1.0/avr->frequency))
 #define US_TO_CYCLES(avr, us) (avr_cycle_count_t)(((us)*1E-6)/(1.0/avr->frequency))
 #define CYCLES_TO_MS_FLOAT(avr, cycles) ((cycles)*(1.0/avr->frequency)*1E3)
+#define CYCLES_TO_NS(avr, cycles) (uint64_t)((cycles)*(1.0/avr->frequency)*1E9)
+#define NS_TO_CYCLES(avr, ns) (avr_cycle_count_t)(((ns)*1E-9)/(1.0/avr->frequency))
+
+//shortest possible frame (3 bytes address, no payload, 1 byte CRC) at 2Mbps is 24.5µs on air, a packet can never be received earlier than this after it started
+#define NRF_MEDIUM_LOOKAHEAD_NS 24000
+
+//received power detector, datasheet section 6.4
+#define NRF_RPD_THRESHOLD_DBM -64
+
+//preamble (1) + address (max 5) + PCF (9 bits) + payload (max 32) + CRC (max 2) = 329 bits
+#define NRF_SZ_FRAME 42
 
 typedef enum
 {
@@ -40,6 +51,8 @@ typedef enum
 	NRF_TX_MODE_FOR_ACK //11
 } state_nRF_t;
 
+#define NRF_NB_STATES (NRF_TX_MODE_FOR_ACK+1)
+
 typedef enum
 {
 	NRF_SPI_IDLE,
@@ -48,7 +61,8 @@ typedef enum
 	NRF_SPI_W_TX_PAYLOAD,
 	NRF_SPI_R_RX_PAYLOAD,
 	NRF_SPI_READ_LENGTH_PAYLOAD,
-	NRF_SPI_WRITE_ACK_PAYLOAD
+	NRF_SPI_WRITE_ACK_PAYLOAD,
+	NRF_SPI_IGNORE //invalid command, the remaining bytes until CSN goes high are not commands
 } state_spi_nRF_t;
 
 typedef struct
@@ -80,15 +94,113 @@ typedef struct
 	uint8_t data[32];
 } packet_rx_t;
 
+typedef struct
+{
+	uint32_t nb_packets_sent; //including retransmissions
+	uint32_t nb_packets_received;
+	uint32_t nb_acks_sent;
+	uint32_t nb_acks_received;
+	uint32_t nb_retransmissions;
+	uint32_t nb_max_rt;
+} module_stats_t;
+
+typedef struct
+{
+	avr_cycle_count_t cycle_tx_end; //end of the last regular packet, the ARD window starts here
+	uint32_t nb_attempts;
+	uint64_t airtime_us; //sum over all attempts
+	uint64_t payload_bytes; //sum over all attempts
+	uint32_t nb_acks; //ACKs that reached the PTX, late or not
+	uint32_t nb_acks_late; //ACKs that ended after ARD or while the PTX was not listening
+	uint32_t ack_delay_max_us; //from end of packet to end of ACK
+	int32_t margin_min_us; //ARD minus ACK delay
+	uint8_t ard_max; //largest ARD (register value) seen
+	uint8_t ack_payload_max;
+	uint32_t retries[16]; //retries needed for acknowledged packets
+	char peer[NRF_SZ_NAME];
+} retransmit_advisor_t;
+
+typedef struct
+{
+	packet_tx_t packets[NRF_MODEL_PACKETS]; //last payloads written by the firmware, ring buffer
+	avr_cycle_count_t intervals[NRF_MODEL_PACKETS]; //cycles since the payload before
+	uint8_t nb_packets;
+	uint8_t head; //next entry written while learning
+	uint8_t replay; //next entry sent by the model
+	avr_cycle_count_t cycle_last_payload;
+	bool active; //the AVR is not running, the model drives the nRF, see nRF_model()
+	uint32_t nb_sent; //payloads put into the TX fifo by the model
+	uint32_t nb_drained; //payloads taken out of the RX fifo by the model
+	uint32_t nb_flushed; //payloads dropped by the model after MAX_RT
+} behavioral_model_t;
+
+//index in nRF_t.addr[] of the only registers wider than 8 bits
+#define ADDR_RX_P0 0
+#define ADDR_RX_P1 1
+#define ADDR_TX 2
+
 struct nRF_struct;
 
+typedef struct
+{
+	char name[NRF_SZ_NAME];
+
+	uint8_t regs_override_mask[30]; //bits forced by the simulation whatever the firmware writes, see nRF_override_register()
+	uint8_t regs_override_value[30];
+
+	packet_tx_t fifo_tx[3];
+
+	//ACK-payloads (PRX), stored in slots and queued per pipe, the number of used slots is in nRF_t
+	packet_tx_t ack_payloads[3];
+	uint8_t ack_payload_writing; //slot being written by W_ACK_PAYLOAD
+	uint8_t ack_queue[6][3]; //slots, per pipe
+	uint8_t ack_queue_head[6];
+	uint8_t ack_queue_len[6];
+
+	packet_rx_t fifo_rx[3];
+
+	packet_tx_t packet_being_sent;
+	packet_rx_t last_rx;
+
+	FILE *log;
+	bool log_tx_to_file;
+	avr_cycle_count_t avr_cycle_last_tx;
+
+	bool frame_synthesis; //build the on-air bitstream for every packet sent
+	uint8_t frame[NRF_SZ_FRAME]; //MSB first, as transmitted
+	uint16_t frame_nb_bits;
+	uint8_t frame_bytes_crc;
+	FILE *capture;
+
+	module_stats_t stats;
+	retransmit_advisor_t * advisor; //NULL until the advisor records something for this nRF, see nRF_retransmit_advisor()
+	behavioral_model_t * model; //NULL until the firmware writes a payload or nRF_model() is called
+	avr_cycle_count_t model_cycle_init; //nRF_init(), the first interval learned by the model starts here
+
+	state_nRF_t energy_state; //state since energy_cycle_last
+	avr_cycle_count_t energy_cycle_last;
+	double energy_current_uA; //of energy_state with the register settings at energy_cycle_last
+	uint64_t residency_cycles[NRF_NB_STATES];
+	double charge_uC;
+
+	avr_cycle_count_t profile_cycle_start; //for the simulated time per wall clock time of the self-profiler
+	uint64_t trace_flow; //packet (PTX) or acknowledged packet (PRX) for flow arrows in the trace, 0 if none
+} nRF_cold_t; //everything not needed to decide who receives a packet or to run the state machine, allocated separately by make_new_nRF()
+
 typedef struct nRF_struct
 {
 	struct avr_t * avr;
 
 	avr_irq_t *	irq;
+	avr_irq_t * spi_irq_in; //SPI input of the AVR for replies, only used with nRF_connect_spi()
 
-	char name[NRF_SZ_NAME];
+	nRF_cold_t * cold;
+
+	uint16_t index; //in modules[]
+
+	bool remote; //proxy for a nRF simulated by another process sharing the RF medium
+	uint8_t remote_process;
+	uint16_t remote_index;
 
 	state_nRF_t state;
 	state_nRF_t state_next;
@@ -106,10 +218,14 @@ typedef struct nRF_struct
 	bool pin_CSN;
 	bool pin_IRQ;
 
-	uint64_t regs[30]; //some regs are 40 bits wide, so make everything 64 bits for simplicity for now...
+	uint8_t regs[30]; //the 40 bits wide address registers are stored in addr[], see reg_read() and reg_write()
+	uint64_t addr[3]; //RX_ADDR_P0, RX_ADDR_P1, TX_ADDR
 
-	packet_tx_t fifo_tx[3];
-	uint8_t fifo_tx_entries;
+	uint8_t fifo_tx_entries; //regular packets only, the hardware TX fifo is shared with the ACK-payloads
+	uint8_t ack_payloads_entries;
+	uint8_t ack_payloads_free; //bitmask of free slots
+	uint8_t fifo_rx_entries;
+	uint8_t fifo_rx_readpos;
 
 	bool tx_in_progress;
 	bool tx_finished;
@@ -123,20 +239,90 @@ typedef struct nRF_struct
 	struct nRF_struct * rx_send_ack_to;
 	struct nRF_struct * tx_receive_ack_from;
 
-	packet_rx_t fifo_rx[3];
-	uint8_t fifo_rx_entries;
-	uint8_t fifo_rx_readpos;
+	bool packet_being_sent_valid; //cold->packet_being_sent contains an actual packet
+	bool last_rx_valid; //cold->last_rx contains an actual packet
 
-	packet_tx_t packet_being_sent;
-	bool packet_being_sent_valid; //contains an actual packet
+	avr_cycle_count_t cycle_state_entered;
+	uint8_t brownout; //number of brownouts in progress, see nRF_fault_brownout()
+} nRF_t;
 
-	packet_rx_t last_rx;
-	bool last_rx_valid; //contains an actual packet
+typedef enum
+{
+	NRF_EVENT_TX_START=0, //nRF: PTX, packet: packet on air
+	NRF_EVENT_TX_END, //nRF: PTX, packet: packet on air
+	NRF_EVENT_RX_DELIVERED, //nRF: PRX, peer: PTX, packet: packet put into RX fifo of PRX
+	NRF_EVENT_ACK_SENT, //nRF: PRX, peer: PTX, packet: ACK-packet on air
+	NRF_EVENT_ACK_RECEIVED, //nRF: PTX, peer: PRX, packet: ACK-packet
+	NRF_EVENT_PACKET_LOST, //nRF: sender (PRX for an ACK-packet), peer: receiver if known, packet: lost packet or ACK-packet
+	NRF_EVENT_DUPLICATE_DROPPED, //nRF: PRX, peer: PTX, packet: dropped packet
+	NRF_EVENT_MAX_RT, //nRF: PTX, packet: packet in TX fifo that was never acknowledged
 
-	FILE *log;
-	bool log_tx_to_file;
-	avr_cycle_count_t avr_cycle_last_tx;
-} nRF_t;
+	NRF_NB_EVENTS
+} nRF_event_t;
+
+typedef void (*nRF_event_cb_t)(const nRF_event_t event, nRF_t const * const nRF, nRF_t const * const peer, packet_tx_t const * const packet, void * param);
+
+typedef struct
+{
+	nRF_event_cb_t cb;
+	void * param;
+} event_callback_t;
+
+typedef enum
+{
+	NRF_PROFILE_SPI=0, //spi_nRF()
+	NRF_PROFILE_CSN, //csn_nRF()
+	NRF_PROFILE_FINISH_SPI,
+	NRF_PROFILE_UPDATE_NRF,
+	NRF_PROFILE_DISPATCH, //dispatch_sent_packet()
+	NRF_PROFILE_CB_CE,
+	NRF_PROFILE_CB_TX_FINISHED,
+	NRF_PROFILE_CB_RX_ACK_TIMEOUT,
+	NRF_PROFILE_CB_ARD_ELAPSED,
+	NRF_PROFILE_CB_DELAY_TIMER,
+	NRF_PROFILE_CB_MEDIUM_DELIVER,
+	NRF_PROFILE_LOG, //printf() of LOG()
+
+	NRF_NB_PROFILE_POINTS
+} profile_point_t;
+
+//histogram of the host time per call: 4 buckets per power of two, see profile_bucket()
+#define NRF_PROFILE_NB_BUCKETS 256
+
+//nested calls (update_nRF() inside finish_spi() inside spi_nRF(), ...) deeper than this are counted but their time is not subtracted from the caller
+#define NRF_PROFILE_DEPTH_MAX 16
+
+typedef struct
+{
+	uint64_t nb_calls;
+	uint64_t total_ns; //including nested profiled calls
+	uint64_t self_ns; //without nested profiled calls
+	uint32_t histogram[NRF_PROFILE_NB_BUCKETS];
+} profile_stats_t;
+
+typedef enum
+{
+	NRF_UNTIL_DELIVERED,
+	NRF_UNTIL_MAX_RT,
+	NRF_UNTIL_REGISTER,
+	NRF_UNTIL_TIME,
+	NRF_UNTIL_STUCK
+} until_type_t;
+
+typedef struct
+{
+	until_type_t type;
+	nRF_t const * nRF; //NULL: any
+	nRF_t const * peer; //DELIVERED: PTX, NULL: any
+	uint32_t nb_packets; //DELIVERED: target
+	uint32_t count; //DELIVERED: so far
+	uint8_t reg;
+	uint8_t mask;
+	uint8_t value;
+	state_nRF_t state; //STUCK, NRF_NB_STATES: any
+	uint32_t ms; //TIME and STUCK
+	int result;
+} until_t;
 
 typedef struct
 {
@@ -150,10 +336,98 @@ typedef struct
 } config_lost_packets_t;
 
 
+typedef struct
+{
+	bool corrupt_frames;
+	uint32_t divider_frames;
+	uint32_t nb_corrupted_frames;
+	uint32_t nb_dropped_frames;
+} config_bit_errors_t;
+
 typedef struct
 {
 	uint32_t nb_packets;
 	uint32_t nb_acks;
 } packets_stats_t;
 
+typedef enum
+{
+	NRF_FAULT_CHANNEL,
+	NRF_FAULT_LINK,
+	NRF_FAULT_BROWNOUT
+} fault_type_t;
+
+typedef struct
+{
+	fault_type_t type;
+	uint8_t channel; //CHANNEL
+	nRF_t * nRF; //LINK: sender of the packets, BROWNOUT
+	nRF_t const * peer; //LINK: receiver of the packets
+	uint32_t lost; //CHANNEL and LINK: 1 out of N lost, 1: everything
+	bool active;
+} fault_t;
+
+typedef struct
+{
+	avr_cycle_count_t cycle; //of the first AVR
+	uint32_t fault; //index in the faults
+	bool start; //else end
+} fault_edge_t;
+
+typedef struct
+{
+	uint32_t key; //sender and receiver, 0: free
+	uint32_t value;
+} link_entry_t;
+
+typedef struct
+{
+	link_entry_t * entries; //open addressing, size is a power of 2
+	uint32_t size;
+	uint32_t nb_entries;
+} link_map_t; //a value for some links (sender, receiver) between nRF, only those set are stored
+
+typedef enum
+{
+	NRF_MEDIUM_MSG_PACKET,
+	NRF_MEDIUM_MSG_ACK
+} medium_msg_type_t;
+
+typedef struct
+{
+	uint8_t type; //medium_msg_type_t
+	uint8_t process; //of the sender
+	uint16_t module; //index of the sender in modules[] of its process
+	uint16_t module_dest; //ACK only: index of the PTX in modules[] of the destination process
+	char name[NRF_SZ_NAME];
+	uint8_t reg_config;
+	uint8_t reg_rf_ch;
+	uint8_t reg_rf_setup;
+	bool crc_ok;
+	uint64_t time_start_ns;
+	uint64_t time_end_ns;
+	packet_tx_t packet;
+} medium_msg_t;
+
+typedef struct
+{
+	uint32_t head; //written by sender only
+	uint32_t tail; //written by receiver only
+	medium_msg_t msgs[NRF_MEDIUM_SZ_RING];
+} medium_ring_t;
+
+typedef struct
+{
+	uint8_t joined[NRF_MEDIUM_PROCESSES_MAX]; //set by each process > 0 until process 0 has cleared the file and answers with welcome
+	uint8_t welcome[NRF_MEDIUM_PROCESSES_MAX];
+	uint64_t time_ns[NRF_MEDIUM_PROCESSES_MAX]; //simulated time each process has reached
+	medium_ring_t rings[NRF_MEDIUM_PROCESSES_MAX][NRF_MEDIUM_PROCESSES_MAX]; //[from][to]
+} medium_shm_t;
+
+typedef struct
+{
+	bool used;
+	medium_msg_t msg;
+} medium_pending_t;
+
 #endif
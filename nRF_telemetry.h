@@ -0,0 +1,89 @@
+#ifndef __NRF_TELEMETRY_H__
+#define __NRF_TELEMETRY_H__
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "nRF_config.h"
+
+/*
+layout of the shared-memory telemetry segment of simavr-nRF24
+
+This header has no dependencies on simavr so external monitoring tools can include it directly.
+
+Every slot is protected by a sequence counter (seqlock): the simulator increments it before and after writing the slot, so it is odd while an update is in progress. Readers never block the simulation, they simply retry if the counter was odd or changed while copying.
+
+(c) 2022 by kittennbfive
+
+AGPLv3+ and NO WARRANTY!
+
+version 11.05.22 00:54
+*/
+
+#define NRF_TELEMETRY_MAGIC 0x5446526e //"nRFT"
+#define NRF_TELEMETRY_VERSION 1
+
+typedef struct
+{
+	uint32_t seq; //odd while the slot is being written
+
+	char name[NRF_SZ_NAME];
+
+	uint8_t state; //state_nRF_t, see nRF_internals.h
+	uint8_t pin_CE;
+	uint8_t pin_IRQ;
+	uint8_t reg_status;
+	uint8_t fifo_tx_entries;
+	uint8_t fifo_rx_entries;
+	uint8_t nb_retries;
+	uint8_t padding;
+
+	double time_ms; //simulated time of the AVR this nRF is connected to
+
+	uint32_t nb_packets_sent; //including retransmissions
+	uint32_t nb_packets_received;
+	uint32_t nb_acks_sent;
+	uint32_t nb_acks_received;
+	uint32_t nb_retransmissions;
+	uint32_t nb_max_rt;
+
+	double last_tx_time_ms;
+	uint8_t last_tx_is_ack;
+	uint8_t last_tx_PID;
+	uint8_t last_tx_nb_bytes;
+
+	uint8_t last_rx_valid;
+	uint8_t last_rx_PID;
+	uint8_t last_rx_pipe;
+	uint8_t last_rx_nb_bytes;
+	uint8_t padding2;
+} nRF_telemetry_slot_t;
+
+typedef struct
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t sz_slot; //sizeof(nRF_telemetry_slot_t), for readers not written in C
+	uint32_t nb_modules;
+	nRF_telemetry_slot_t slots[NB_NRF_MAX];
+} nRF_telemetry_t;
+
+//consistent snapshot of one slot for readers, returns false if the slot has never been written
+static inline bool nRF_telemetry_read_slot(nRF_telemetry_t const * const telemetry, const uint32_t index, nRF_telemetry_slot_t * const slot)
+{
+	uint32_t seq_before, seq_after=0;
+
+	do
+	{
+		seq_before=__atomic_load_n(&telemetry->slots[index].seq, __ATOMIC_ACQUIRE);
+		if(seq_before&1)
+			continue;
+		memcpy(slot, &telemetry->slots[index], sizeof(nRF_telemetry_slot_t));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		seq_after=__atomic_load_n(&telemetry->slots[index].seq, __ATOMIC_RELAXED);
+	} while((seq_before&1) || seq_before!=seq_after);
+
+	return seq_before!=0;
+}
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef __HOST_PROTOCOL_H__
+#define __HOST_PROTOCOL_H__
+#include <stdint.h>
+
+/*
+protocol between the scenario loader and host software driving a simulated nRF24L01+ through a Unix-domain socket (node type "host"), see README
+
+Every message is a header followed by header.length bytes of data. The host software sends a request and waits for the reply, which has the same type. Integers are in the byte order of the host, the socket is local anyway.
+
+Simulated time only advances during HOST_MSG_WAIT and HOST_MSG_WAIT_IRQ, everything else happens at once.
+
+(c) 2022 by kittennbfive
+
+AGPLv3+ and NO WARRANTY!
+*/
+
+#define HOST_MSG_SPI 0x01 //request: bytes on MOSI, CSN is low during the whole transaction; reply: bytes on MISO
+#define HOST_MSG_CE 0x02 //request: uint8_t level; reply: nothing
+#define HOST_MSG_IRQ 0x03 //request: nothing; reply: uint8_t level of the IRQ-pin (active low)
+#define HOST_MSG_WAIT 0x04 //request: uint32_t µs; reply: uint64_t simulated time in ns
+#define HOST_MSG_WAIT_IRQ 0x05 //request: uint32_t timeout in µs; reply: uint8_t level of the IRQ-pin, then uint64_t simulated time in ns - returns as soon as IRQ is low
+
+typedef struct
+{
+	uint8_t type;
+	uint8_t length;
+} host_msg_header_t;
+
+#endif
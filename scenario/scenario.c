@@ -0,0 +1,1719 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <err.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_time.h"
+#include "sim_cycle_timers.h"
+#include "avr_spi.h"
+#include "avr_ioport.h"
+
+#include "nRF.h"
+#include "nRF_defs.h"
+
+#include "host_protocol.h"
+
+/*
+This builds and runs a whole network of AVR and nRF24L01+ described in a scenario file instead of wiring every node by hand like in /example.
+
+Nodes running the same firmware share a single parsed ELF image, each AVR only gets its own copy of the flash.
+
+Please read the fine manual.
+
+(c) 2022 by kittennbfive
+
+AGPLv3+ and NO WARRANTY!
+*/
+
+#define SZ_FILENAME 128
+#define SZ_MCU 20
+#define NB_FIRMWARES_MAX 16
+
+#define PACING_INTERVAL_NS 100000 //with realtime the wall clock is checked every 100µs of simulated time
+
+#define WATCH_INTERVAL_NS 1000000 //with watch_firmware the wall clock is checked every 1ms of simulated time...
+#define WATCH_PERIOD_NS 1000000000ULL //...and the firmwares every second of wall clock time
+
+#define NB_UNTILS_MAX NRF_UNTIL_MAX
+
+#define NB_SWITCHES_MAX 64 //changes between AVR and behavioral model
+#define TIMER_STEP_US 10 //a node whose AVR is not run (behavioral model or host) advances at most this much at once, so it stays close to the others
+
+#define HOST_MCU "atmega328p" //the AVR of a host node is never run, only its cycle timers are used by the nRF
+#define HOST_FREQUENCY 16000000
+#define HOST_PIN_CE 0
+#define HOST_PIN_IRQ 1
+
+#define NB_CHECKPOINTS_MAX 64
+#define SZ_JOURNAL 4096 //RF events kept for time travel
+#define NB_OUTPUTS_MAX 64 //output files rewound when a checkpoint wakes up
+
+typedef struct
+{
+	char port;
+	uint8_t pin;
+} pin_t;
+
+typedef struct
+{
+	char name[NRF_SZ_NAME];
+	char mcu[SZ_MCU];
+	uint32_t frequency;
+	char firmware[SZ_FILENAME];
+	pin_t ce;
+	pin_t csn;
+	pin_t irq;
+	int16_t channel; //-1: keep what the firmware writes
+
+	avr_t * avr;
+	nRF_t * nRF;
+	bool model; //the AVR is not run, see nRF_model()
+
+	//host nodes only: the nRF is driven by host software through a Unix-domain socket, see host_protocol.h
+	bool host;
+	char socket[SZ_FILENAME];
+	avr_irq_t * host_pins; //CE and IRQ
+	int fd_listen;
+	int fd; //-1 until the host software has connected
+	bool host_waiting; //for simulated time, see HOST_MSG_WAIT
+	bool host_wait_irq; //the wait ends early when IRQ goes low
+	uint64_t host_until_ns;
+
+	//realtime only, how far this AVR was behind the wall clock
+	double lag_max_ms;
+	double lag_max_at_ms; //simulated time
+	state_nRF_t lag_max_state;
+	double lag_sum_ms;
+	uint64_t nb_lag_checks;
+	uint64_t nb_lag_checks_behind;
+} node_t;
+
+typedef struct
+{
+	char filename[SZ_FILENAME];
+	elf_firmware_t * firmware;
+	struct timespec mtime; //when it was read
+} firmware_cache_t;
+
+typedef struct
+{
+	until_type_t type;
+	char node[NRF_SZ_NAME]; //empty: any
+	char peer[NRF_SZ_NAME]; //DELIVERED: PTX, empty: any
+	uint32_t value; //DELIVERED: packets, TIME and STUCK: ms, REGISTER: register
+	uint8_t mask;
+	uint8_t reg_value;
+	state_nRF_t state;
+	int result;
+} until_spec_t;
+
+typedef struct
+{
+	uint64_t at_ns;
+	char node[NRF_SZ_NAME]; //empty: all
+	bool model; //else back to the AVR
+	uint8_t line; //order of the lines for switches at the same time
+} switch_t;
+
+typedef struct
+{
+	fault_type_t type;
+	uint8_t channel; //CHANNEL
+	char node[NRF_SZ_NAME]; //LINK: sender, BROWNOUT
+	char peer[NRF_SZ_NAME]; //LINK: receiver
+	uint32_t from_ms;
+	uint32_t to_ms;
+	uint32_t lost; //CHANNEL and LINK, 0: everything
+} fault_spec_t;
+
+typedef struct
+{
+	node_t nodes[NB_NRF_MAX];
+	uint16_t nb_nodes;
+	uint32_t lost_packets;
+	uint32_t lost_acks;
+	uint32_t corrupted_frames;
+	nRF_log_level_t log_level;
+	bool stop_on_error;
+	uint32_t time_ms; //0: until Ctrl+C
+	bool realtime; //run at wall clock speed instead of as fast as possible
+	bool profile; //see nRF_profile()
+	bool watch_firmware; //reload nodes when their firmware changes on disk
+	uint32_t checkpoint_ms; //0: no time travel
+	uint8_t checkpoints_max;
+	until_spec_t untils[NB_UNTILS_MAX];
+	uint8_t nb_untils;
+	switch_t switches[NB_SWITCHES_MAX]; //sorted by time
+	uint8_t nb_switches;
+	fault_spec_t * faults; //may be thousands, given in a separate file
+	uint32_t nb_faults;
+} scenario_t;
+
+typedef struct
+{
+	uint64_t time_ns;
+	pid_t pid; //process waiting to continue the simulation from this point
+	int fd_wake; //write end of the pipe it is waiting on
+} checkpoint_t;
+
+typedef struct
+{
+	int fd;
+	off_t offset;
+} output_t; //an output file shared with the checkpoints, see save_outputs()
+
+typedef struct
+{
+	pid_t live; //process running the simulation
+	uint8_t nb_checkpoints;
+	checkpoint_t checkpoints[NB_CHECKPOINTS_MAX]; //oldest first
+} timetravel_t; //shared between all processes
+
+typedef struct
+{
+	uint64_t time_ns;
+	nRF_event_t event;
+	char const * nRF;
+	char const * peer; //NULL if none
+	uint8_t PID;
+	uint8_t nb_bytes;
+} journal_entry_t;
+
+typedef struct
+{
+	uint64_t now_ns;
+	node_t * node;
+} run_order_t;
+
+static scenario_t scenario;
+
+static timetravel_t * timetravel=NULL;
+static uint64_t pause_at_ns; //0: don't pause
+static uint64_t next_checkpoint_ns;
+static uint64_t pacing_start_ns; //CLOCK_MONOTONIC minus simulated time
+
+static uint8_t next_switch=0;
+
+static run_order_t run_order[NB_NRF_MAX]; //min-heap, the node that is behind in simulated time first
+
+static journal_entry_t journal[SZ_JOURNAL];
+static uint32_t journal_head=0; //total number of entries ever written
+
+static const char * event_names[NRF_NB_EVENTS]={
+	[NRF_EVENT_TX_START]="TX start",
+	[NRF_EVENT_TX_END]="TX end",
+	[NRF_EVENT_RX_DELIVERED]="RX delivered",
+	[NRF_EVENT_ACK_SENT]="ACK sent",
+	[NRF_EVENT_ACK_RECEIVED]="ACK received",
+	[NRF_EVENT_PACKET_LOST]="lost",
+	[NRF_EVENT_DUPLICATE_DROPPED]="duplicate dropped",
+	[NRF_EVENT_MAX_RT]="MAX_RT"
+};
+
+static firmware_cache_t firmwares[NB_FIRMWARES_MAX];
+static uint8_t nb_firmwares=0;
+
+volatile bool run=true;
+
+static void sigint_handler(int sig)
+{
+	(void)sig;
+	run=false;
+	printf("\n");
+}
+
+static pin_t parse_pin(char const * const value, char const * const filename, const uint32_t nb_line)
+{
+	pin_t pin;
+
+	if(value[0]<'A' || value[0]>'L' || value[1]<'0' || value[1]>'7' || value[2]!='\0')
+		errx(1, "%s:%u: invalid pin \"%s\", use port and pin like D5", filename, nb_line, value);
+
+	pin.port=value[0];
+	pin.pin=value[1]-'0';
+
+	return pin;
+}
+
+static nRF_log_level_t parse_log_level(char const * const value, char const * const filename, const uint32_t nb_line)
+{
+	if(!strcmp(value, "error"))
+		return NRF_LOG_ERROR;
+	if(!strcmp(value, "warning"))
+		return NRF_LOG_WARNING;
+	if(!strcmp(value, "verbose"))
+		return NRF_LOG_VERBOSE;
+	if(!strcmp(value, "debug"))
+		return NRF_LOG_DEBUG;
+	errx(1, "%s:%u: invalid log level \"%s\"", filename, nb_line, value);
+}
+
+static uint32_t parse_number(char const * const value, char const * const filename, const uint32_t nb_line)
+{
+	if(!value)
+		errx(1, "%s:%u: number missing", filename, nb_line);
+
+	char * end;
+	errno=0;
+	const unsigned long number=strtoul(value, &end, 0);
+	if(!isdigit((unsigned char)value[0]) || *end!='\0' || errno || number>UINT32_MAX)
+		errx(1, "%s:%u: invalid number \"%s\"", filename, nb_line, value);
+
+	return number;
+}
+
+static void parse_node(char const * const filename, const uint32_t nb_line)
+{
+	if(scenario.nb_nodes==NB_NRF_MAX)
+		errx(1, "%s:%u: too many nodes, increase NB_NRF_MAX in nRF_config.h", filename, nb_line);
+
+	node_t * const node=&scenario.nodes[scenario.nb_nodes];
+
+	char * name=strtok(NULL, " \t\r\n");
+	char * mcu=strtok(NULL, " \t\r\n");
+	char * frequency=strtok(NULL, " \t\r\n");
+	char * firmware=strtok(NULL, " \t\r\n");
+
+	if(!firmware)
+		errx(1, "%s:%u: use node <name> <mcu> <frequency> <firmware> [ce=D5] [csn=D6] [irq=D7] [channel=N]", filename, nb_line);
+	if(strlen(name)>=NRF_SZ_NAME || strlen(mcu)>=SZ_MCU || strlen(firmware)>=SZ_FILENAME)
+		errx(1, "%s:%u: name, MCU or firmware too long", filename, nb_line);
+
+	strcpy(node->name, name);
+	strcpy(node->mcu, mcu);
+	node->frequency=parse_number(frequency, filename, nb_line);
+	if(node->frequency==0)
+		errx(1, "%s:%u: invalid frequency \"%s\"", filename, nb_line, frequency);
+	strcpy(node->firmware, firmware);
+
+	//same pins as in /example
+	node->ce=parse_pin("D5", filename, nb_line);
+	node->csn=parse_pin("D6", filename, nb_line);
+	node->irq=parse_pin("D7", filename, nb_line);
+	node->channel=-1;
+
+	char * option;
+	while((option=strtok(NULL, " \t\r\n")))
+	{
+		if(!strncmp(option, "ce=", 3))
+			node->ce=parse_pin(option+3, filename, nb_line);
+		else if(!strncmp(option, "csn=", 4))
+			node->csn=parse_pin(option+4, filename, nb_line);
+		else if(!strncmp(option, "irq=", 4))
+			node->irq=parse_pin(option+4, filename, nb_line);
+		else if(!strncmp(option, "channel=", 8))
+		{
+			const uint32_t channel=parse_number(option+8, filename, nb_line);
+			if(channel>125)
+				errx(1, "%s:%u: invalid channel \"%s\"", filename, nb_line, option+8);
+			node->channel=channel;
+		}
+		else
+			errx(1, "%s:%u: unknown option \"%s\"", filename, nb_line, option);
+	}
+
+	scenario.nb_nodes++;
+}
+
+static void parse_host(char const * const filename, const uint32_t nb_line)
+{
+	if(scenario.nb_nodes==NB_NRF_MAX)
+		errx(1, "%s:%u: too many nodes, increase NB_NRF_MAX in nRF_config.h", filename, nb_line);
+
+	node_t * const node=&scenario.nodes[scenario.nb_nodes];
+
+	char * name=strtok(NULL, " \t\r\n");
+	char * socket=strtok(NULL, " \t\r\n");
+
+	if(!socket)
+		errx(1, "%s:%u: use host <name> <socket> [channel=N]", filename, nb_line);
+	if(strlen(name)>=NRF_SZ_NAME || strlen(socket)>=sizeof(((struct sockaddr_un*)NULL)->sun_path))
+		errx(1, "%s:%u: name or socket too long", filename, nb_line);
+
+	strcpy(node->name, name);
+	strcpy(node->mcu, HOST_MCU);
+	node->frequency=HOST_FREQUENCY;
+	strcpy(node->socket, socket);
+	node->host=true;
+	node->channel=-1;
+
+	char * option;
+	while((option=strtok(NULL, " \t\r\n")))
+	{
+		if(!strncmp(option, "channel=", 8))
+		{
+			const uint32_t channel=parse_number(option+8, filename, nb_line);
+			if(channel>125)
+				errx(1, "%s:%u: invalid channel \"%s\"", filename, nb_line, option+8);
+			node->channel=channel;
+		}
+		else
+			errx(1, "%s:%u: unknown option \"%s\"", filename, nb_line, option);
+	}
+
+	scenario.nb_nodes++;
+}
+
+static void parse_node_name(char * const dest, char const * const value, char const * const filename, const uint32_t nb_line)
+{
+	if(!value)
+		errx(1, "%s:%u: node name missing", filename, nb_line);
+	if(strlen(value)>=NRF_SZ_NAME)
+		errx(1, "%s:%u: node name \"%s\" too long", filename, nb_line, value);
+
+	strcpy(dest, strcmp(value, "*")?value:"");
+}
+
+static void parse_until(char const * const filename, const uint32_t nb_line)
+{
+	if(scenario.nb_untils==NB_UNTILS_MAX)
+		errx(1, "%s:%u: too many until, increase NRF_UNTIL_MAX in nRF_config.h", filename, nb_line);
+
+	until_spec_t * const until=&scenario.untils[scenario.nb_untils];
+	memset(until, 0, sizeof(until_spec_t));
+
+	char * type=strtok(NULL, " \t\r\n");
+	if(!type)
+		errx(1, "%s:%u: until what?", filename, nb_line);
+
+	if(!strcmp(type, "delivered"))
+	{
+		until->type=NRF_UNTIL_DELIVERED;
+		parse_node_name(until->peer, strtok(NULL, " \t\r\n"), filename, nb_line);
+		parse_node_name(until->node, strtok(NULL, " \t\r\n"), filename, nb_line);
+		until->value=parse_number(strtok(NULL, " \t\r\n"), filename, nb_line);
+	}
+	else if(!strcmp(type, "max_rt"))
+	{
+		until->type=NRF_UNTIL_MAX_RT;
+		parse_node_name(until->node, strtok(NULL, " \t\r\n"), filename, nb_line);
+	}
+	else if(!strcmp(type, "register"))
+	{
+		until->type=NRF_UNTIL_REGISTER;
+		parse_node_name(until->node, strtok(NULL, " \t\r\n"), filename, nb_line);
+		if(!until->node[0])
+			errx(1, "%s:%u: until register needs a node", filename, nb_line);
+		until->value=parse_number(strtok(NULL, " \t\r\n"), filename, nb_line);
+		until->mask=parse_number(strtok(NULL, " \t\r\n"), filename, nb_line);
+		until->reg_value=parse_number(strtok(NULL, " \t\r\n"), filename, nb_line);
+	}
+	else if(!strcmp(type, "time"))
+	{
+		until->type=NRF_UNTIL_TIME;
+		until->value=parse_number(strtok(NULL, " \t\r\n"), filename, nb_line);
+	}
+	else if(!strcmp(type, "stuck"))
+	{
+		until->type=NRF_UNTIL_STUCK;
+		parse_node_name(until->node, strtok(NULL, " \t\r\n"), filename, nb_line);
+		char * state=strtok(NULL, " \t\r\n");
+		until->state=(state && !strcmp(state, "*"))?NRF_NB_STATES:parse_number(state, filename, nb_line);
+		if(until->state>NRF_NB_STATES)
+			errx(1, "%s:%u: invalid state \"%s\"", filename, nb_line, state);
+		until->value=parse_number(strtok(NULL, " \t\r\n"), filename, nb_line);
+	}
+	else
+		errx(1, "%s:%u: unknown until \"%s\"", filename, nb_line, type);
+
+	char * result=strtok(NULL, " \t\r\n");
+	until->result=result?(int)parse_number(result, filename, nb_line):0;
+
+	scenario.nb_untils++;
+}
+
+static void add_switch(char const * const node, const uint32_t ms, const bool model, char const * const filename, const uint32_t nb_line)
+{
+	if(scenario.nb_switches==NB_SWITCHES_MAX)
+		errx(1, "%s:%u: too many model lines, increase NB_SWITCHES_MAX", filename, nb_line);
+
+	switch_t * const s=&scenario.switches[scenario.nb_switches];
+	s->at_ns=(uint64_t)ms*1000000;
+	strcpy(s->node, node);
+	s->model=model;
+	s->line=scenario.nb_switches;
+	scenario.nb_switches++;
+}
+
+static void parse_model(char const * const filename, const uint32_t nb_line)
+{
+	char node[NRF_SZ_NAME];
+	parse_node_name(node, strtok(NULL, " \t\r\n"), filename, nb_line);
+	const uint32_t from_ms=parse_number(strtok(NULL, " \t\r\n"), filename, nb_line);
+	char * to=strtok(NULL, " \t\r\n");
+
+	add_switch(node, from_ms, true, filename, nb_line);
+	if(to)
+	{
+		const uint32_t to_ms=parse_number(to, filename, nb_line);
+		if(to_ms<=from_ms)
+			errx(1, "%s:%u: model window ends before it starts", filename, nb_line);
+		add_switch(node, to_ms, false, filename, nb_line);
+	}
+}
+
+static void parse_fault(char const * const filename, const uint32_t nb_line)
+{
+	if((scenario.nb_faults&0xff)==0)
+	{
+		scenario.faults=realloc(scenario.faults, (scenario.nb_faults+256)*sizeof(fault_spec_t));
+		if(!scenario.faults)
+			err(1, "realloc for faults failed");
+	}
+
+	fault_spec_t * const fault=&scenario.faults[scenario.nb_faults];
+	memset(fault, 0, sizeof(fault_spec_t));
+
+	char * type=strtok(NULL, " \t\r\n");
+	if(!type)
+		errx(1, "%s:%u: fault of what?", filename, nb_line);
+
+	if(!strcmp(type, "channel"))
+	{
+		fault->type=NRF_FAULT_CHANNEL;
+		const uint32_t channel=parse_number(strtok(NULL, " \t\r\n"), filename, nb_line);
+		if(channel>=128)
+			errx(1, "%s:%u: invalid channel %u", filename, nb_line, channel);
+		fault->channel=channel;
+	}
+	else if(!strcmp(type, "link"))
+	{
+		fault->type=NRF_FAULT_LINK;
+		parse_node_name(fault->node, strtok(NULL, " \t\r\n"), filename, nb_line);
+		parse_node_name(fault->peer, strtok(NULL, " \t\r\n"), filename, nb_line);
+		if(!fault->node[0] || !fault->peer[0])
+			errx(1, "%s:%u: fault link needs two nodes", filename, nb_line);
+	}
+	else if(!strcmp(type, "brownout"))
+	{
+		fault->type=NRF_FAULT_BROWNOUT;
+		parse_node_name(fault->node, strtok(NULL, " \t\r\n"), filename, nb_line);
+		if(!fault->node[0])
+			errx(1, "%s:%u: fault brownout needs a node", filename, nb_line);
+	}
+	else
+		errx(1, "%s:%u: unknown fault \"%s\"", filename, nb_line, type);
+
+	fault->from_ms=parse_number(strtok(NULL, " \t\r\n"), filename, nb_line);
+	fault->to_ms=parse_number(strtok(NULL, " \t\r\n"), filename, nb_line);
+	if(fault->to_ms<=fault->from_ms)
+		errx(1, "%s:%u: fault ends before it starts", filename, nb_line);
+
+	if(fault->type!=NRF_FAULT_BROWNOUT)
+	{
+		char * lost=strtok(NULL, " \t\r\n");
+		fault->lost=lost?parse_number(lost, filename, nb_line):0;
+	}
+
+	scenario.nb_faults++;
+}
+
+static void parse_faults_file(char const * const filename) //a timeline of fault lines, e.g. generated by a script
+{
+	FILE * f=fopen(filename, "r");
+	if(f==NULL)
+		err(1, "opening faults %s failed", filename);
+
+	char line[512];
+	uint32_t nb_line=0;
+	while(fgets(line, sizeof(line), f))
+	{
+		nb_line++;
+
+		char * key=strtok(line, " \t\r\n");
+		if(key==NULL || key[0]=='#')
+			continue;
+
+		if(strcmp(key, "fault"))
+			errx(1, "%s:%u: only fault lines are allowed here", filename, nb_line);
+
+		parse_fault(filename, nb_line);
+	}
+
+	fclose(f);
+}
+
+static int compare_switches(const void * a, const void * b)
+{
+	switch_t const * const s1=a;
+	switch_t const * const s2=b;
+
+	if(s1->at_ns!=s2->at_ns)
+		return (s1->at_ns<s2->at_ns)?-1:1;
+	return s1->line-s2->line;
+}
+
+static void parse_scenario(char const * const filename)
+{
+	FILE * f=fopen(filename, "r");
+	if(f==NULL)
+		err(1, "opening scenario %s failed", filename);
+
+	memset(&scenario, 0, sizeof(scenario_t));
+	scenario.log_level=NRF_LOG_WARNING;
+	scenario.stop_on_error=true;
+	scenario.checkpoints_max=16;
+
+	char line[512];
+	uint32_t nb_line=0;
+	while(fgets(line, sizeof(line), f))
+	{
+		nb_line++;
+
+		char * key=strtok(line, " \t\r\n");
+		if(key==NULL || key[0]=='#')
+			continue;
+
+		if(!strcmp(key, "node"))
+		{
+			parse_node(filename, nb_line);
+			continue;
+		}
+
+		if(!strcmp(key, "until"))
+		{
+			parse_until(filename, nb_line);
+			continue;
+		}
+
+		if(!strcmp(key, "model"))
+		{
+			parse_model(filename, nb_line);
+			continue;
+		}
+
+		if(!strcmp(key, "host"))
+		{
+			parse_host(filename, nb_line);
+			continue;
+		}
+
+		if(!strcmp(key, "fault"))
+		{
+			parse_fault(filename, nb_line);
+			continue;
+		}
+
+		char * value=strtok(NULL, " \t\r\n");
+		if(value==NULL)
+			errx(1, "%s:%u: no value for \"%s\"", filename, nb_line, key);
+
+		if(!strcmp(key, "lost_packets"))
+			scenario.lost_packets=parse_number(value, filename, nb_line);
+		else if(!strcmp(key, "lost_acks"))
+			scenario.lost_acks=parse_number(value, filename, nb_line);
+		else if(!strcmp(key, "corrupted_frames"))
+			scenario.corrupted_frames=parse_number(value, filename, nb_line);
+		else if(!strcmp(key, "log_level"))
+			scenario.log_level=parse_log_level(value, filename, nb_line);
+		else if(!strcmp(key, "stop_on_error"))
+			scenario.stop_on_error=parse_number(value, filename, nb_line);
+		else if(!strcmp(key, "time_ms"))
+			scenario.time_ms=parse_number(value, filename, nb_line);
+		else if(!strcmp(key, "realtime"))
+			scenario.realtime=parse_number(value, filename, nb_line);
+		else if(!strcmp(key, "profile"))
+			scenario.profile=parse_number(value, filename, nb_line);
+		else if(!strcmp(key, "watch_firmware"))
+			scenario.watch_firmware=parse_number(value, filename, nb_line);
+		else if(!strcmp(key, "checkpoint_ms"))
+			scenario.checkpoint_ms=parse_number(value, filename, nb_line);
+		else if(!strcmp(key, "faults"))
+			parse_faults_file(value);
+		else if(!strcmp(key, "checkpoints_max"))
+		{
+			scenario.checkpoints_max=parse_number(value, filename, nb_line);
+			if(scenario.checkpoints_max<1 || scenario.checkpoints_max>NB_CHECKPOINTS_MAX)
+				errx(1, "%s:%u: checkpoints_max must be 1 to %u", filename, nb_line, NB_CHECKPOINTS_MAX);
+		}
+		else
+			errx(1, "%s:%u: unknown setting \"%s\"", filename, nb_line, key);
+	}
+
+	fclose(f);
+
+	if(scenario.nb_nodes==0)
+		errx(1, "%s: no nodes", filename);
+
+	qsort(scenario.switches, scenario.nb_switches, sizeof(switch_t), &compare_switches);
+
+	uint16_t i;
+	for(i=0; i<scenario.nb_nodes; i++)
+	{
+		if(scenario.nodes[i].host && scenario.checkpoint_ms)
+			errx(1, "%s: host nodes can't go back in time, remove checkpoint_ms", filename); //the host software would not follow
+	}
+}
+
+static bool read_firmware(firmware_cache_t * const cache) //false if the file can't be read
+{
+	struct stat st;
+	if(stat(cache->filename, &st))
+		return false;
+
+	elf_firmware_t * firmware=calloc(1, sizeof(elf_firmware_t));
+	if(!firmware)
+		err(1, "allocating firmware %s failed", cache->filename);
+
+	if(elf_read_firmware(cache->filename, firmware))
+	{
+		free(firmware);
+		return false;
+	}
+
+	cache->firmware=firmware; //the previous image may still be used by avr_load_firmware() of other nodes, it is not freed
+	cache->mtime=st.st_mtim;
+
+	return true;
+}
+
+static firmware_cache_t * find_firmware(char const * const filename) //NULL if not read yet
+{
+	uint8_t i;
+	for(i=0; i<nb_firmwares; i++)
+		if(!strcmp(firmwares[i].filename, filename))
+			return &firmwares[i];
+
+	return NULL;
+}
+
+static firmware_cache_t * new_firmware(char const * const filename) //NULL if the file can't be read
+{
+	firmware_cache_t * const cache=&firmwares[nb_firmwares];
+	strcpy(cache->filename, filename);
+	if(!read_firmware(cache))
+		return NULL;
+	nb_firmwares++;
+
+	return cache;
+}
+
+static firmware_cache_t * get_firmware(char const * const filename)
+{
+	firmware_cache_t * cache=find_firmware(filename);
+	if(cache)
+		return cache;
+
+	if(nb_firmwares==NB_FIRMWARES_MAX)
+		errx(1, "too many different firmwares, increase NB_FIRMWARES_MAX");
+
+	cache=new_firmware(filename);
+	if(!cache)
+		errx(1, "elf_read_firmware %s failed", filename);
+
+	return cache;
+}
+
+static avr_irq_t * pin_irq(avr_t * avr, const pin_t pin)
+{
+	return avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ(pin.port), pin.pin);
+}
+
+static void build_node(node_t * const node)
+{
+	node->avr=avr_make_mcu_by_name(node->mcu);
+	if(!node->avr)
+		errx(1, "node %s: avr_make_mcu_by_name %s failed", node->name, node->mcu);
+
+	avr_init(node->avr);
+	node->avr->frequency=node->frequency;
+	avr_load_firmware(node->avr, get_firmware(node->firmware)->firmware);
+
+	node->nRF=make_new_nRF();
+	nRF_init(node->avr, node->nRF, node->name);
+	nRF_connect(node->nRF, pin_irq(node->avr, node->ce), pin_irq(node->avr, node->irq));
+
+	if(node->channel>=0)
+		nRF_override_register(node->nRF, REG_RF_CH, 0x7f, node->channel);
+
+	nRF_connect_spi(node->nRF, avr_io_getirq(node->avr, AVR_IOCTL_SPI_GETIRQ(0), SPI_IRQ_OUTPUT), avr_io_getirq(node->avr, AVR_IOCTL_SPI_GETIRQ(0), SPI_IRQ_INPUT), pin_irq(node->avr, node->csn));
+}
+
+static void set_model(node_t * const node, const bool model)
+{
+	if(node->model==model)
+		return;
+
+	nRF_model(node->nRF, model);
+	node->model=model;
+
+	printf("node %s: %s at %.3fms\n", node->name, model?"behavioral model":"AVR running again", CYCLES_TO_MS_FLOAT(node->avr, node->avr->cycle));
+}
+
+static void apply_switches(const uint64_t now_ns)
+{
+	while(next_switch<scenario.nb_switches && scenario.switches[next_switch].at_ns<=now_ns)
+	{
+		switch_t const * const s=&scenario.switches[next_switch++];
+
+		uint16_t i;
+		for(i=0; i<scenario.nb_nodes; i++)
+		{
+			if(!scenario.nodes[i].host && (!s->node[0] || !strcmp(scenario.nodes[i].name, s->node)))
+				set_model(&scenario.nodes[i], s->model);
+		}
+	}
+}
+
+static void run_timers(node_t * const node, const uint64_t max_ns)
+{
+	//only the cycle timers (of the nRF and the model) are fired, the AVR core stays where it was stopped
+	avr_t * const avr=node->avr;
+
+	const avr_cycle_count_t next=avr_cycle_timer_process(avr);
+	avr_cycle_count_t step=avr_usec_to_cycles(avr, TIMER_STEP_US);
+	if(next && next<step)
+		step=next;
+	const avr_cycle_count_t max=avr_nsec_to_cycles(avr, max_ns);
+	if(max<step)
+		step=max?max:1;
+	avr->cycle+=step;
+}
+
+static void build_host(node_t * const node)
+{
+	static const char * pin_names[2]={"host_CE", "host_IRQ"};
+
+	node->avr=avr_make_mcu_by_name(node->mcu);
+	if(!node->avr)
+		errx(1, "node %s: avr_make_mcu_by_name %s failed", node->name, node->mcu);
+
+	avr_init(node->avr);
+	node->avr->frequency=node->frequency;
+
+	node->nRF=make_new_nRF();
+	nRF_init(node->avr, node->nRF, node->name);
+	node->host_pins=avr_alloc_irq(&node->avr->irq_pool, 0, 2, pin_names);
+	nRF_connect(node->nRF, &node->host_pins[HOST_PIN_CE], &node->host_pins[HOST_PIN_IRQ]);
+
+	if(node->channel>=0)
+		nRF_override_register(node->nRF, REG_RF_CH, 0x7f, node->channel);
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family=AF_UNIX;
+	strcpy(addr.sun_path, node->socket);
+
+	node->fd_listen=socket(AF_UNIX, SOCK_STREAM, 0);
+	if(node->fd_listen<0)
+		err(1, "node %s: socket failed", node->name);
+	unlink(node->socket);
+	if(bind(node->fd_listen, (struct sockaddr*)&addr, sizeof(addr)) || listen(node->fd_listen, 1))
+		err(1, "node %s: listening on %s failed", node->name, node->socket);
+
+	node->fd=-1;
+}
+
+static void reload_node(node_t * const node, firmware_cache_t const * const cache)
+{
+	//the AVR restarts with the new firmware and the nRF is reset like at power-on, the rest of the network keeps running
+	const avr_cycle_count_t cycle=node->avr->cycle;
+
+	set_model(node, false); //the new firmware has to run to configure the nRF
+
+	avr_load_firmware(node->avr, cache->firmware);
+	avr_reset(node->avr);
+	node->avr->cycle=cycle; //avr_reset() starts at cycle 0, the node must stay at the time of the network
+	node->avr->state=cpu_Running;
+	node->avr->frequency=node->frequency;
+
+	nRF_reset(node->nRF);
+
+	printf("node %s: firmware %s loaded at %.3fms\n", node->name, cache->filename, CYCLES_TO_MS_FLOAT(node->avr, cycle));
+}
+
+static void watch_firmwares(void)
+{
+	uint8_t i;
+	for(i=0; i<nb_firmwares; i++)
+	{
+		firmware_cache_t * const cache=&firmwares[i];
+
+		struct stat st;
+		if(stat(cache->filename, &st) || (st.st_mtim.tv_sec==cache->mtime.tv_sec && st.st_mtim.tv_nsec==cache->mtime.tv_nsec))
+			continue;
+
+		if(!read_firmware(cache))
+			continue; //probably still being written, try again later
+
+		uint16_t n;
+		for(n=0; n<scenario.nb_nodes; n++)
+		{
+			if(!strcmp(scenario.nodes[n].firmware, cache->filename))
+				reload_node(&scenario.nodes[n], cache);
+		}
+	}
+}
+
+static void journal_event(const nRF_event_t event, nRF_t const * const nRF, nRF_t const * const peer, packet_tx_t const * const packet, void * param)
+{
+	(void)param;
+
+	journal_entry_t * const entry=&journal[journal_head%SZ_JOURNAL];
+	entry->time_ns=nRF->avr?avr_cycles_to_nsec(nRF->avr, nRF->avr->cycle):0;
+	entry->event=event;
+	entry->nRF=nRF->cold->name;
+	entry->peer=peer?peer->cold->name:NULL;
+	entry->PID=packet?packet->PID:0;
+	entry->nb_bytes=packet?packet->nb_bytes:0;
+	journal_head++;
+}
+
+static nRF_t * find_nRF(char const * const name) //NULL for any
+{
+	if(!name[0])
+		return NULL;
+
+	uint16_t i;
+	for(i=0; i<scenario.nb_nodes; i++)
+	{
+		if(!strcmp(scenario.nodes[i].name, name))
+			return scenario.nodes[i].nRF;
+	}
+
+	errx(1, "no node %s", name);
+}
+
+static void setup_untils(void)
+{
+	uint8_t i;
+	for(i=0; i<scenario.nb_untils; i++)
+	{
+		until_spec_t const * const until=&scenario.untils[i];
+		switch(until->type)
+		{
+			case NRF_UNTIL_DELIVERED:
+				nRF_until_delivered(find_nRF(until->peer), find_nRF(until->node), until->value, until->result);
+				break;
+			case NRF_UNTIL_MAX_RT:
+				nRF_until_max_rt(find_nRF(until->node), until->result);
+				break;
+			case NRF_UNTIL_REGISTER:
+				nRF_until_register(find_nRF(until->node), until->value, until->mask, until->reg_value, until->result);
+				break;
+			case NRF_UNTIL_TIME:
+				nRF_until_time(until->value, until->result);
+				break;
+			case NRF_UNTIL_STUCK:
+				nRF_until_stuck(find_nRF(until->node), until->state, until->value, until->result);
+				break;
+		}
+	}
+}
+
+static void setup_faults(void)
+{
+	uint32_t i;
+	for(i=0; i<scenario.nb_faults; i++)
+	{
+		fault_spec_t const * const fault=&scenario.faults[i];
+		switch(fault->type)
+		{
+			case NRF_FAULT_CHANNEL:
+				nRF_fault_channel(fault->channel, fault->from_ms, fault->to_ms, fault->lost);
+				break;
+			case NRF_FAULT_LINK:
+				nRF_fault_link(find_nRF(fault->node), find_nRF(fault->peer), fault->from_ms, fault->to_ms, fault->lost);
+				break;
+			case NRF_FAULT_BROWNOUT:
+				nRF_fault_brownout(find_nRF(fault->node), fault->from_ms, fault->to_ms);
+				break;
+		}
+	}
+
+	free(scenario.faults); //copied by simavr-nRF24
+	scenario.faults=NULL;
+}
+
+static void build_network(void)
+{
+	nRF_global_init();
+	nRF_stop_on_error(scenario.stop_on_error);
+	nRF_set_log_level(scenario.log_level);
+	nRF_set_lost_packets(scenario.lost_packets, scenario.lost_acks);
+	nRF_set_bit_errors(scenario.corrupted_frames);
+
+	uint16_t i;
+	for(i=0; i<scenario.nb_nodes; i++)
+	{
+		if(scenario.nodes[i].host)
+			build_host(&scenario.nodes[i]);
+		else
+			build_node(&scenario.nodes[i]);
+	}
+
+	for(i=0; i<scenario.nb_switches; i++)
+	{
+		if(scenario.switches[i].node[0])
+			find_nRF(scenario.switches[i].node); //check the name now rather than when the switch is due
+	}
+
+	setup_untils();
+	setup_faults();
+
+	if(scenario.checkpoint_ms)
+	{
+		nRF_event_t event;
+		for(event=0; event<NRF_NB_EVENTS; event++)
+			nRF_register_event_callback(event, &journal_event, NULL);
+	}
+}
+
+static uint64_t monotonic_ns(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec*1000000000ULL+now.tv_nsec;
+}
+
+static void pacing_rebase(const uint64_t now_ns) //simulated time now_ns is now
+{
+	pacing_start_ns=monotonic_ns()-now_ns;
+}
+
+static void pace(const uint64_t now_ns)
+{
+	//now_ns is the AVR that is behind, wait until the wall clock has caught up with it
+	uint64_t wall=monotonic_ns()-pacing_start_ns;
+	if(now_ns>wall)
+	{
+		struct timespec wait={(now_ns-wall)/1000000000ULL, (now_ns-wall)%1000000000ULL};
+		nanosleep(&wait, NULL);
+		wall=monotonic_ns()-pacing_start_ns;
+	}
+
+	uint16_t i;
+	for(i=0; i<scenario.nb_nodes; i++)
+	{
+		node_t * const node=&scenario.nodes[i];
+		const double sim_ms=CYCLES_TO_MS_FLOAT(node->avr, node->avr->cycle);
+		const double lag_ms=wall/1E6-sim_ms;
+
+		node->nb_lag_checks++;
+		if(lag_ms<=0)
+			continue;
+
+		node->nb_lag_checks_behind++;
+		node->lag_sum_ms+=lag_ms;
+		if(lag_ms>node->lag_max_ms)
+		{
+			node->lag_max_ms=lag_ms;
+			node->lag_max_at_ms=sim_ms;
+			node->lag_max_state=node->nRF->state;
+		}
+	}
+}
+
+static void print_lag(void)
+{
+	printf("lag behind wall clock (checked every %uµs of simulated time):\n", PACING_INTERVAL_NS/1000);
+
+	uint16_t i;
+	for(i=0; i<scenario.nb_nodes; i++)
+	{
+		node_t const * const node=&scenario.nodes[i];
+		if(node->nb_lag_checks_behind==0)
+		{
+			printf("node %s: never behind\n", node->name);
+			continue;
+		}
+
+		printf("node %s: behind in %.1f%% of checks, average %.3fms, worst %.3fms at %.3fms simulated time (nRF state %u)\n", node->name, \
+				100.0*node->nb_lag_checks_behind/node->nb_lag_checks, node->lag_sum_ms/node->nb_lag_checks_behind, node->lag_max_ms, node->lag_max_at_ms, node->lag_max_state);
+	}
+}
+
+static bool host_read(const int fd, void * const data, const size_t length) //false if disconnected
+{
+	size_t done=0;
+	while(done<length)
+	{
+		ssize_t n=read(fd, (uint8_t*)data+done, length-done);
+		if(n<0 && errno==EINTR)
+			continue;
+		if(n<=0)
+			return false;
+		done+=n;
+	}
+
+	return true;
+}
+
+static bool host_reply(node_t * const node, const uint8_t type, void const * const data, const uint8_t length)
+{
+	uint8_t msg[sizeof(host_msg_header_t)+255];
+	host_msg_header_t header={type, length};
+	memcpy(msg, &header, sizeof(header));
+	memcpy(msg+sizeof(header), data, length);
+
+	size_t done=0;
+	while(done<sizeof(header)+length)
+	{
+		ssize_t n=send(node->fd, msg+done, sizeof(header)+length-done, MSG_NOSIGNAL);
+		if(n<0 && errno==EINTR)
+			continue;
+		if(n<=0)
+			return false;
+		done+=n;
+	}
+
+	return true;
+}
+
+static void host_disconnect(node_t * const node, char const * const why)
+{
+	printf("node %s: host software %s at %.3fms, stopping\n", node->name, why, CYCLES_TO_MS_FLOAT(node->avr, node->avr->cycle));
+	close(node->fd);
+	node->fd=-1;
+	node->host_waiting=true; //don't read again
+	node->host_until_ns=UINT64_MAX;
+	run=false;
+}
+
+static bool host_request(node_t * const node) //false when the host software waits for simulated time (or is gone)
+{
+	host_msg_header_t header;
+	uint8_t data[255];
+
+	if(!host_read(node->fd, &header, sizeof(header)) || !host_read(node->fd, data, header.length))
+	{
+		host_disconnect(node, "disconnected");
+		return false;
+	}
+
+	const uint64_t now_ns=avr_cycles_to_nsec(node->avr, node->avr->cycle);
+	bool ok;
+	uint8_t i;
+
+	switch(header.type)
+	{
+		case HOST_MSG_SPI:
+			csn_nRF(node->nRF, 0);
+			for(i=0; i<header.length; i++)
+				data[i]=spi_nRF(node->nRF, data[i]);
+			csn_nRF(node->nRF, 1);
+			ok=host_reply(node, HOST_MSG_SPI, data, header.length);
+			break;
+
+		case HOST_MSG_CE:
+			if(header.length!=1)
+			{
+				host_disconnect(node, "sent an invalid message");
+				return false;
+			}
+			avr_raise_irq(&node->host_pins[HOST_PIN_CE], data[0]?1:0);
+			ok=host_reply(node, HOST_MSG_CE, NULL, 0);
+			break;
+
+		case HOST_MSG_IRQ:
+		{
+			const uint8_t level=node->host_pins[HOST_PIN_IRQ].value;
+			ok=host_reply(node, HOST_MSG_IRQ, &level, 1);
+			break;
+		}
+
+		case HOST_MSG_WAIT:
+		case HOST_MSG_WAIT_IRQ:
+		{
+			if(header.length!=sizeof(uint32_t))
+			{
+				host_disconnect(node, "sent an invalid message");
+				return false;
+			}
+			uint32_t us;
+			memcpy(&us, data, sizeof(us));
+			node->host_until_ns=now_ns+us*1000ULL;
+			node->host_wait_irq=(header.type==HOST_MSG_WAIT_IRQ);
+			node->host_waiting=true;
+			return false; //answered by run_host() when the time has come
+		}
+
+		default:
+			host_disconnect(node, "sent an invalid message");
+			return false;
+	}
+
+	if(!ok)
+	{
+		host_disconnect(node, "disconnected");
+		return false;
+	}
+
+	return true;
+}
+
+static void run_host(node_t * const node)
+{
+	avr_t * const avr=node->avr;
+	const uint64_t now_ns=avr_cycles_to_nsec(avr, avr->cycle);
+
+	if(node->fd<0 && !node->host_waiting)
+	{
+		printf("node %s: waiting for host software on %s\n", node->name, node->socket);
+		fflush(stdout);
+		do
+		{
+			node->fd=accept(node->fd_listen, NULL, NULL);
+		} while(node->fd<0 && errno==EINTR);
+		if(node->fd<0)
+			err(1, "node %s: accept failed", node->name);
+		pacing_rebase(now_ns);
+	}
+
+	if(node->host_waiting)
+	{
+		const bool irq=node->host_wait_irq && !node->host_pins[HOST_PIN_IRQ].value;
+		if(!irq && now_ns<node->host_until_ns)
+		{
+			run_timers(node, node->host_until_ns-now_ns);
+			return;
+		}
+
+		node->host_waiting=false;
+
+		uint8_t reply[1+sizeof(uint64_t)];
+		uint8_t length=0;
+		if(node->host_wait_irq)
+			reply[length++]=node->host_pins[HOST_PIN_IRQ].value;
+		memcpy(reply+length, &now_ns, sizeof(now_ns));
+		length+=sizeof(now_ns);
+		if(!host_reply(node, node->host_wait_irq?HOST_MSG_WAIT_IRQ:HOST_MSG_WAIT, reply, length))
+		{
+			host_disconnect(node, "disconnected");
+			return;
+		}
+	}
+
+	while(host_request(node)); //until the host software waits
+}
+
+//time travel: every checkpoint is a fork()ed copy (copy-on-write) of the whole simulation waiting on a pipe, going back in time means waking up the nearest checkpoint and replaying from there
+
+static void supervise(void)
+{
+	//the original process only waits so the shell sees a single program whatever process ends up running the simulation
+	timetravel=mmap(NULL, sizeof(timetravel_t), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if(timetravel==MAP_FAILED)
+		err(1, "mmap for checkpoints failed");
+	memset(timetravel, 0, sizeof(timetravel_t));
+
+	if(prctl(PR_SET_CHILD_SUBREAPER, 1)) //checkpoints whose parent exited are reaped here
+		err(1, "prctl PR_SET_CHILD_SUBREAPER failed");
+
+	setvbuf(stdin, NULL, _IONBF, 0); //commands must not stay in a buffer copied into the checkpoints
+
+	fflush(NULL);
+	pid_t pid=fork();
+	if(pid<0)
+		err(1, "fork failed");
+	if(pid==0)
+	{
+		signal(SIGPIPE, SIG_IGN);
+		__atomic_store_n(&timetravel->live, getpid(), __ATOMIC_SEQ_CST);
+		return;
+	}
+
+	__atomic_store_n(&timetravel->live, pid, __ATOMIC_SEQ_CST);
+	signal(SIGINT, SIG_IGN);
+	signal(SIGTERM, SIG_IGN);
+
+	while(1)
+	{
+		int status;
+		pid_t done=wait(&status);
+		if(done<0)
+		{
+			if(errno==EINTR)
+				continue;
+			err(1, "wait failed");
+		}
+
+		if(done==__atomic_load_n(&timetravel->live, __ATOMIC_SEQ_CST))
+		{
+			uint8_t i;
+			for(i=0; i<timetravel->nb_checkpoints; i++)
+				kill(timetravel->checkpoints[i].pid, SIGTERM); //not the process group, it may be shared with a calling script
+			exit(WIFEXITED(status)?WEXITSTATUS(status):1);
+		}
+	}
+}
+
+static void drop_checkpoint(const uint8_t index)
+{
+	checkpoint_t * const checkpoint=&timetravel->checkpoints[index];
+	kill(checkpoint->pid, SIGKILL);
+	while(waitpid(checkpoint->pid, NULL, 0)<0 && errno==EINTR)
+		; //ECHILD: forked by a process that has exited since, the supervisor reaps it
+	close(checkpoint->fd_wake);
+
+	memmove(checkpoint, checkpoint+1, (timetravel->nb_checkpoints-index-1)*sizeof(checkpoint_t));
+	timetravel->nb_checkpoints--;
+}
+
+static uint8_t save_outputs(output_t * const outputs)
+{
+	//the files written during the simulation (log, capture and trace of simavr-nRF24, anything opened write-only) share their offset with the checkpoints
+	DIR * dir=opendir("/proc/self/fd");
+	if(!dir)
+		return 0;
+
+	uint8_t nb=0;
+	struct dirent * entry;
+	while((entry=readdir(dir)) && nb<NB_OUTPUTS_MAX)
+	{
+		const int fd=atoi(entry->d_name);
+		if(fd<=STDERR_FILENO || fd==dirfd(dir))
+			continue;
+
+		struct stat st;
+		const int flags=fcntl(fd, F_GETFL);
+		if(flags<0 || (flags&O_ACCMODE)!=O_WRONLY || fstat(fd, &st) || !S_ISREG(st.st_mode))
+			continue;
+
+		outputs[nb].fd=fd;
+		outputs[nb].offset=lseek(fd, 0, SEEK_CUR);
+		nb++;
+	}
+	closedir(dir);
+
+	return nb;
+}
+
+static void rewind_outputs(output_t const * const outputs, const uint8_t nb)
+{
+	//what the discarded future wrote is cut off, the replay writes it again
+	uint8_t i;
+	for(i=0; i<nb; i++)
+	{
+		if(outputs[i].offset<0 || ftruncate(outputs[i].fd, outputs[i].offset) || lseek(outputs[i].fd, outputs[i].offset, SEEK_SET)<0)
+			warn("rewinding output file %d failed", outputs[i].fd);
+	}
+}
+
+static void take_checkpoint(const uint64_t now_ns)
+{
+	if(timetravel->nb_checkpoints==scenario.checkpoints_max)
+		drop_checkpoint(0);
+
+	int fds[2];
+	if(pipe(fds))
+		err(1, "pipe for checkpoint failed");
+
+	fflush(NULL); //else buffered output would be written by both processes
+
+	output_t outputs[NB_OUTPUTS_MAX];
+	const uint8_t nb_outputs=save_outputs(outputs);
+
+	pid_t pid=fork();
+	if(pid<0)
+		err(1, "fork for checkpoint failed");
+
+	if(pid==0)
+	{
+		close(fds[1]);
+
+		uint64_t target_ns;
+		ssize_t n;
+		do
+		{
+			n=read(fds[0], &target_ns, sizeof(target_ns));
+		} while(n<0 && errno==EINTR);
+		if(n!=sizeof(target_ns))
+			_exit(0);
+		close(fds[0]);
+
+		//woken up: this process continues the simulation, deterministically replaying from here
+		rewind_outputs(outputs, nb_outputs);
+		run=true;
+		pause_at_ns=target_ns;
+		next_checkpoint_ns=now_ns; //replace this checkpoint right away
+		pacing_rebase(now_ns);
+		printf("back at checkpoint %.3fms, replaying up to %.3fms\n", now_ns/1E6, target_ns/1E6);
+		return;
+	}
+
+	close(fds[0]);
+
+	checkpoint_t * const checkpoint=&timetravel->checkpoints[timetravel->nb_checkpoints];
+	checkpoint->time_ns=now_ns;
+	checkpoint->pid=pid;
+	checkpoint->fd_wake=fds[1];
+	timetravel->nb_checkpoints++;
+}
+
+static void go_back(const uint64_t target_ns)
+{
+	int8_t i;
+	for(i=timetravel->nb_checkpoints-1; i>=0; i--)
+	{
+		if(timetravel->checkpoints[i].time_ns<=target_ns)
+			break;
+	}
+
+	if(i<0)
+	{
+		printf("no checkpoint before %.3fms\n", target_ns/1E6);
+		return;
+	}
+
+	//the future is discarded, checkpoints after the target would be taken again while replaying
+	while(timetravel->nb_checkpoints>i+1)
+		drop_checkpoint(timetravel->nb_checkpoints-1);
+
+	checkpoint_t checkpoint=timetravel->checkpoints[i];
+	timetravel->nb_checkpoints=i; //the woken up process is no longer a checkpoint
+
+	__atomic_store_n(&timetravel->live, checkpoint.pid, __ATOMIC_SEQ_CST);
+	if(write(checkpoint.fd_wake, &target_ns, sizeof(target_ns))!=sizeof(target_ns))
+	{
+		__atomic_store_n(&timetravel->live, getpid(), __ATOMIC_SEQ_CST);
+		err(1, "waking up checkpoint at %.3fms failed", checkpoint.time_ns/1E6);
+	}
+
+	fflush(stdout);
+	_exit(0); //without flushing other files, their buffers are also in the checkpoint
+}
+
+static void print_journal(uint32_t nb)
+{
+	if(nb>journal_head)
+		nb=journal_head;
+	if(nb>SZ_JOURNAL)
+		nb=SZ_JOURNAL;
+
+	uint32_t i;
+	for(i=journal_head-nb; i<journal_head; i++)
+	{
+		journal_entry_t const * const entry=&journal[i%SZ_JOURNAL];
+		printf("%12.3fms nRF %s: %s", entry->time_ns/1E6, entry->nRF, event_names[entry->event]);
+		if(entry->peer)
+			printf(" (peer %s)", entry->peer);
+		printf(", PID %u, %u bytes\n", entry->PID, entry->nb_bytes);
+	}
+}
+
+static bool prompt(const uint64_t now_ns, int * const state) //returns false to quit
+{
+	while(1)
+	{
+		printf("[%.3fms] c: continue, t <ms>: go to time, j [n]: last RF events, r <node> [firmware]: reload firmware, m <node>: AVR/model, l: list checkpoints, q: quit> ", now_ns/1E6);
+		fflush(stdout);
+
+		char line[64];
+		if(!fgets(line, sizeof(line), stdin))
+			return false;
+
+		const bool avr_stopped=(*state==cpu_Done || *state==cpu_Crashed);
+
+		switch(line[0])
+		{
+			case 'c':
+				if(avr_stopped)
+				{
+					printf("an AVR is done or crashed, go back in time or quit\n");
+					break;
+				}
+				pause_at_ns=0;
+				return true;
+
+			case 't':
+			{
+				char * end;
+				const double target_ms=strtod(line+1, &end);
+				if(end==line+1 || !(target_ms>=0 && target_ms<UINT64_MAX/1E6))
+				{
+					printf("use t <ms> with a time of 0 or more\n");
+					break;
+				}
+
+				const uint64_t target_ns=target_ms*1E6;
+				if(target_ns<now_ns)
+				{
+					go_back(target_ns); //only returns on failure
+					break;
+				}
+				if(avr_stopped)
+				{
+					printf("an AVR is done or crashed, go back in time or quit\n");
+					break;
+				}
+				pause_at_ns=target_ns;
+				return true;
+			}
+
+			case 'j':
+			{
+				uint32_t nb=strtoul(line+1, NULL, 10);
+				print_journal(nb?nb:20);
+				break;
+			}
+
+			case 'r':
+			{
+				char name[64]="";
+				char filename[SZ_FILENAME+1]="";
+				if(sscanf(line+1, "%63s %128s", name, filename)<1)
+				{
+					printf("use r <node> [firmware]\n");
+					break;
+				}
+
+				uint16_t n;
+				for(n=0; n<scenario.nb_nodes; n++)
+				{
+					if(!strcmp(scenario.nodes[n].name, name))
+						break;
+				}
+				if(n==scenario.nb_nodes)
+				{
+					printf("no node %s\n", name);
+					break;
+				}
+
+				node_t * const node=&scenario.nodes[n];
+				if(filename[0] && strlen(filename)>=SZ_FILENAME)
+				{
+					printf("filename too long\n");
+					break;
+				}
+				if(!filename[0])
+					strcpy(filename, node->firmware);
+
+				//the node keeps its firmware if the file can't be read
+				firmware_cache_t * cache=find_firmware(filename);
+				if(!cache && nb_firmwares==NB_FIRMWARES_MAX)
+				{
+					printf("too many different firmwares, increase NB_FIRMWARES_MAX\n");
+					break;
+				}
+				if(!cache)
+					cache=new_firmware(filename);
+				else if(!strcmp(filename, node->firmware) && !read_firmware(cache)) //same file again, it has probably changed
+					cache=NULL;
+				if(!cache)
+				{
+					printf("elf_read_firmware %s failed\n", filename);
+					break;
+				}
+				strcpy(node->firmware, filename);
+				reload_node(node, cache);
+				*state=cpu_Running; //a crashed node can continue with a fixed firmware
+				break;
+			}
+
+			case 'm':
+			{
+				char name[64]="";
+				if(sscanf(line+1, "%63s", name)!=1)
+				{
+					printf("use m <node>\n");
+					break;
+				}
+
+				uint16_t n;
+				for(n=0; n<scenario.nb_nodes; n++)
+				{
+					if(!strcmp(scenario.nodes[n].name, name))
+						break;
+				}
+				if(n==scenario.nb_nodes)
+				{
+					printf("no node %s\n", name);
+					break;
+				}
+
+				set_model(&scenario.nodes[n], !scenario.nodes[n].model);
+				break;
+			}
+
+			case 'l':
+			{
+				uint8_t i;
+				for(i=0; i<timetravel->nb_checkpoints; i++)
+					printf("checkpoint %u: %.3fms\n", i, timetravel->checkpoints[i].time_ns/1E6);
+				break;
+			}
+
+			case 'q':
+				return false;
+
+			default:
+				break;
+		}
+	}
+}
+
+static void run_order_sift_down(uint16_t pos)
+{
+	const run_order_t entry=run_order[pos];
+
+	while(1)
+	{
+		uint16_t child=2*pos+1;
+		if(child>=scenario.nb_nodes)
+			break;
+		if(child+1<scenario.nb_nodes && run_order[child+1].now_ns<run_order[child].now_ns)
+			child++;
+		if(entry.now_ns<=run_order[child].now_ns)
+			break;
+		run_order[pos]=run_order[child];
+		pos=child;
+	}
+	run_order[pos]=entry;
+}
+
+static void run_order_build(void)
+{
+	uint16_t i;
+	for(i=0; i<scenario.nb_nodes; i++)
+	{
+		run_order[i].node=&scenario.nodes[i];
+		run_order[i].now_ns=avr_cycles_to_nsec(scenario.nodes[i].avr, scenario.nodes[i].avr->cycle);
+	}
+	for(i=scenario.nb_nodes/2; i>0; i--)
+		run_order_sift_down(i-1);
+}
+
+static int run_network(void)
+{
+	uint64_t now_ns;
+	uint64_t next_pacing_ns=0;
+	uint64_t next_watch_ns=0;
+	uint64_t last_watch_wall_ns=0;
+	int state=cpu_Running;
+
+	pause_at_ns=(uint64_t)scenario.time_ms*1000000;
+	next_checkpoint_ns=0;
+
+	if(scenario.checkpoint_ms)
+		supervise();
+
+	pacing_rebase(0);
+	run_order_build();
+
+	while(1)
+	{
+		//always run the AVR that is behind in simulated time
+		node_t * const behind=run_order[0].node;
+		now_ns=run_order[0].now_ns;
+
+		if(scenario.checkpoint_ms && now_ns>=next_checkpoint_ns)
+		{
+			next_checkpoint_ns=now_ns+(uint64_t)scenario.checkpoint_ms*1000000;
+			take_checkpoint(now_ns);
+		}
+
+		const bool avr_stopped=(state==cpu_Done || state==cpu_Crashed);
+		if(avr_stopped || !run || (pause_at_ns && now_ns>=pause_at_ns) || nRF_done(NULL))
+		{
+			if(!scenario.checkpoint_ms || !prompt(now_ns, &state))
+				break;
+
+			run=true;
+			pacing_rebase(now_ns);
+			run_order_build(); //the prompt can change nodes
+			continue;
+		}
+
+		if(next_switch<scenario.nb_switches && now_ns>=scenario.switches[next_switch].at_ns)
+			apply_switches(now_ns);
+
+		if(scenario.watch_firmware && now_ns>=next_watch_ns)
+		{
+			next_watch_ns=now_ns+WATCH_INTERVAL_NS;
+			if(monotonic_ns()-last_watch_wall_ns>=WATCH_PERIOD_NS)
+			{
+				last_watch_wall_ns=monotonic_ns();
+				watch_firmwares();
+			}
+		}
+
+		if(scenario.realtime && now_ns>=next_pacing_ns)
+		{
+			pace(now_ns);
+			next_pacing_ns=now_ns+PACING_INTERVAL_NS;
+		}
+
+		if(behind->host)
+			run_host(behind);
+		else if(behind->model)
+			run_timers(behind, UINT64_MAX);
+		else
+		{
+			state=avr_run(behind->avr);
+			if(state==cpu_Done || state==cpu_Crashed)
+				printf("node %s: AVR %s\n", behind->name, state==cpu_Done?"done":"crashed");
+		}
+
+		run_order[0].now_ns=avr_cycles_to_nsec(behind->avr, behind->avr->cycle);
+		run_order_sift_down(0);
+	}
+
+	if(scenario.realtime)
+		print_lag();
+
+	int result;
+	if(nRF_done(&result))
+		return result;
+
+	return state==cpu_Crashed;
+}
+
+int main(int argc, char ** argv)
+{
+	if(argc!=2)
+		errx(1, "usage: %s scenario.txt", argv[0]);
+
+	signal(SIGINT, &sigint_handler);
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	parse_scenario(argv[1]);
+	build_network();
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("%u nodes (%u different firmwares) built in %.3fs\n", scenario.nb_nodes, nb_firmwares, (end.tv_sec-start.tv_sec)+(end.tv_nsec-start.tv_nsec)/1E9);
+
+	printf("starting simulation - interrupt with Ctrl+C\n");
+
+	nRF_profile(scenario.profile);
+
+	int ret=run_network();
+
+	uint16_t i;
+	for(i=0; i<scenario.nb_nodes; i++)
+	{
+		if(scenario.nodes[i].host)
+		{
+			if(scenario.nodes[i].fd>=0)
+				close(scenario.nodes[i].fd);
+			close(scenario.nodes[i].fd_listen);
+			unlink(scenario.nodes[i].socket);
+		}
+		avr_terminate(scenario.nodes[i].avr);
+	}
+
+	nRF_cleanup();
+
+	printf("simulation finished\n");
+
+	return ret;
+}
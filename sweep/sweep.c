@@ -0,0 +1,504 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <err.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_time.h"
+#include "avr_spi.h"
+#include "avr_ioport.h"
+
+#include "nRF.h"
+#include "nRF_defs.h"
+
+/*
+This is a parameter sweep runner for simavr-nRF24. It runs the same firmware with every combination of the parameters given in a grid file and prints one line of statistics per combination.
+
+Every point of the grid is simulated in its own process (the state of simavr-nRF24 is global), up to one process per core at the same time.
+
+Please read the fine manual.
+
+(c) 2022 by kittennbfive
+
+AGPLv3+ and NO WARRANTY!
+*/
+
+#define SZ_AXIS_MAX 16
+#define SZ_FILENAME 128
+
+#define OVERRIDE_NONE -1 //keep what the firmware writes
+
+typedef struct
+{
+	char ptx[SZ_FILENAME];
+	char prx[SZ_FILENAME];
+	elf_firmware_t * ptx_image; //read once by the parent, inherited by every worker
+	elf_firmware_t * prx_image;
+} firmware_pair_t;
+
+typedef struct
+{
+	uint32_t lost_packets[SZ_AXIS_MAX];
+	uint8_t nb_lost_packets;
+	uint32_t lost_acks[SZ_AXIS_MAX];
+	uint8_t nb_lost_acks;
+	int8_t ard[SZ_AXIS_MAX];
+	uint8_t nb_ard;
+	int8_t arc[SZ_AXIS_MAX];
+	uint8_t nb_arc;
+	int32_t data_rate[SZ_AXIS_MAX]; //kbps
+	uint8_t nb_data_rate;
+	firmware_pair_t firmware[SZ_AXIS_MAX];
+	uint8_t nb_firmware;
+	uint16_t nodes[SZ_AXIS_MAX];
+	uint8_t nb_nodes;
+	uint32_t time_ms;
+} grid_t;
+
+typedef struct
+{
+	uint32_t lost_packets;
+	uint32_t lost_acks;
+	int8_t ard;
+	int8_t arc;
+	int32_t data_rate;
+	uint8_t firmware;
+	uint16_t nodes;
+} point_t;
+
+typedef struct
+{
+	bool done;
+	uint32_t nb_packets_sent;
+	uint32_t nb_retransmissions;
+	uint32_t nb_max_rt;
+	uint32_t nb_packets_received;
+	uint32_t nb_acks_sent;
+	uint32_t nb_acks_received;
+	uint32_t nb_lost;
+	uint32_t nb_duplicates;
+	double time_ms;
+} result_t;
+
+static grid_t grid;
+
+static void grid_defaults(void)
+{
+	memset(&grid, 0, sizeof(grid_t));
+	grid.lost_packets[grid.nb_lost_packets++]=0;
+	grid.lost_acks[grid.nb_lost_acks++]=0;
+	grid.ard[grid.nb_ard++]=OVERRIDE_NONE;
+	grid.arc[grid.nb_arc++]=OVERRIDE_NONE;
+	grid.data_rate[grid.nb_data_rate++]=OVERRIDE_NONE;
+	strcpy(grid.firmware[0].ptx, "avr1.elf");
+	strcpy(grid.firmware[0].prx, "avr2.elf");
+	grid.nb_firmware=1;
+	grid.nodes[grid.nb_nodes++]=1;
+	grid.time_ms=1000;
+}
+
+static int32_t parse_override(char const * const value, const int32_t max, char const * const key)
+{
+	if(!strcmp(value, "fw"))
+		return OVERRIDE_NONE;
+
+	char * end;
+	long v=strtol(value, &end, 10);
+	if(*end!='\0' || v<0 || v>max)
+		errx(1, "invalid value \"%s\" for %s", value, key);
+	return v;
+}
+
+static uint32_t parse_number(char const * const value, char const * const key)
+{
+	char * end;
+	errno=0;
+	unsigned long v=strtoul(value, &end, 10);
+	if(value[0]<'0' || value[0]>'9' || *end!='\0' || errno || v>UINT32_MAX)
+		errx(1, "invalid value \"%s\" for %s", value, key);
+	return v;
+}
+
+static int32_t parse_data_rate(char const * const value)
+{
+	if(!strcmp(value, "fw"))
+		return OVERRIDE_NONE;
+	if(!strcmp(value, "250k"))
+		return 250;
+	if(!strcmp(value, "1M"))
+		return 1000;
+	if(!strcmp(value, "2M"))
+		return 2000;
+	errx(1, "invalid data rate \"%s\", use 250k, 1M, 2M or fw", value);
+}
+
+static void parse_grid(char const * const filename)
+{
+	FILE * f=fopen(filename, "r");
+	if(f==NULL)
+		err(1, "opening grid %s failed", filename);
+
+	char line[512];
+	uint32_t nb_line=0;
+	while(fgets(line, sizeof(line), f))
+	{
+		nb_line++;
+
+		char * key=strtok(line, " \t\r\n");
+		if(key==NULL || key[0]=='#')
+			continue;
+
+		uint8_t nb_values=0;
+		char * value;
+		while((value=strtok(NULL, " \t\r\n")))
+		{
+			if(nb_values==SZ_AXIS_MAX)
+				errx(1, "%s:%u: too many values, increase SZ_AXIS_MAX", filename, nb_line);
+
+			if(!strcmp(key, "lost_packets"))
+				grid.lost_packets[nb_values]=parse_number(value, key);
+			else if(!strcmp(key, "lost_acks"))
+				grid.lost_acks[nb_values]=parse_number(value, key);
+			else if(!strcmp(key, "ard"))
+				grid.ard[nb_values]=parse_override(value, 15, key);
+			else if(!strcmp(key, "arc"))
+				grid.arc[nb_values]=parse_override(value, 15, key);
+			else if(!strcmp(key, "data_rate"))
+				grid.data_rate[nb_values]=parse_data_rate(value);
+			else if(!strcmp(key, "firmware"))
+			{
+				char * sep=strchr(value, ':');
+				if(sep==NULL || strlen(value)>=SZ_FILENAME)
+					errx(1, "%s:%u: invalid firmware \"%s\", use ptx.elf:prx.elf", filename, nb_line, value);
+				*sep='\0';
+				strcpy(grid.firmware[nb_values].ptx, value);
+				strcpy(grid.firmware[nb_values].prx, sep+1);
+			}
+			else if(!strcmp(key, "nodes"))
+			{
+				int32_t nodes=parse_override(value, NB_NRF_MAX-1, key);
+				if(nodes<1)
+					errx(1, "%s:%u: invalid number of nodes \"%s\" (1 to %u, increase NB_NRF_MAX in nRF_config.h for more)", filename, nb_line, value, NB_NRF_MAX-1);
+				grid.nodes[nb_values]=nodes;
+			}
+			else if(!strcmp(key, "time_ms"))
+				grid.time_ms=parse_number(value, key);
+			else
+				errx(1, "%s:%u: unknown parameter \"%s\"", filename, nb_line, key);
+
+			nb_values++;
+		}
+
+		if(nb_values==0)
+			errx(1, "%s:%u: no values for \"%s\"", filename, nb_line, key);
+
+		if(!strcmp(key, "lost_packets"))
+			grid.nb_lost_packets=nb_values;
+		else if(!strcmp(key, "lost_acks"))
+			grid.nb_lost_acks=nb_values;
+		else if(!strcmp(key, "ard"))
+			grid.nb_ard=nb_values;
+		else if(!strcmp(key, "arc"))
+			grid.nb_arc=nb_values;
+		else if(!strcmp(key, "data_rate"))
+			grid.nb_data_rate=nb_values;
+		else if(!strcmp(key, "firmware"))
+			grid.nb_firmware=nb_values;
+		else if(!strcmp(key, "nodes"))
+			grid.nb_nodes=nb_values;
+	}
+
+	fclose(f);
+}
+
+static uint32_t grid_nb_points(void)
+{
+	return grid.nb_lost_packets*grid.nb_lost_acks*grid.nb_ard*grid.nb_arc*grid.nb_data_rate*grid.nb_firmware*grid.nb_nodes;
+}
+
+static void grid_point(uint32_t index, point_t * const point)
+{
+	point->lost_packets=grid.lost_packets[index%grid.nb_lost_packets];
+	index/=grid.nb_lost_packets;
+	point->lost_acks=grid.lost_acks[index%grid.nb_lost_acks];
+	index/=grid.nb_lost_acks;
+	point->ard=grid.ard[index%grid.nb_ard];
+	index/=grid.nb_ard;
+	point->arc=grid.arc[index%grid.nb_arc];
+	index/=grid.nb_arc;
+	point->data_rate=grid.data_rate[index%grid.nb_data_rate];
+	index/=grid.nb_data_rate;
+	point->firmware=index%grid.nb_firmware;
+	index/=grid.nb_firmware;
+	point->nodes=grid.nodes[index%grid.nb_nodes];
+}
+
+static void cb_count(const nRF_event_t event, nRF_t const * const nRF, nRF_t const * const peer, packet_tx_t const * const packet, void * param)
+{
+	(void)event;
+	(void)nRF;
+	(void)peer;
+	(void)packet;
+	(*(uint32_t*)param)++;
+}
+
+static void override_config(nRF_t * const nRF, point_t const * const point)
+{
+	uint8_t mask=0, value=0;
+	if(point->ard!=OVERRIDE_NONE)
+	{
+		mask|=(0b1111<<ARD);
+		value|=(point->ard<<ARD);
+	}
+	if(point->arc!=OVERRIDE_NONE)
+	{
+		mask|=(0b1111<<ARC);
+		value|=(point->arc<<ARC);
+	}
+	if(mask)
+		nRF_override_register(nRF, REG_SETUP_RETR, mask, value);
+
+	switch(point->data_rate)
+	{
+		case 250: nRF_override_register(nRF, REG_RF_SETUP, (1<<RF_DR_LOW)|(1<<RF_DR_HIGH), (1<<RF_DR_LOW)); break;
+		case 1000: nRF_override_register(nRF, REG_RF_SETUP, (1<<RF_DR_LOW)|(1<<RF_DR_HIGH), 0); break;
+		case 2000: nRF_override_register(nRF, REG_RF_SETUP, (1<<RF_DR_LOW)|(1<<RF_DR_HIGH), (1<<RF_DR_HIGH)); break;
+	}
+}
+
+static elf_firmware_t * read_firmware(char const * const filename)
+{
+	elf_firmware_t * firmware=calloc(1, sizeof(elf_firmware_t));
+	if(!firmware)
+		err(1, "allocating firmware %s failed", filename);
+
+	if(elf_read_firmware(filename, firmware))
+		errx(1, "elf_read_firmware %s failed", filename);
+
+	return firmware;
+}
+
+static elf_firmware_t * get_firmware(char const * const filename, const uint8_t nb_pairs) //nb_pairs: pairs already read
+{
+	uint8_t i;
+	for(i=0; i<nb_pairs; i++)
+	{
+		if(!strcmp(grid.firmware[i].ptx, filename))
+			return grid.firmware[i].ptx_image;
+		if(!strcmp(grid.firmware[i].prx, filename))
+			return grid.firmware[i].prx_image;
+	}
+
+	return read_firmware(filename);
+}
+
+static void read_firmwares(void) //each file once, the workers only load the images
+{
+	uint8_t i;
+	for(i=0; i<grid.nb_firmware; i++)
+	{
+		firmware_pair_t * const pair=&grid.firmware[i];
+		pair->ptx_image=get_firmware(pair->ptx, i);
+		pair->prx_image=strcmp(pair->prx, pair->ptx)?get_firmware(pair->prx, i):pair->ptx_image;
+	}
+}
+
+static avr_t * make_avr(elf_firmware_t * const firmware, const uint32_t frequency)
+{
+	avr_t * avr=avr_make_mcu_by_name("atmega328p");
+	if(!avr)
+		errx(1, "avr_make_mcu_by_name failed");
+
+	avr_init(avr);
+	avr->frequency=frequency;
+	avr_load_firmware(avr, firmware);
+
+	return avr;
+}
+
+static nRF_t * make_node(avr_t * avr, char const * const name, point_t const * const point)
+{
+	nRF_t * nRF=make_new_nRF();
+	nRF_init(avr, nRF, name);
+	nRF_connect(nRF, avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('D'), 5), avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('D'), 7));
+	override_config(nRF, point);
+
+	nRF_connect_spi(nRF, avr_io_getirq(avr, AVR_IOCTL_SPI_GETIRQ(0), SPI_IRQ_OUTPUT), avr_io_getirq(avr, AVR_IOCTL_SPI_GETIRQ(0), SPI_IRQ_INPUT), avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('D'), 6));
+
+	return nRF;
+}
+
+static void run_point(point_t const * const point, result_t * const result)
+{
+	//the firmwares and nRF print a lot, only the table is wanted
+	if(freopen("/dev/null", "w", stdout)==NULL)
+		err(1, "freopen");
+
+	avr_t * avr[NB_NRF_MAX];
+	nRF_t * nRF[NB_NRF_MAX];
+	uint16_t nb_avr=point->nodes+1;
+	uint16_t i;
+
+	//same clocks as in /example: PTX 10MHz, PRX 8MHz
+	avr[0]=make_avr(grid.firmware[point->firmware].prx_image, 8000000);
+	for(i=1; i<nb_avr; i++)
+		avr[i]=make_avr(grid.firmware[point->firmware].ptx_image, 10000000);
+
+	nRF_global_init();
+	nRF_stop_on_error(true);
+	nRF_set_log_level(NRF_LOG_ERROR);
+	nRF_set_lost_packets(point->lost_packets, point->lost_acks);
+	nRF_register_event_callback(NRF_EVENT_PACKET_LOST, &cb_count, &result->nb_lost);
+	nRF_register_event_callback(NRF_EVENT_DUPLICATE_DROPPED, &cb_count, &result->nb_duplicates);
+
+	char name[NRF_SZ_NAME];
+	for(i=0; i<nb_avr; i++)
+	{
+		snprintf(name, NRF_SZ_NAME, i?"PTX%u":"PRX", i);
+		nRF[i]=make_node(avr[i], name, point);
+	}
+
+	const uint64_t end_ns=(uint64_t)grid.time_ms*1000000;
+	uint64_t now_ns;
+	int state;
+	do
+	{
+		//always run the AVR that is behind in simulated time
+		uint16_t behind=0;
+		now_ns=avr_cycles_to_nsec(avr[0], avr[0]->cycle);
+		for(i=1; i<nb_avr; i++)
+		{
+			uint64_t t=avr_cycles_to_nsec(avr[i], avr[i]->cycle);
+			if(t<now_ns)
+			{
+				now_ns=t;
+				behind=i;
+			}
+		}
+		state=avr_run(avr[behind]);
+	} while(state!=cpu_Done && state!=cpu_Crashed && now_ns<end_ns);
+
+	for(i=1; i<nb_avr; i++)
+	{
+		result->nb_packets_sent+=nRF[i]->cold->stats.nb_packets_sent;
+		result->nb_retransmissions+=nRF[i]->cold->stats.nb_retransmissions;
+		result->nb_max_rt+=nRF[i]->cold->stats.nb_max_rt;
+		result->nb_acks_received+=nRF[i]->cold->stats.nb_acks_received;
+	}
+	result->nb_packets_received=nRF[0]->cold->stats.nb_packets_received;
+	result->nb_acks_sent=nRF[0]->cold->stats.nb_acks_sent;
+	result->time_ms=now_ns/1E6;
+	result->done=(state!=cpu_Crashed);
+
+	for(i=0; i<nb_avr; i++)
+		avr_terminate(avr[i]);
+
+	nRF_cleanup();
+}
+
+static void format_override(char * const buf, const size_t sz, const int32_t value)
+{
+	if(value==OVERRIDE_NONE)
+		snprintf(buf, sz, "fw");
+	else
+		snprintf(buf, sz, "%d", value);
+}
+
+static void print_result(const uint32_t index, result_t const * const result)
+{
+	point_t point;
+	grid_point(index, &point);
+
+	char ard[12], arc[12], data_rate[12];
+	format_override(ard, sizeof(ard), point.ard);
+	format_override(arc, sizeof(arc), point.arc);
+	format_override(data_rate, sizeof(data_rate), point.data_rate);
+
+	printf("%u,%u,%u,%s,%s,%s,%s:%s,%u,", index, point.lost_packets, point.lost_acks, ard, arc, data_rate, grid.firmware[point.firmware].ptx, grid.firmware[point.firmware].prx, point.nodes);
+
+	if(!result->done)
+	{
+		printf("failed,,,,,,,,\n");
+		return;
+	}
+
+	printf("%.3f,%u,%u,%u,%u,%u,%u,%u,%u\n", result->time_ms, result->nb_packets_sent, result->nb_retransmissions, result->nb_max_rt, \
+			result->nb_packets_received, result->nb_acks_sent, result->nb_acks_received, result->nb_lost, result->nb_duplicates);
+}
+
+int main(int argc, char ** argv)
+{
+	long nb_workers=sysconf(_SC_NPROCESSORS_ONLN);
+
+	int opt;
+	while((opt=getopt(argc, argv, "j:"))!=-1)
+	{
+		if(opt=='j')
+			nb_workers=strtol(optarg, NULL, 10);
+		else
+			errx(1, "usage: %s [-j workers] grid.txt", argv[0]);
+	}
+
+	if(optind!=argc-1 || nb_workers<1)
+		errx(1, "usage: %s [-j workers] grid.txt", argv[0]);
+
+	grid_defaults();
+	parse_grid(argv[optind]);
+	read_firmwares();
+
+	const uint32_t nb_points=grid_nb_points();
+
+	//results are written by the workers directly into shared memory
+	result_t * results=mmap(NULL, nb_points*sizeof(result_t), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if(results==MAP_FAILED)
+		err(1, "mmap");
+	memset(results, 0, nb_points*sizeof(result_t));
+
+	fprintf(stderr, "sweep: %u points on %ld workers, %ums simulated each\n", nb_points, nb_workers, grid.time_ms);
+
+	uint32_t next=0, finished=0;
+	long running=0;
+	while(finished<nb_points)
+	{
+		while(running<nb_workers && next<nb_points)
+		{
+			fflush(stdout);
+			pid_t pid=fork();
+			if(pid<0)
+				err(1, "fork");
+			if(pid==0)
+			{
+				point_t point;
+				grid_point(next, &point);
+				run_point(&point, &results[next]);
+				_exit(0);
+			}
+			next++;
+			running++;
+		}
+
+		int status;
+		if(wait(&status)<0)
+			err(1, "wait");
+		running--;
+		finished++;
+		fprintf(stderr, "\rsweep: %u/%u done", finished, nb_points);
+	}
+	fprintf(stderr, "\n");
+
+	printf("index,lost_packets,lost_acks,ard,arc,data_rate_kbps,firmware,nodes,time_ms,packets_sent,retransmissions,max_rt,packets_received,acks_sent,acks_received,lost,duplicates\n");
+	uint32_t i;
+	for(i=0; i<nb_points; i++)
+		print_result(i, &results[i]);
+
+	munmap(results, nb_points*sizeof(result_t));
+
+	return 0;
+}